@@ -1,4 +1,9 @@
+from concurrent.futures import Future
+from typing import Iterator
+from typing import List
+from typing import Optional
 from typing import Tuple
+from typing import Union
 
 import numpy as np
 
@@ -6,15 +11,29 @@ from _pynear import BKTreeBinaryIndex64
 from _pynear import BKTreeBinaryIndex128
 from _pynear import BKTreeBinaryIndex256
 from _pynear import BKTreeBinaryIndex512
+from _pynear import BKTreeBinaryIndex1024
 from _pynear import BKTreeBinaryIndex as BKTreeBinaryIndexN
+from _pynear import BruteForceInnerProductIndex
+from _pynear import BruteForceL2Index
 from _pynear import VPTreeBinaryIndex64
 from _pynear import VPTreeBinaryIndex128
 from _pynear import VPTreeBinaryIndex256
 from _pynear import VPTreeBinaryIndex512
+from _pynear import VPTreeBinaryIndex1024
 from _pynear import VPTreeBinaryIndex as VPTreeBinaryIndexN
+from _pynear import VPTreeChebyshevFloat64Index
 from _pynear import VPTreeChebyshevIndex
+from _pynear import VPTreeChebyshevInt16Index
+from _pynear import VPTreeChebyshevInt32Index
+from _pynear import VPTreeL1Float64Index
 from _pynear import VPTreeL1Index
+from _pynear import VPTreeL1Int16Index
+from _pynear import VPTreeL1Int32Index
+from _pynear import VPTreeL2Float64Index
 from _pynear import VPTreeL2Index
+from _pynear import VPTreeL2Int16Index
+from _pynear import VPTreeL2Int32Index
+from _pynear import simd_level
 
 from ._version import __version__
 
@@ -23,12 +42,16 @@ class VPTreeBinaryIndex:
     def __init__(self) -> None:
         self._index = None
         self._dimension = None
+        self._num_threads = 0
+        self._work_stealing = True
 
     def set(self, data: np.ndarray) -> None:
         self._validate(data)
 
         dim = data.shape[1]
-        if dim == 64:
+        if dim == 128:
+            self._index = VPTreeBinaryIndex1024()
+        elif dim == 64:
             self._index = VPTreeBinaryIndex512()
         elif dim == 32:
             self._index = VPTreeBinaryIndex256()
@@ -40,9 +63,32 @@ class VPTreeBinaryIndex:
             self._index = VPTreeBinaryIndexN()
 
         self._dimension = dim
+        self._index.set_num_threads(self._num_threads, self._work_stealing)
         self._index.set(data)
 
-    def searchKNN(self, queries: np.ndarray, k: int) -> Tuple[list, list]:
+    def set_num_threads(self, num_threads: int, work_stealing: bool = True) -> None:
+        self._num_threads = num_threads
+        self._work_stealing = work_stealing
+        if self._index is not None:
+            self._index.set_num_threads(num_threads, work_stealing)
+
+    def num_threads(self) -> int:
+        if self._index is None:
+            return self._num_threads
+
+        return self._index.num_threads()
+
+    def searchKNN(
+        self,
+        queries: np.ndarray,
+        k: int,
+        best_first: bool = False,
+        max_radius: Optional[int] = None,
+        allowed: Optional[np.ndarray] = None,
+        allowed_ranges: Optional[List[List[Tuple[int, int]]]] = None,
+        out: Optional[Tuple[np.ndarray, np.ndarray]] = None,
+        reorder_queries: bool = False,
+    ) -> Tuple[np.ndarray, np.ndarray]:
         dim = queries.shape[1]
         if dim != self._dimension:
             raise ValueError(
@@ -53,15 +99,137 @@ class VPTreeBinaryIndex:
             return [], []
 
         self._validate(queries)
-        return self._index.searchKNN(queries, k)
+        return self._index.searchKNN(queries, k, best_first, max_radius, allowed, allowed_ranges, out, reorder_queries)
+
+    def searchKNNApprox(
+        self,
+        queries: np.ndarray,
+        k: int,
+        epsilon: float = 0.0,
+        max_distance_evaluations: Optional[int] = None,
+        max_visited_nodes: Optional[int] = None,
+        time_budget: Optional[float] = None,
+        query_time_budget: Optional[float] = None,
+        best_first: bool = False,
+    ) -> Tuple[np.ndarray, np.ndarray, np.ndarray]:
+        dim = queries.shape[1]
+        if dim != self._dimension:
+            raise ValueError(
+                f"invalid data dimension: index built data and query data dimensions must agree, index built data dimension is {dim}"
+            )
+
+        if self._index is None:
+            return [], [], []
+
+        self._validate(queries)
+        return self._index.searchKNNApprox(
+            queries, k, epsilon, max_distance_evaluations, max_visited_nodes, time_budget, query_time_budget, best_first
+        )
+
+    def searchRadius(
+        self, queries: np.ndarray, radius: Union[int, np.ndarray]
+    ) -> Tuple[np.ndarray, np.ndarray, np.ndarray]:
+        dim = queries.shape[1]
+        if dim != self._dimension:
+            raise ValueError(
+                f"invalid data dimension: index built data and query data dimensions must agree, index built data dimension is {dim}"
+            )
+
+        if self._index is None:
+            empty = np.array([], dtype=np.int64)
+            return np.zeros(len(queries) + 1, dtype=np.int64), empty, empty
+
+        self._validate(queries)
+        return self._index.searchRadius(queries, radius)
+
+    def searchKNNBatched(self, queries: np.ndarray, k: int, block_size: int = 32) -> Tuple[np.ndarray, np.ndarray]:
+        dim = queries.shape[1]
+        if dim != self._dimension:
+            raise ValueError(
+                f"invalid data dimension: index built data and query data dimensions must agree, index built data dimension is {dim}"
+            )
 
-    def search1NN(self, queries: np.ndarray) -> Tuple[list, list]:
+        if self._index is None:
+            return [], []
+
+        self._validate(queries)
+        return self._index.searchKNNBatched(queries, k, block_size)
+
+    def searchKNNDualTree(self, queries: np.ndarray, k: int, block_size: int = 32) -> Tuple[np.ndarray, np.ndarray]:
+        dim = queries.shape[1]
+        if dim != self._dimension:
+            raise ValueError(
+                f"invalid data dimension: index built data and query data dimensions must agree, index built data dimension is {dim}"
+            )
+
+        if self._index is None:
+            return [], []
+
+        self._validate(queries)
+        return self._index.searchKNNDualTree(queries, k, block_size)
+
+    def knn_graph(self, k: int, exclude_self: bool = True) -> Tuple[np.ndarray, np.ndarray]:
+        if self._index is None:
+            return np.zeros((0, k), dtype=np.int64), np.zeros((0, k), dtype=np.int64)
+
+        return self._index.knn_graph(k, exclude_self)
+
+    def iter_neighbors(self, query: np.ndarray, chunk_size: int = 16) -> Iterator[Tuple[np.ndarray, np.ndarray]]:
+        if len(query.shape) != 1 or query.shape[0] != self._dimension:
+            raise ValueError(
+                f"invalid data dimension: index built data and query data dimensions must agree, index built data dimension is {self._dimension}"
+            )
+
+        if self._index is None:
+            return iter([])
+
+        self._validate(query[np.newaxis])
+        return self._index.iter_neighbors(query, chunk_size)
+
+    def submit(self, queries: np.ndarray, k: int) -> Future:
+        dim = queries.shape[1]
+        if dim != self._dimension:
+            raise ValueError(
+                f"invalid data dimension: index built data and query data dimensions must agree, index built data dimension is {dim}"
+            )
+
+        if self._index is None:
+            future = Future()
+            future.set_result(([], []))
+            return future
+
+        self._validate(queries)
+        return self._index.submit(queries, k)
+
+    def search1NN(self, queries: np.ndarray) -> Tuple[np.ndarray, np.ndarray]:
         if self._index is None:
             return [], []
 
         self._validate(queries)
         return self._index.search1NN(queries)
 
+    def searchKNNStats(
+        self, queries: np.ndarray, k: int, best_first: bool = False, aggregate: bool = False
+    ) -> Tuple[np.ndarray, np.ndarray, np.ndarray]:
+        dim = queries.shape[1]
+        if dim != self._dimension:
+            raise ValueError(
+                f"invalid data dimension: index built data and query data dimensions must agree, index built data dimension is {dim}"
+            )
+
+        if self._index is None:
+            return [], [], []
+
+        self._validate(queries)
+        return self._index.searchKNNStats(queries, k, best_first, aggregate)
+
+    def search1NNStats(self, queries: np.ndarray, aggregate: bool = False) -> Tuple[np.ndarray, np.ndarray, np.ndarray]:
+        if self._index is None:
+            return [], [], []
+
+        self._validate(queries)
+        return self._index.search1NNStats(queries, aggregate)
+
     def _validate(self, data: np.ndarray) -> None:
         if len(data.shape) != 2:
             raise ValueError("invalid data shape: binary indexes must be 2D")
@@ -79,7 +247,9 @@ class BKTreeBinaryIndex:
         self._validate(data)
 
         dim = data.shape[1]
-        if dim == 64:
+        if dim == 128:
+            self._index = BKTreeBinaryIndex1024()
+        elif dim == 64:
             self._index = BKTreeBinaryIndex512()
         elif dim == 32:
             self._index = BKTreeBinaryIndex256()
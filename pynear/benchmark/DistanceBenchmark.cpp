@@ -0,0 +1,156 @@
+/*
+ *  MIT Licence
+ *  Copyright 2021 Pablo Carneiro Elias
+ */
+
+/*
+ *  Microbenchmarks of the distance kernels of every instruction set level the CPU supports: nanoseconds per distance
+ *  between a query and a set of points small enough to stay in cache, so the numbers compare the kernels themselves.
+ *
+ *      distance-benchmark [number of points]
+ */
+
+#include <CpuFeatures.hpp>
+#include <DistanceFunctions.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using vptree::SimdLevel;
+
+// Best time of a few runs of computing the distance of the query to every point, in nanoseconds per distance
+template <typename Distance> static double nanosecondsPerDistance(size_t numPoints, Distance distance) {
+    constexpr int runs = 5;
+    constexpr int repeats = 200;
+    double best = std::numeric_limits<double>::max();
+    volatile double sink = 0;
+    for (int run = 0; run < runs; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        double sum = 0;
+        for (int repeat = 0; repeat < repeats; ++repeat) {
+            for (size_t i = 0; i < numPoints; ++i) {
+                sum += distance(i);
+            }
+        }
+        const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        sink = sink + sum;
+        best = std::min(best, elapsed.count() / (repeats * numPoints));
+    }
+    return best;
+}
+
+static std::vector<SimdLevel> supportedLevels() {
+    std::vector<SimdLevel> levels;
+    for (SimdLevel level : {SimdLevel::Generic, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (level <= vptree::detectSimdLevel()) {
+            levels.push_back(level);
+        }
+    }
+    return levels;
+}
+
+static void printHeader(const char *title) {
+    std::printf("\n%-24s", title);
+    for (SimdLevel level : supportedLevels()) {
+        std::printf("%10s", vptree::simdLevelName(level));
+    }
+    std::printf("\n");
+}
+
+static void benchmarkFloat(size_t numPoints) {
+    std::mt19937 generator(1);
+    std::normal_distribution<float> distribution;
+
+    printHeader("float kernels (ns)");
+    for (size_t dimension : {3, 16, 64, 100, 128, 300, 768}) {
+        std::vector<float> points(numPoints * dimension), query(dimension);
+        std::generate(points.begin(), points.end(), [&]() { return distribution(generator); });
+        std::generate(query.begin(), query.end(), [&]() { return distribution(generator); });
+
+        const char *names[] = {"l2", "l1", "chebyshev"};
+        for (int metric = 0; metric < 3; ++metric) {
+            std::printf("%-10s d=%-11zu", names[metric], dimension);
+            for (SimdLevel level : supportedLevels()) {
+                const DistanceKernels kernels = distanceKernelsFor(level);
+                auto kernel = metric == 0 ? kernels.l2Squared : metric == 1 ? kernels.l1 : kernels.chebyshev;
+                std::printf("%10.2f", nanosecondsPerDistance(numPoints, [&](size_t i) {
+                                return kernel(query.data(), points.data() + i * dimension, dimension);
+                            }));
+            }
+            std::printf("\n");
+        }
+    }
+}
+
+// L2 kernels of double, int16 and int32 vectors, all computed in double precision
+template <typename T> static void benchmarkFloat64(size_t numPoints, const char *title, const Float64Kernels<T> DistanceKernels::*member) {
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<double> distribution(-1000, 1000);
+
+    printHeader(title);
+    for (size_t dimension : {3, 16, 64, 128, 768}) {
+        std::vector<T> points(numPoints * dimension), query(dimension);
+        std::generate(points.begin(), points.end(), [&]() { return static_cast<T>(distribution(generator)); });
+        std::generate(query.begin(), query.end(), [&]() { return static_cast<T>(distribution(generator)); });
+
+        std::printf("%-10s d=%-11zu", "l2", dimension);
+        for (SimdLevel level : supportedLevels()) {
+            const Float64Kernels<T> kernels = distanceKernelsFor(level).*member;
+            std::printf("%10.2f", nanosecondsPerDistance(numPoints, [&](size_t i) {
+                            return kernels.l2Squared(query.data(), points.data() + i * dimension, dimension);
+                        }));
+        }
+        std::printf("\n");
+    }
+}
+
+static void benchmarkHamming(size_t numPoints) {
+    std::mt19937 generator(1);
+    std::uniform_int_distribution<int> distribution(0, 255);
+
+    printHeader("hamming kernels (ns)");
+    for (size_t bits : {64, 128, 256, 512, 1024, 2048}) {
+        const size_t size = bits / 8;
+        std::vector<uint8_t> points(numPoints * size), query(size);
+        std::generate(points.begin(), points.end(), [&]() { return distribution(generator); });
+        std::generate(query.begin(), query.end(), [&]() { return distribution(generator); });
+
+        // fixed size kernels where there is one, the kernel for any number of bytes otherwise
+        for (bool fixed : {true, false}) {
+            if (fixed && bits > 1024) {
+                continue;
+            }
+            std::printf("%-10s %-13s", fixed ? "fixed" : "any size", (std::to_string(bits) + " bits").c_str());
+            for (SimdLevel level : supportedLevels()) {
+                const DistanceKernels kernels = distanceKernelsFor(level);
+                auto fixedKernel = bits == 64    ? kernels.hamming64
+                                   : bits == 128 ? kernels.hamming128
+                                   : bits == 256 ? kernels.hamming256
+                                   : bits == 512 ? kernels.hamming512
+                                                 : kernels.hamming1024;
+                std::printf("%10.2f", nanosecondsPerDistance(numPoints, [&](size_t i) {
+                                const uint8_t *point = points.data() + i * size;
+                                return static_cast<double>(fixed ? fixedKernel(query.data(), point) : kernels.hamming(query.data(), point, size));
+                            }));
+            }
+            std::printf("\n");
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    const size_t numPoints = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256;
+    std::printf("selected level: %s, AVX-512 VPOPCNTDQ: %s\n", vptree::simdLevelName(activeDistanceKernels.level),
+                vptree::detectAvx512Popcount() ? "yes" : "no");
+    benchmarkFloat(numPoints);
+    benchmarkFloat64<double>(numPoints, "float64 kernels (ns)", &DistanceKernels::float64);
+    benchmarkFloat64<int16_t>(numPoints, "int16 kernels (ns)", &DistanceKernels::int16);
+    benchmarkFloat64<int32_t>(numPoints, "int32 kernels (ns)", &DistanceKernels::int32);
+    benchmarkHamming(numPoints);
+    return 0;
+}
@@ -37,6 +37,10 @@ class BenchmarkCase:
     dataset_num_clusters: int
     dataset_type: str = "float32"
 
+    # fraction of queries taken from the dataset points, which are much cheaper to search than the generated ones. They
+    # come after the generated queries, so that the search cost is skewed along the batch
+    dataset_query_ratio: float = 0.0
+
     def run(self):
         results = []
         for dimension in self.dimensions:
@@ -57,12 +61,15 @@ class BenchmarkCase:
                     logger.info("buiding index done")
                     logger.info("start performing queries")
                     for num_queries in self.num_queries:
+                        num_dataset_queries = int(num_queries * self.dataset_query_ratio)
                         query = generate_gaussian_dataset(
-                            num_queries,
+                            num_queries - num_dataset_queries,
                             1,
                             dimension,
                             data_type=np.dtype(self.dataset_type),
                         )
+                        dataset_queries = data[np.random.choice(len(data), num_dataset_queries, replace=False)]
+                        query = np.concatenate([query, dataset_queries], axis=0)
                         logger.info(f"start performing queries (num_queries = {num_queries})")
                         runs = np.array([index.clock_search(query, k_value) for _ in range(NUM_AVG_SEARCHS)])
                         logger.info(f"5 runs set: {runs}")
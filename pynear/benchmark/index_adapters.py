@@ -23,11 +23,13 @@ def create_index_adapter(index_name: str):
         "VPTreeL1Index": pynear.VPTreeL1Index,
         "VPTreeBinaryIndex": pynear.VPTreeBinaryIndex,
         "VPTreeChebyshevIndex": pynear.VPTreeChebyshevIndex,
+        "VPTreeL2IndexStaticSchedule": pynear.VPTreeL2Index,
+        "BruteForceL2Index": pynear.BruteForceL2Index,
     }
     if index_name not in mapper:
         raise ValueError(f"Index name {index_name} not supported")
 
-    if index_name.startswith("VPTree"):
+    if index_name.startswith(("VPTree", "BruteForce")):
         return PyNearAdapter(index_name)
 
     return mapper[index_name]()
@@ -61,10 +63,15 @@ class PyNearAdapter(IndexAdapter):
             "VPTreeBinaryIndex": pynear.VPTreeBinaryIndex,
             "VPTreeChebyshevIndex": pynear.VPTreeChebyshevIndex,
             "VPTreeL1Index": pynear.VPTreeL1Index,
+            "VPTreeL2IndexStaticSchedule": pynear.VPTreeL2Index,
+            "BruteForceL2Index": pynear.BruteForceL2Index,
         }
 
     def build_index(self, data: np.ndarray):
         self._index = self._pyvp_index_map[self._pyvp_index_name]()
+        if self._pyvp_index_name.endswith("StaticSchedule"):
+            # same index, only splitting queries evenly between threads, without work stealing
+            self._index.set_num_threads(0, work_stealing=False)
         self._index.set(data)
 
     def _search_implementation(self, query, k: int):
@@ -7,6 +7,10 @@
 
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
 #include <type_traits>
 #include <vector>
 
@@ -45,4 +49,60 @@ class BindingUtils {
                               std::move(offsets), // C-style contiguous strides for double
                               buffer, free_when_done);
     }
+
+    template <class T> static py::array_t<T> vectorToNumpyArray(std::vector<T> &&vec) {
+        /*
+         *  Moves the vector into a 1D numpy array without copying its data. The array takes over the ownership of the
+         *  vector buffer.
+         */
+
+        auto *owner = new std::vector<T>(std::move(vec));
+        py::capsule free_when_done(owner, [](void *rawvec) { delete reinterpret_cast<std::vector<T> *>(rawvec); });
+
+        return py::array_t<T>({owner->size()}, {sizeof(T)}, owner->data(), free_when_done);
+    }
+
+    template <class T> static py::array_t<T> vectorToNumpyArray(std::vector<T> &&vec, size_t rows, size_t cols) {
+        /*
+         *  Same as above, but for a row major 2D array of rows x cols elements.
+         */
+
+        auto *owner = new std::vector<T>(std::move(vec));
+        py::capsule free_when_done(owner, [](void *rawvec) { delete reinterpret_cast<std::vector<T> *>(rawvec); });
+
+        return py::array_t<T>({rows, cols}, {cols * sizeof(T), sizeof(T)}, owner->data(), free_when_done);
+    }
+
+    template <class T>
+    static std::tuple<py::array_t<int64_t>, py::array_t<T>> knnOutputArrays(const std::optional<py::tuple> &out, size_t rows, size_t cols) {
+        /*
+         *  Returns the rows x cols arrays of indices and distances that search results get written into: the given
+         *  (indices, distances) out arrays, or new ones. Out arrays are written in place, so they must be writeable, C
+         *  contiguous and have the exact dtype and shape.
+         */
+
+        if (!out.has_value()) {
+            return std::make_tuple(py::array_t<int64_t>({rows, cols}), py::array_t<T>({rows, cols}));
+        }
+        if (out->size() != 2) {
+            throw std::invalid_argument("out must be a tuple of (indices, distances) arrays");
+        }
+        return std::make_tuple(outputArray<int64_t>((*out)[0], rows, cols, "indices"), outputArray<T>((*out)[1], rows, cols, "distances"));
+    }
+
+    private:
+    template <class T> static py::array_t<T> outputArray(const py::object &object, size_t rows, size_t cols, const std::string &name) {
+        if (!py::array_t<T, py::array::c_style>::check_(object)) {
+            throw std::invalid_argument("out " + name + " must be a C contiguous array of " + py::str(py::dtype::of<T>()).cast<std::string>());
+        }
+
+        auto array = py::reinterpret_borrow<py::array_t<T>>(object);
+        if (array.ndim() != 2 || size_t(array.shape(0)) != rows || size_t(array.shape(1)) != cols) {
+            throw std::invalid_argument("out " + name + " must have shape (" + std::to_string(rows) + ", " + std::to_string(cols) + ")");
+        }
+        if (!array.writeable()) {
+            throw std::invalid_argument("out " + name + " must be writeable");
+        }
+        return array;
+    }
 };
@@ -0,0 +1,312 @@
+/*
+ *  MIT Licence
+ *  Copyright 2021 Pablo Carneiro Elias
+ */
+
+#pragma once
+
+// searches already run on the threads of ThreadPool, matrix products must not start OpenMP threads of their own
+#ifndef EIGEN_DONT_PARALLELIZE
+#define EIGEN_DONT_PARALLELIZE
+#endif
+
+#include <Eigen/Core>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "DistanceFunctions.hpp"
+#include "ISerializable.hpp"
+#include "KNNQueue.hpp"
+#include "ThreadPool.hpp"
+
+namespace vptree {
+
+enum class GemmMetric { L2, InnerProduct };
+
+using RowMatrixf = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+// Points per matrix product of gemmScan: a tile of products for a block of 64 queries fits in L2 cache
+constexpr size_t gemmTileSize = 256;
+
+// Buffers of gemmScan, reused from one call to the next
+struct GemmScratch {
+    RowMatrixf products;
+    RowMatrixf points;
+};
+
+/*
+ *  Brute force scan of all the points of a BruteForceIndex for a block of queries, merging every point into the knn queue
+ *  of each query.
+ *
+ *  For L2, queues get squared distances computed as ||q||² - 2 q·x + ||x||², where the q·x products come from one cache
+ *  blocked matrix product (GEMM) per tile of gemmTileSize points. That form cancels catastrophically for vectors far from
+ *  the origin, so queries and points are first moved by -center, usually the mean of the points: queries are given
+ *  moved, norms are those of the moved vectors, and points are moved tile by tile. Each tile is merged into the queues
+ *  right after its product, while it is still cached, so the distance matrix is never stored whole. For the inner
+ *  product, queues get -q·x, so the closest point is the one with the largest inner product, and center is unused.
+ *
+ *  queries is a (number of queries) x dimension matrix and points a numPoints x dimension row major buffer. Norms are
+ *  squared norms, unused for the inner product. Point i is pushed as index i.
+ */
+template <GemmMetric metric, typename KNNQueue>
+void gemmScan(const Eigen::Ref<const RowMatrixf> &queries, const float *queryNorms, const float *points, const float *pointNorms,
+              const float *center, size_t numPoints, KNNQueue *queues, GemmScratch &scratch) {
+    const Eigen::Index dimension = queries.cols();
+    for (size_t first = 0; first < numPoints; first += gemmTileSize) {
+        const size_t count = std::min(gemmTileSize, numPoints - first);
+        Eigen::Map<const RowMatrixf> tilePoints(points + first * dimension, count, dimension);
+        if constexpr (metric == GemmMetric::L2) {
+            scratch.points = tilePoints.rowwise() - Eigen::Map<const Eigen::RowVectorXf>(center, dimension);
+            scratch.products.noalias() = queries * scratch.points.transpose();
+        } else {
+            scratch.products.noalias() = queries * tilePoints.transpose();
+        }
+
+        for (Eigen::Index q = 0; q < queries.rows(); ++q) {
+            KNNQueue &queue = queues[q];
+            const float *products = scratch.products.data() + q * count;
+            // points are pushed until the queue is full, then only when closer than its farthest one
+            float tau = queue.full() ? queue.worst() : std::numeric_limits<float>::max();
+            for (size_t j = 0; j < count; ++j) {
+                float dist;
+                if constexpr (metric == GemmMetric::L2) {
+                    dist = queryNorms[q] + pointNorms[first + j] - 2 * products[j];
+                } else {
+                    dist = -products[j];
+                }
+                if (dist < tau) {
+                    queue.push(static_cast<int64_t>(first + j), dist);
+                    if (queue.full()) {
+                        tau = queue.worst();
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ *  Exact index scanning every point with gemmScan. At high dimensions a tree prunes almost nothing, and computing the
+ *  distances of a block of queries as one matrix product is much faster than walking the tree query by query. The
+ *  expanded L2 form is only used to pick candidates: the k closest ones are then ranked by their distance as
+ *  dist_l2_f_avx2 computes it, so results match the ones of a VPTree, rounding included.
+ */
+class BruteForceIndex : public ISerializable {
+    public:
+    // Queries per matrix product: enough rows to make the products compute bound, few enough to split a batch between threads
+    static constexpr size_t queryBlockSize = 64;
+
+    // L2 candidates kept per query beyond k, which covers near ties reordered by the rounding of the expanded form
+    static constexpr size_t rerankSlack = 16;
+
+    explicit BruteForceIndex(GemmMetric metric = GemmMetric::L2) : _metric(metric) {}
+
+    // points is a numPoints x dimension row major buffer, copied into the index
+    void set(const float *points, size_t numPoints, size_t dimension) {
+        _points = Eigen::Map<const RowMatrixf>(points, numPoints, dimension);
+        _center = Eigen::RowVectorXf::Zero(dimension);
+        if (_metric == GemmMetric::L2 && numPoints > 0) {
+            _center = _points.cast<double>().colwise().mean().cast<float>();
+        }
+        _norms.resize(numPoints);
+        for (size_t i = 0; i < numPoints; ++i) {
+            _norms[i] = (_points.row(i) - _center).squaredNorm();
+        }
+    }
+
+    void set(const std::vector<std::vector<float>> &points) {
+        const RowMatrixf packed = pack(points);
+        set(packed.data(), packed.rows(), packed.cols());
+    }
+
+    bool isEmpty() const { return _points.rows() == 0; }
+    size_t size() const { return _points.rows(); }
+    size_t dimension() const { return _points.cols(); }
+    GemmMetric metric() const { return _metric; }
+
+    void setNumThreads(size_t numThreads, ThreadPool::Schedule schedule = ThreadPool::Schedule::WorkStealing) {
+        if (numThreads == 0 && schedule == ThreadPool::Schedule::WorkStealing) {
+            _threadPool = nullptr;
+        } else {
+            _threadPool = std::make_shared<ThreadPool>(numThreads, schedule);
+        }
+    }
+
+    size_t numThreads() const { return threadPool().numThreads(); }
+
+    /*
+     *  Writes row major (number of queries) x k arrays, where row i holds the points found for query i from the farthest
+     *  to the closest one, as VPTree::searchKNN does. Distances are euclidean distances for L2 and inner products
+     *  (largest last) for the inner product. Rows with fewer than k points start with -1 indexes and the farthest
+     *  possible distance.
+     */
+    void searchKNN(const float *queries, size_t numQueries, size_t dimension, size_t k, int64_t *indexes, float *distances) const {
+        if (isEmpty()) {
+            throw std::runtime_error("index must be first initialized with .set() function and non empty dataset");
+        }
+        if (numQueries == 0) {
+            return;
+        }
+        if (dimension != this->dimension()) {
+            throw std::invalid_argument("queries and indexed points must have the same dimension");
+        }
+
+        const size_t candidates = _metric == GemmMetric::L2 ? k + rerankSlack : k;
+        dispatchKNNQueue<float>(candidates, [&](auto queueType) {
+            using KNNQueue = typename decltype(queueType)::type;
+
+            const size_t numBlocks = (numQueries + queryBlockSize - 1) / queryBlockSize;
+            threadPool().parallelFor(numBlocks, [&](size_t block) {
+                const size_t first = block * queryBlockSize;
+                const size_t count = std::min(queryBlockSize, numQueries - first);
+                Eigen::Map<const RowMatrixf> blockQueries(queries + first * dimension, count, dimension);
+
+                thread_local std::vector<KNNQueue> queues;
+                thread_local std::vector<float> queryNorms;
+                thread_local RowMatrixf movedQueries;
+                thread_local GemmScratch scratch;
+                queues.resize(count);
+                queryNorms.resize(count);
+                for (size_t q = 0; q < count; ++q) {
+                    queues[q].reset(candidates);
+                }
+
+                if (_metric == GemmMetric::L2) {
+                    movedQueries = blockQueries.rowwise() - _center;
+                    for (size_t q = 0; q < count; ++q) {
+                        queryNorms[q] = movedQueries.row(q).squaredNorm();
+                    }
+                    gemmScan<GemmMetric::L2>(movedQueries, queryNorms.data(), _points.data(), _norms.data(), _center.data(), size(), queues.data(),
+                                             scratch);
+                    for (size_t q = 0; q < count; ++q) {
+                        rerank(queues[q], blockQueries.row(q).data(), k, indexes + (first + q) * k, distances + (first + q) * k);
+                    }
+                } else {
+                    gemmScan<GemmMetric::InnerProduct>(blockQueries, nullptr, _points.data(), nullptr, nullptr, size(), queues.data(), scratch);
+                    for (size_t q = 0; q < count; ++q) {
+                        write(queues[q], k, indexes + (first + q) * k, distances + (first + q) * k);
+                    }
+                }
+            });
+        });
+    }
+
+    void searchKNN(const std::vector<std::vector<float>> &queries, size_t k, int64_t *indexes, float *distances) const {
+        const RowMatrixf packed = pack(queries);
+        searchKNN(packed.data(), packed.rows(), packed.cols(), k, indexes, distances);
+    }
+
+    void search1NN(const std::vector<std::vector<float>> &queries, std::vector<int64_t> &indices, std::vector<float> &distances) const {
+        indices.resize(queries.size());
+        distances.resize(queries.size());
+        searchKNN(queries, 1, indices.data(), distances.data());
+    }
+
+    SerializedState serialize() const override {
+        if (isEmpty()) {
+            return SerializedState();
+        }
+
+        SerializedState state;
+        state.reserve(_points.size() * sizeof(float) + 3 * sizeof(size_t));
+        state.push_by_size(_points.data(), _points.size() * sizeof(float));
+        state.push(static_cast<size_t>(_points.rows()));
+        state.push(static_cast<size_t>(_points.cols()));
+        state.push(static_cast<size_t>(_metric));
+        state.buildChecksum();
+        return state;
+    }
+
+    void deserialize(const SerializedState &state) override {
+        if (state.data.empty()) {
+            set(nullptr, 0, 0);
+            return;
+        }
+        if (!state.isValid()) {
+            throw std::invalid_argument("invalid state - checksum mismatch");
+        }
+
+        SerializedState copy(state);
+        if (copy.size() < 3 * sizeof(size_t)) {
+            throw std::invalid_argument("invalid state - truncated");
+        }
+        const size_t metric = copy.pop<size_t>();
+        const size_t dimension = copy.pop<size_t>();
+        const size_t numPoints = copy.pop<size_t>();
+        if (copy.size() != numPoints * dimension * sizeof(float)) {
+            throw std::invalid_argument("invalid state - truncated");
+        }
+        _metric = static_cast<GemmMetric>(metric);
+        RowMatrixf points(numPoints, dimension);
+        copy.pop_by_size(points.data(), points.size() * sizeof(float));
+        set(points.data(), numPoints, dimension);
+    }
+
+    private:
+    static RowMatrixf pack(const std::vector<std::vector<float>> &vectors) {
+        const size_t dimension = vectors.empty() ? 0 : vectors[0].size();
+        RowMatrixf packed(vectors.size(), dimension);
+        for (size_t i = 0; i < vectors.size(); ++i) {
+            if (vectors[i].size() != dimension) {
+                throw std::invalid_argument("all vectors must have the same dimension");
+            }
+            std::copy(vectors[i].begin(), vectors[i].end(), packed.row(i).data());
+        }
+        return packed;
+    }
+
+    // Writes a queue filled by gemmScan for the inner product as one row of the results of searchKNN
+    template <typename KNNQueue> void write(KNNQueue &queue, size_t k, int64_t *indexes, float *distances) const {
+        const size_t padding = k - queue.size();
+        std::fill(indexes, indexes + padding, -1);
+        std::fill(distances, distances + padding, std::numeric_limits<float>::lowest());
+        queue.fill(indexes + padding, distances + padding);
+        for (size_t i = padding; i < k; ++i) {
+            distances[i] = -distances[i];
+        }
+    }
+
+    // Ranks the L2 candidates of query kept by gemmScan by their exact distance, and writes the k closest ones as one row
+    // of the results of searchKNN
+    template <typename KNNQueue> void rerank(KNNQueue &queue, const float *query, size_t k, int64_t *indexes, float *distances) const {
+        thread_local std::vector<int64_t> candidateIndexes;
+        thread_local std::vector<float> candidateDistances;
+        thread_local std::vector<std::pair<float, int64_t>> ranked;
+        candidateIndexes.resize(queue.size());
+        candidateDistances.resize(queue.size());
+        queue.fill(candidateIndexes.data(), candidateDistances.data());
+
+        ranked.clear();
+        for (int64_t index : candidateIndexes) {
+            ranked.emplace_back(std::sqrt(activeDistanceKernels.l2Squared(query, _points.row(index).data(), dimension())), index);
+        }
+        const size_t found = std::min(k, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + found, ranked.end());
+
+        const size_t padding = k - found;
+        std::fill(indexes, indexes + padding, -1);
+        std::fill(distances, distances + padding, std::numeric_limits<float>::max());
+        for (size_t i = 0; i < found; ++i) {
+            indexes[k - 1 - i] = ranked[i].second;
+            distances[k - 1 - i] = ranked[i].first;
+        }
+    }
+
+    ThreadPool &threadPool() const { return _threadPool != nullptr ? *_threadPool : ThreadPool::defaultPool(); }
+
+    GemmMetric _metric;
+    RowMatrixf _points;
+    // mean of the points for L2, zero for the inner product
+    Eigen::RowVectorXf _center;
+    std::vector<float> _norms;
+    std::shared_ptr<ThreadPool> _threadPool;
+};
+
+} // namespace vptree
@@ -0,0 +1,176 @@
+/*
+ *  MIT Licence
+ *  Copyright 2021 Pablo Carneiro Elias
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+#include "BruteForceIndex.hpp"
+#include "ThreadPool.hpp"
+#include "VPTree.hpp"
+
+namespace vptree {
+
+/*
+ *  How to answer kNN searches over an index, as measured by planSearch: the leaf size of tree searches and, when a brute
+ *  force scan is available, the costs deciding which engine answers a batch.
+ *
+ *  A tree search costs about the same for every query. A brute force scan streams the whole dataset once per block of
+ *  BruteForceIndex::queryBlockSize queries, and then costs a little more per query of the block, so it only wins for
+ *  batches large enough to fill its blocks.
+ */
+struct SearchPlan {
+    size_t leafSize = 1;
+
+    // mean fraction of the points whose distance to a query the tree search with leafSize evaluated, 1 if it prunes nothing
+    double evaluatedFraction = 1;
+
+    // measured on a single thread
+    double treeSecondsPerQuery = 0;
+    double bruteForceSecondsPerBlock = 0;
+    double bruteForceSecondsPerQuery = 0;
+    bool hasBruteForce = false;
+
+    // Estimated cost of a batch on numThreads threads, which run queries (tree) or blocks of queries (brute force)
+    double treeSeconds(size_t numQueries, size_t numThreads) const {
+        return treeSecondsPerQuery * numQueries / std::max<size_t>(std::min(numThreads, numQueries), 1);
+    }
+
+    double bruteForceSeconds(size_t numQueries, size_t numThreads) const {
+        const size_t numBlocks = (numQueries + BruteForceIndex::queryBlockSize - 1) / BruteForceIndex::queryBlockSize;
+        const double seconds = bruteForceSecondsPerBlock * numBlocks + bruteForceSecondsPerQuery * numQueries;
+        return seconds / std::max<size_t>(std::min(numThreads, numBlocks), 1);
+    }
+
+    bool useBruteForce(size_t numQueries, size_t numThreads) const {
+        return hasBruteForce && bruteForceSeconds(numQueries, numThreads) < treeSeconds(numQueries, numThreads);
+    }
+
+    // false if the tree is faster for any batch, so the brute force index does not need to be kept
+    bool bruteForceEverWins() const {
+        const size_t fullBlock = BruteForceIndex::queryBlockSize;
+        return hasBruteForce && bruteForceSeconds(fullBlock, 1) < treeSeconds(fullBlock, 1);
+    }
+};
+
+/*
+ *  Measures searches of k neighbors for a sample of the indexed points, held out of the results so that they do not find
+ *  themselves, and returns the fastest plan. points are the indexed points, in the order given to tree.set(). Brute force
+ *  scans only exist for float points, bruteForce is ignored for other types.
+ *
+ *  The tree is timed for a few leaf sizes, each counting the distances it evaluates. Timings are noisy, so leaf sizes
+ *  close to the fastest one are ranked by their evaluated fraction, the one pruning most being the least sensitive to
+ *  the machine and to k. bruteForce, if given, evaluates every distance but through matrix products, which cannot make
+ *  up for a tree evaluating less than 1 / maxBruteForceSpeedup of them: it is only timed, for a single query and for a
+ *  full block, when the tree prunes less than that. Every timing is the best of a few runs after a warm-up run.
+ *
+ *  Everything runs on the calling thread. The sample is a single block of queries, but each query may scan the whole
+ *  dataset at high dimensions, so planning costs up to a few brute force searches of BruteForceIndex::queryBlockSize
+ *  queries.
+ */
+template <typename Tree, typename Point>
+SearchPlan planSearch(Tree &tree, const std::vector<Point> &points, const BruteForceIndex *bruteForce, size_t k = 8) {
+    using Distance = typename decltype(Tree::VPTreeSearchResultElement::distances)::value_type;
+
+    // below this many points, any engine is fast enough not to be worth measuring
+    constexpr size_t minPoints = 1024;
+    const size_t sampleSize = BruteForceIndex::queryBlockSize;
+    // leaf sizes this close to the fastest one are deemed as fast
+    constexpr double timingTolerance = 1.1;
+    // how many times faster than a tree search a brute force scan computes a distance, at best
+    constexpr double maxBruteForceSpeedup = 64;
+    constexpr int timedRuns = 3;
+
+    SearchPlan plan;
+    if (points.size() < minPoints) {
+        return plan;
+    }
+
+    std::vector<size_t> positions(points.size());
+    std::iota(positions.begin(), positions.end(), 0);
+    std::mt19937_64 generator(points.size());
+    std::shuffle(positions.begin(), positions.end(), generator);
+    positions.resize(sampleSize);
+
+    std::vector<Point> sample;
+    std::vector<bool> allowed(points.size(), true);
+    for (size_t position : positions) {
+        sample.push_back(points[position]);
+        allowed[position] = false;
+    }
+    const typename Tree::VPTreeAllowedSet allowedSet = tree.makeAllowedSet(allowed);
+
+    ThreadPool::SerialScope serial;
+    // the warm-up run pays for first touches of the data and for allocating scratch buffers
+    auto secondsOf = [](auto &&search) {
+        search();
+        double best = std::numeric_limits<double>::max();
+        for (int run = 0; run < timedRuns; ++run) {
+            const auto start = std::chrono::steady_clock::now();
+            search();
+            best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    };
+
+    std::vector<int64_t> indexes(sampleSize * k);
+    std::vector<Distance> distances(sampleSize * k);
+    typename Tree::VPTreeSearchOptions options;
+    options.allowedSet = &allowedSet;
+
+    struct LeafSizeCosts {
+        size_t leafSize;
+        double secondsPerQuery;
+        double evaluatedFraction;
+    };
+    std::vector<LeafSizeCosts> costs;
+    std::vector<VPTreeSearchStats> stats;
+    for (size_t leafSize : {1, 4, 16, 64}) {
+        options.leafSize = leafSize;
+        tree.searchKNN(sample, k, {indexes.data(), distances.data(), k}, options, stats);
+        uint64_t distanceEvaluations = 0;
+        for (const VPTreeSearchStats &queryStats : stats) {
+            distanceEvaluations += queryStats.distanceEvaluations;
+        }
+        const double seconds = secondsOf([&]() { tree.searchKNN(sample, k, {indexes.data(), distances.data(), k}, options); });
+        costs.push_back({leafSize, seconds / sampleSize, static_cast<double>(distanceEvaluations) / (sampleSize * points.size())});
+    }
+
+    const double fastest =
+        std::min_element(costs.begin(), costs.end(), [](const auto &a, const auto &b) { return a.secondsPerQuery < b.secondsPerQuery; })
+            ->secondsPerQuery;
+    const LeafSizeCosts *chosen = nullptr;
+    for (const LeafSizeCosts &candidate : costs) {
+        if (candidate.secondsPerQuery <= fastest * timingTolerance &&
+            (chosen == nullptr || candidate.evaluatedFraction < chosen->evaluatedFraction)) {
+            chosen = &candidate;
+        }
+    }
+    plan.leafSize = chosen->leafSize;
+    plan.treeSecondsPerQuery = chosen->secondsPerQuery;
+    plan.evaluatedFraction = chosen->evaluatedFraction;
+
+    if constexpr (std::is_same<Point, std::vector<float>>::value) {
+        if (bruteForce != nullptr && plan.evaluatedFraction * maxBruteForceSpeedup >= 1) {
+            // seconds(1 query) = perBlock + perQuery and seconds(full block) = perBlock + sampleSize * perQuery
+            const double single = secondsOf([&]() { bruteForce->searchKNN({sample[0]}, k, indexes.data(), distances.data()); });
+            const double block = secondsOf([&]() { bruteForce->searchKNN(sample, k, indexes.data(), distances.data()); });
+            plan.bruteForceSecondsPerQuery = std::max(block - single, 0.0) / (sampleSize - 1);
+            plan.bruteForceSecondsPerBlock = std::max(single - plan.bruteForceSecondsPerQuery, 0.0);
+            plan.hasBruteForce = true;
+        }
+    }
+
+    return plan;
+}
+
+} // namespace vptree
@@ -0,0 +1,132 @@
+/*
+ *  MIT Licence
+ *  Copyright 2021 Pablo Carneiro Elias
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+/*
+ *  Functions marked with PYNEAR_TARGET(isa) are compiled for the given instruction sets, whatever the flags of the rest of
+ *  the build, and must only be called on CPUs supporting them. MSVC compiles intrinsics of any instruction set without
+ *  flags, so the attribute is empty there.
+ */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define PYNEAR_TARGET(isa)
+#define PYNEAR_ALWAYS_INLINE __forceinline
+#else
+#define PYNEAR_TARGET(isa) __attribute__((target(isa)))
+#define PYNEAR_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
+namespace vptree {
+
+/*
+ *  Instruction set levels distance kernels are compiled for, each one including the previous ones:
+ *
+ *      Generic: baseline x86-64 (SSE2), portable scalar code
+ *      SSE42:   SSE4.2 and POPCNT
+ *      AVX2:    AVX2 and FMA
+ *      AVX512:  AVX-512 F, VL, BW and DQ
+ */
+enum class SimdLevel { Generic, SSE42, AVX2, AVX512 };
+
+inline const char *simdLevelName(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::SSE42:
+        return "sse4.2";
+    case SimdLevel::AVX2:
+        return "avx2";
+    case SimdLevel::AVX512:
+        return "avx512";
+    default:
+        return "generic";
+    }
+}
+
+// Highest level supported by both the CPU and the operating system, which must save the wider registers
+inline SimdLevel detectSimdLevel() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    const bool sse42 = (info[2] & (1 << 20)) && (info[2] & (1 << 23));
+    const bool fma = info[2] & (1 << 12);
+    const bool osxsave = info[2] & (1 << 27);
+    const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+    const bool ymmState = (xcr0 & 0x6) == 0x6;
+    const bool zmmState = (xcr0 & 0xe6) == 0xe6;
+
+    bool avx2 = false, avx512 = false;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = info[1] & (1 << 5);
+        // F, DQ, BW and VL
+        avx512 = (info[1] & (1 << 16)) && (info[1] & (1 << 17)) && (info[1] & (1 << 30)) && (info[1] & (1u << 31));
+    }
+
+    if (avx512 && avx2 && fma && zmmState) {
+        return SimdLevel::AVX512;
+    }
+    if (avx2 && fma && ymmState) {
+        return SimdLevel::AVX2;
+    }
+    return sse42 ? SimdLevel::SSE42 : SimdLevel::Generic;
+#else
+    // also checks that the operating system saves the AVX and AVX-512 registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+        return SimdLevel::SSE42;
+    }
+    return SimdLevel::Generic;
+#endif
+}
+
+// Whether the CPU has the AVX-512 VPOPCNTDQ extension (Ice Lake and later), with population counts of 64 bit lanes
+inline bool detectAvx512Popcount() {
+    if (detectSimdLevel() < SimdLevel::AVX512) {
+        return false;
+    }
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return info[2] & (1 << 14);
+#else
+    return __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+}
+
+/*
+ *  Level kernels are selected for: the detected one, unless the PYNEAR_SIMD environment variable (generic, sse4.2, avx2
+ *  or avx512) asks for a lower one, e.g. to reproduce the results of an older machine.
+ */
+inline SimdLevel selectSimdLevel() {
+    const SimdLevel detected = detectSimdLevel();
+    const char *requested = std::getenv("PYNEAR_SIMD");
+    if (requested == nullptr) {
+        return detected;
+    }
+    for (SimdLevel level : {SimdLevel::Generic, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (std::strcmp(requested, simdLevelName(level)) == 0) {
+            return std::min(level, detected);
+        }
+    }
+    return detected;
+}
+
+} // namespace vptree
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <vector>
 
 #if defined(_MSC_VER)
@@ -9,16 +11,25 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
+#include <cstring>
 #include <immintrin.h>
+#include <limits>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "CpuFeatures.hpp"
+
 using arrayd = std::vector<double>;
 using arrayf = std::vector<float>;
 using arrayli = std::vector<uint8_t>;
+using arrayi16 = std::vector<int16_t>;
+using arrayi32 = std::vector<int32_t>;
 using ndarrayd = std::vector<arrayd>;
 using ndarrayf = std::vector<arrayf>;
 using ndarrayli = std::vector<arrayli>;
+using ndarrayi16 = std::vector<arrayi16>;
+using ndarrayi32 = std::vector<arrayi32>;
 
 #if defined(_MSC_VER)
 #define ALIGN_AS(bits) __declspec(align(bits))
@@ -26,245 +37,1000 @@ using ndarrayli = std::vector<arrayli>;
 #define ALIGN_AS(bits) __attribute__((__aligned__(bits)))
 #endif
 
-/* Hamming distances for multiples of 64 bits */
-int64_t hamming_u64(const arrayli &p1, const arrayli &p2) {
-    assert(p1.size() == p2.size());
-    assert(p1.size() % 8 == 0);
+/*
+ *  Distance kernels are compiled for every instruction set level of CpuFeatures.hpp, one namespace per level, and the
+ *  fastest level the CPU supports is selected once, when the module is loaded, into activeDistanceKernels. The dist_*
+ *  functions below keep their historical names (dist_l2_f_avx2 runs on any CPU) and call the selected kernels, so a
+ *  build runs on any x86-64 machine and still uses the widest registers it has.
+ *
+ *  Early abandon (bounded) versions of the kernels return the distance if it is at most bound, any value greater than
+ *  bound otherwise. Partial results are compared against bound every 64 dimensions (512 bits for hamming distances), so
+ *  most far away points are rejected after a fraction of their dimensions. When the full distance is computed, it is the
+ *  exact same value the unbounded version of the same level returns.
+ *
+ *  Kernels of double, int16 and int32 vectors (the *_f64 ones) compute in double precision, which holds the difference
+ *  of any two int32 values and the square of any int16 difference exactly.
+ */
+const unsigned int early_abandon_block = 64;
+
+namespace distance_kernels {
+
+// compiled to the POPCNT instruction in functions targeting it (always with MSVC when hardware is set)
+template <bool hardware> PYNEAR_ALWAYS_INLINE int64_t popcount64(uint64_t x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    if constexpr (hardware) {
+        return static_cast<int64_t>(__popcnt64(x));
+    }
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return static_cast<int64_t>((x * 0x0101010101010101ULL) >> 56);
+#else
+    return __builtin_popcountll(x);
+#endif
+}
 
-    const uint64_t *bs1 = reinterpret_cast<const uint64_t *>(p1.data());
-    const uint64_t *bs2 = reinterpret_cast<const uint64_t *>(p2.data());
+PYNEAR_ALWAYS_INLINE uint64_t load_u64(const uint8_t *p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return word;
+}
 
-    const size_t nwords = p1.size() / 8;
-    size_t i;
+/* Hamming distance of any number of bytes: 64 bit words, then the remaining bytes */
+template <bool hardware, bool bounded> PYNEAR_ALWAYS_INLINE int64_t hamming_bytes(const uint8_t *a, const uint8_t *b, size_t size, int64_t bound) {
+    const size_t nwords = size / 8;
     int64_t h = 0;
-    for (i = 0; i < nwords; i++)
-        h += _mm_popcnt_u64(bs1[i] ^ bs2[i]);
+    for (size_t i = 0; i < nwords; i++) {
+        h += popcount64<hardware>(load_u64(a + 8 * i) ^ load_u64(b + 8 * i));
+        if constexpr (bounded) {
+            if (i % 8 == 7 && h > bound) {
+                return h;
+            }
+        }
+    }
+    for (size_t i = 8 * nwords; i < size; i++) {
+        h += popcount64<hardware>(a[i] ^ b[i]);
+    }
     return h;
 }
 
-template <size_t nbits> int64_t hamming_u64(const uint64_t *bs1, const uint64_t *bs2) {
-    const size_t nwords = nbits / 64;
-    size_t i;
+/* Hamming distance of nwords 64 bit words, unrolled by the compiler */
+template <size_t nwords, bool hardware> PYNEAR_ALWAYS_INLINE int64_t hamming_words(const uint8_t *a, const uint8_t *b) {
     int64_t h = 0;
-    for (i = 0; i < nwords; i++)
-        h += _mm_popcnt_u64(bs1[i] ^ bs2[i]);
+    for (size_t i = 0; i < nwords; i++) {
+        h += popcount64<hardware>(load_u64(a + 8 * i) ^ load_u64(b + 8 * i));
+    }
     return h;
 }
 
-/* Hamming distances for multiples of 32 bits */
-int32_t hamming_u32(const arrayli &p1, const arrayli &p2) {
-    assert(p1.size() == p2.size());
-    assert(p1.size() % 4 == 0);
+template <bool hardware> PYNEAR_ALWAYS_INLINE int64_t hamming_512_bounded_words(const uint8_t *a, const uint8_t *b, int64_t bound) {
+    // first half, then second half if still within bound
+    const int64_t h = hamming_words<4, hardware>(a, b);
+    if (h > bound) {
+        return h;
+    }
+    return h + hamming_words<4, hardware>(a + 32, b + 32);
+}
 
-    const uint32_t *bs1 = reinterpret_cast<const uint32_t *>(p1.data());
-    const uint32_t *bs2 = reinterpret_cast<const uint32_t *>(p2.data());
+/* Portable scalar kernels, for CPUs without SSE4.2 */
+namespace generic {
 
-    const size_t nwords = p1.size() / 4;
-    size_t i;
-    int32_t h = 0;
-    for (i = 0; i < nwords; i++)
-        h += _mm_popcnt_u32(bs1[i] ^ bs2[i]);
-    return h;
+template <bool bounded> inline float l2_squared_impl(const float *x, const float *y, size_t d, float squaredBound) {
+    float sum = 0;
+    for (size_t i = 0; i < d; i += early_abandon_block) {
+        const size_t end = std::min<size_t>(i + early_abandon_block, d);
+        for (size_t j = i; j < end; j++) {
+            const float diff = x[j] - y[j];
+            sum += diff * diff;
+        }
+        if constexpr (bounded) {
+            if (end < d && sum > squaredBound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    return !bounded || sum <= squaredBound ? sum : std::numeric_limits<float>::infinity();
 }
 
-template <size_t nbits> int32_t hamming_u32(const uint32_t *bs1, const uint32_t *bs2) {
-    const size_t nwords = nbits / 32;
-    size_t i;
-    int32_t h = 0;
-    for (i = 0; i < nwords; i++)
-        h += _mm_popcnt_u32(bs1[i] ^ bs2[i]);
-    return h;
+template <bool bounded> inline float l1_impl(const float *x, const float *y, size_t d, float bound) {
+    float sum = 0;
+    for (size_t i = 0; i < d; i += early_abandon_block) {
+        const size_t end = std::min<size_t>(i + early_abandon_block, d);
+        for (size_t j = i; j < end; j++) {
+            sum += std::fabs(x[j] - y[j]);
+        }
+        if constexpr (bounded) {
+            if (end < d && sum > bound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    return sum;
 }
 
-/* Hamming distances for multiples of 16 bits */
-int16_t hamming_u16(const arrayli &p1, const arrayli &p2) {
-    assert(p1.size() == p2.size());
-    assert(p1.size() % 2 == 0);
+template <bool bounded> inline float chebyshev_impl(const float *x, const float *y, size_t d, float bound) {
+    float max_distance = 0;
+    for (size_t i = 0; i < d; i += early_abandon_block) {
+        const size_t end = std::min<size_t>(i + early_abandon_block, d);
+        for (size_t j = i; j < end; j++) {
+            max_distance = std::max(max_distance, std::fabs(x[j] - y[j]));
+        }
+        if constexpr (bounded) {
+            if (end < d && max_distance > bound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    return max_distance;
+}
 
-    const uint16_t *bs1 = reinterpret_cast<const uint16_t *>(p1.data());
-    const uint16_t *bs2 = reinterpret_cast<const uint16_t *>(p2.data());
+inline float l2_squared(const float *x, const float *y, size_t d) { return l2_squared_impl<false>(x, y, d, 0); }
+inline float l2_squared_bounded(const float *x, const float *y, size_t d, float squaredBound) { return l2_squared_impl<true>(x, y, d, squaredBound); }
+inline float l1(const float *x, const float *y, size_t d) { return l1_impl<false>(x, y, d, 0); }
+inline float l1_bounded(const float *x, const float *y, size_t d, float bound) { return l1_impl<true>(x, y, d, bound); }
+inline float chebyshev(const float *x, const float *y, size_t d) { return chebyshev_impl<false>(x, y, d, 0); }
+inline float chebyshev_bounded(const float *x, const float *y, size_t d, float bound) { return chebyshev_impl<true>(x, y, d, bound); }
 
-    const size_t nwords = p1.size() / 2;
-    size_t i;
-    int16_t h = 0;
-    for (i = 0; i < nwords; i++)
-        h += _mm_popcnt_u32(bs1[i] ^ bs2[i]);
-    return h;
+inline int64_t hamming(const uint8_t *a, const uint8_t *b, size_t size) { return hamming_bytes<false, false>(a, b, size, 0); }
+inline int64_t hamming_bounded(const uint8_t *a, const uint8_t *b, size_t size, int64_t bound) {
+    return hamming_bytes<false, true>(a, b, size, bound);
+}
+inline int64_t hamming_64(const uint8_t *a, const uint8_t *b) { return hamming_words<1, false>(a, b); }
+inline int64_t hamming_128(const uint8_t *a, const uint8_t *b) { return hamming_words<2, false>(a, b); }
+inline int64_t hamming_256(const uint8_t *a, const uint8_t *b) { return hamming_words<4, false>(a, b); }
+inline int64_t hamming_512(const uint8_t *a, const uint8_t *b) { return hamming_words<8, false>(a, b); }
+inline int64_t hamming_1024(const uint8_t *a, const uint8_t *b) { return hamming_words<16, false>(a, b); }
+inline int64_t hamming_512_bounded(const uint8_t *a, const uint8_t *b, int64_t bound) { return hamming_512_bounded_words<false>(a, b, bound); }
+
+template <typename T, bool bounded> inline double l2_squared_f64_impl(const T *x, const T *y, size_t d, double squaredBound) {
+    double sum = 0;
+    for (size_t i = 0; i < d; i += early_abandon_block) {
+        const size_t end = std::min<size_t>(i + early_abandon_block, d);
+        for (size_t j = i; j < end; j++) {
+            const double diff = static_cast<double>(x[j]) - static_cast<double>(y[j]);
+            sum += diff * diff;
+        }
+        if constexpr (bounded) {
+            if (end < d && sum > squaredBound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    return !bounded || sum <= squaredBound ? sum : std::numeric_limits<double>::infinity();
 }
 
-template <size_t nbits> int16_t hamming_u16(const uint16_t *bs1, const uint16_t *bs2) {
-    const size_t nwords = nbits / 16;
-    size_t i;
-    int16_t h = 0;
-    for (i = 0; i < nwords; i++)
-        h += _mm_popcnt_u32(bs1[i] ^ bs2[i]);
-    return h;
+template <typename T, bool bounded> inline double l1_f64_impl(const T *x, const T *y, size_t d, double bound) {
+    double sum = 0;
+    for (size_t i = 0; i < d; i += early_abandon_block) {
+        const size_t end = std::min<size_t>(i + early_abandon_block, d);
+        for (size_t j = i; j < end; j++) {
+            sum += std::fabs(static_cast<double>(x[j]) - static_cast<double>(y[j]));
+        }
+        if constexpr (bounded) {
+            if (end < d && sum > bound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    return sum;
 }
 
-/* Hamming distances for multiples of 8 bits */
-int8_t hamming_u8(const arrayli &p1, const arrayli &p2) {
-    assert(p1.size() == p2.size());
+template <typename T, bool bounded> inline double chebyshev_f64_impl(const T *x, const T *y, size_t d, double bound) {
+    double max_distance = 0;
+    for (size_t i = 0; i < d; i += early_abandon_block) {
+        const size_t end = std::min<size_t>(i + early_abandon_block, d);
+        for (size_t j = i; j < end; j++) {
+            max_distance = std::max(max_distance, std::fabs(static_cast<double>(x[j]) - static_cast<double>(y[j])));
+        }
+        if constexpr (bounded) {
+            if (end < d && max_distance > bound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    return max_distance;
+}
 
-    const uint8_t *bs1 = p1.data();
-    const uint8_t *bs2 = p2.data();
+template <typename T> inline double l2_squared_f64(const T *x, const T *y, size_t d) { return l2_squared_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> inline double l2_squared_f64_bounded(const T *x, const T *y, size_t d, double squaredBound) {
+    return l2_squared_f64_impl<T, true>(x, y, d, squaredBound);
+}
+template <typename T> inline double l1_f64(const T *x, const T *y, size_t d) { return l1_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> inline double l1_f64_bounded(const T *x, const T *y, size_t d, double bound) { return l1_f64_impl<T, true>(x, y, d, bound); }
+template <typename T> inline double chebyshev_f64(const T *x, const T *y, size_t d) { return chebyshev_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> inline double chebyshev_f64_bounded(const T *x, const T *y, size_t d, double bound) {
+    return chebyshev_f64_impl<T, true>(x, y, d, bound);
+}
 
-    const size_t nwords = p1.size();
-    size_t i;
-    int8_t h = 0;
-    for (i = 0; i < nwords; i++)
-        h += _mm_popcnt_u32(bs1[i] ^ bs2[i]);
-    return h;
+} // namespace generic
+
+/* 128 bit kernels and the POPCNT instruction */
+namespace sse42 {
+
+#define PYNEAR_SSE42 PYNEAR_TARGET("sse4.2,popcnt")
+
+PYNEAR_SSE42 inline float sum4(__m128 x) {
+    x = _mm_hadd_ps(x, x);
+    x = _mm_hadd_ps(x, x);
+    return _mm_cvtss_f32(x);
 }
 
-template <size_t nbits> int8_t hamming_u8(const uint8_t *bs1, const uint8_t *bs2) {
-    const size_t nwords = nbits / 8;
-    size_t i;
-    int8_t h = 0;
-    for (i = 0; i < nwords; i++)
-        h += _mm_popcnt_u32(bs1[i] ^ bs2[i]);
-    return h;
+PYNEAR_SSE42 inline float max4(__m128 x) {
+    x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_max_ss(x, _mm_shuffle_ps(x, x, 0x1));
+    return _mm_cvtss_f32(x);
+}
+
+PYNEAR_SSE42 inline __m128 abs_diff(__m128 x, __m128 y) { return _mm_and_ps(_mm_sub_ps(x, y), _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF))); }
+
+template <bool bounded> PYNEAR_SSE42 inline float l2_squared_impl(const float *x, const float *y, size_t d, float squaredBound) {
+    __m128 sum = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= d; i += 4) {
+        const __m128 diff = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+        sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+        if constexpr (bounded) {
+            if ((i + 4) % early_abandon_block == 0 && i + 4 < d && sum4(sum) > squaredBound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    // the last dimensions one by one: gathering them into a register costs more than it saves
+    float result = sum4(sum);
+    for (; i < d; i++) {
+        const float diff = x[i] - y[i];
+        result += diff * diff;
+    }
+    return !bounded || result <= squaredBound ? result : std::numeric_limits<float>::infinity();
+}
+
+template <bool bounded> PYNEAR_SSE42 inline float l1_impl(const float *x, const float *y, size_t d, float bound) {
+    __m128 sum = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= d; i += 4) {
+        sum = _mm_add_ps(sum, abs_diff(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+        if constexpr (bounded) {
+            if ((i + 4) % early_abandon_block == 0 && i + 4 < d && sum4(sum) > bound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    float result = sum4(sum);
+    for (; i < d; i++) {
+        result += std::fabs(x[i] - y[i]);
+    }
+    return result;
+}
+
+template <bool bounded> PYNEAR_SSE42 inline float chebyshev_impl(const float *x, const float *y, size_t d, float bound) {
+    __m128 max_diff = _mm_setzero_ps();
+    const __m128 bounds = _mm_set1_ps(bound);
+    size_t i = 0;
+    for (; i + 4 <= d; i += 4) {
+        max_diff = _mm_max_ps(max_diff, abs_diff(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+        if constexpr (bounded) {
+            if ((i + 4) % early_abandon_block == 0 && i + 4 < d && _mm_movemask_ps(_mm_cmpgt_ps(max_diff, bounds)) != 0) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    float result = max4(max_diff);
+    for (; i < d; i++) {
+        result = std::max(result, std::fabs(x[i] - y[i]));
+    }
+    return result;
 }
 
-inline double sum4(__m256d v) {
-    __m128d vlow = _mm256_castpd256_pd128(v);
-    __m128d vhigh = _mm256_extractf128_pd(v, 1); // high 128
-    vlow = _mm_add_pd(vlow, vhigh);              // reduce down to 128
+PYNEAR_SSE42 inline float l2_squared(const float *x, const float *y, size_t d) { return l2_squared_impl<false>(x, y, d, 0); }
+PYNEAR_SSE42 inline float l2_squared_bounded(const float *x, const float *y, size_t d, float squaredBound) {
+    return l2_squared_impl<true>(x, y, d, squaredBound);
+}
+PYNEAR_SSE42 inline float l1(const float *x, const float *y, size_t d) { return l1_impl<false>(x, y, d, 0); }
+PYNEAR_SSE42 inline float l1_bounded(const float *x, const float *y, size_t d, float bound) { return l1_impl<true>(x, y, d, bound); }
+PYNEAR_SSE42 inline float chebyshev(const float *x, const float *y, size_t d) { return chebyshev_impl<false>(x, y, d, 0); }
+PYNEAR_SSE42 inline float chebyshev_bounded(const float *x, const float *y, size_t d, float bound) { return chebyshev_impl<true>(x, y, d, bound); }
+
+PYNEAR_SSE42 inline int64_t hamming(const uint8_t *a, const uint8_t *b, size_t size) { return hamming_bytes<true, false>(a, b, size, 0); }
+PYNEAR_SSE42 inline int64_t hamming_bounded(const uint8_t *a, const uint8_t *b, size_t size, int64_t bound) {
+    return hamming_bytes<true, true>(a, b, size, bound);
+}
+PYNEAR_SSE42 inline int64_t hamming_64(const uint8_t *a, const uint8_t *b) { return hamming_words<1, true>(a, b); }
+PYNEAR_SSE42 inline int64_t hamming_128(const uint8_t *a, const uint8_t *b) { return hamming_words<2, true>(a, b); }
+PYNEAR_SSE42 inline int64_t hamming_256(const uint8_t *a, const uint8_t *b) { return hamming_words<4, true>(a, b); }
+PYNEAR_SSE42 inline int64_t hamming_512(const uint8_t *a, const uint8_t *b) { return hamming_words<8, true>(a, b); }
+PYNEAR_SSE42 inline int64_t hamming_1024(const uint8_t *a, const uint8_t *b) { return hamming_words<16, true>(a, b); }
+PYNEAR_SSE42 inline int64_t hamming_512_bounded(const uint8_t *a, const uint8_t *b, int64_t bound) {
+    return hamming_512_bounded_words<true>(a, b, bound);
+}
+
+/*
+ *  Vectors of 2 doubles. Integers are widened to int32 and converted, both exactly, so every element type shares the
+ *  same kernels.
+ */
+PYNEAR_SSE42 inline __m128d load2(const double *p) { return _mm_loadu_pd(p); }
+PYNEAR_SSE42 inline __m128d load2(const int32_t *p) { return _mm_cvtepi32_pd(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))); }
+PYNEAR_SSE42 inline __m128d load2(const int16_t *p) {
+    int32_t pair;
+    std::memcpy(&pair, p, sizeof(pair));
+    return _mm_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_cvtsi32_si128(pair)));
+}
+
+PYNEAR_SSE42 inline double sum2(__m128d x) { return _mm_cvtsd_f64(_mm_add_sd(x, _mm_unpackhi_pd(x, x))); }
+PYNEAR_SSE42 inline double max2(__m128d x) { return _mm_cvtsd_f64(_mm_max_sd(x, _mm_unpackhi_pd(x, x))); }
+
+PYNEAR_SSE42 inline __m128d abs_diff(__m128d x, __m128d y) {
+    return _mm_and_pd(_mm_sub_pd(x, y), _mm_castsi128_pd(_mm_set1_epi64x(0x7FFFFFFFFFFFFFFFLL)));
+}
+
+template <typename T, bool bounded> PYNEAR_SSE42 inline double l2_squared_f64_impl(const T *x, const T *y, size_t d, double squaredBound) {
+    __m128d sum = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= d; i += 2) {
+        const __m128d diff = _mm_sub_pd(load2(x + i), load2(y + i));
+        sum = _mm_add_pd(sum, _mm_mul_pd(diff, diff));
+        if constexpr (bounded) {
+            if ((i + 2) % early_abandon_block == 0 && i + 2 < d && sum2(sum) > squaredBound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    double result = sum2(sum);
+    if (i < d) {
+        const double diff = static_cast<double>(x[i]) - static_cast<double>(y[i]);
+        result += diff * diff;
+    }
+    return !bounded || result <= squaredBound ? result : std::numeric_limits<double>::infinity();
+}
+
+template <typename T, bool bounded> PYNEAR_SSE42 inline double l1_f64_impl(const T *x, const T *y, size_t d, double bound) {
+    __m128d sum = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= d; i += 2) {
+        sum = _mm_add_pd(sum, abs_diff(load2(x + i), load2(y + i)));
+        if constexpr (bounded) {
+            if ((i + 2) % early_abandon_block == 0 && i + 2 < d && sum2(sum) > bound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    double result = sum2(sum);
+    if (i < d) {
+        result += std::fabs(static_cast<double>(x[i]) - static_cast<double>(y[i]));
+    }
+    return result;
+}
 
-    __m128d high64 = _mm_unpackhi_pd(vlow, vlow);
-    return _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); // reduce to scalar
+template <typename T, bool bounded> PYNEAR_SSE42 inline double chebyshev_f64_impl(const T *x, const T *y, size_t d, double bound) {
+    __m128d max_diff = _mm_setzero_pd();
+    const __m128d bounds = _mm_set1_pd(bound);
+    size_t i = 0;
+    for (; i + 2 <= d; i += 2) {
+        max_diff = _mm_max_pd(max_diff, abs_diff(load2(x + i), load2(y + i)));
+        if constexpr (bounded) {
+            if ((i + 2) % early_abandon_block == 0 && i + 2 < d && _mm_movemask_pd(_mm_cmpgt_pd(max_diff, bounds)) != 0) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    double result = max2(max_diff);
+    if (i < d) {
+        result = std::max(result, std::fabs(static_cast<double>(x[i]) - static_cast<double>(y[i])));
+    }
+    return result;
 }
 
-/* specialized (optimized) functions */
-template <> int8_t hamming_u8<8>(const uint8_t *pa, const uint8_t *pb) { return _mm_popcnt_u32(pa[0] ^ pb[0]); }
+template <typename T> PYNEAR_SSE42 inline double l2_squared_f64(const T *x, const T *y, size_t d) {
+    return l2_squared_f64_impl<T, false>(x, y, d, 0);
+}
+template <typename T> PYNEAR_SSE42 inline double l2_squared_f64_bounded(const T *x, const T *y, size_t d, double squaredBound) {
+    return l2_squared_f64_impl<T, true>(x, y, d, squaredBound);
+}
+template <typename T> PYNEAR_SSE42 inline double l1_f64(const T *x, const T *y, size_t d) { return l1_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> PYNEAR_SSE42 inline double l1_f64_bounded(const T *x, const T *y, size_t d, double bound) {
+    return l1_f64_impl<T, true>(x, y, d, bound);
+}
+template <typename T> PYNEAR_SSE42 inline double chebyshev_f64(const T *x, const T *y, size_t d) { return chebyshev_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> PYNEAR_SSE42 inline double chebyshev_f64_bounded(const T *x, const T *y, size_t d, double bound) {
+    return chebyshev_f64_impl<T, true>(x, y, d, bound);
+}
 
-template <> int16_t hamming_u16<16>(const uint16_t *pa, const uint16_t *pb) { return _mm_popcnt_u32(pa[0] ^ pb[0]); }
+} // namespace sse42
 
-template <> int32_t hamming_u32<32>(const uint32_t *pa, const uint32_t *pb) { return _mm_popcnt_u32(pa[0] ^ pb[0]); }
+/* 256 bit kernels, with fused multiply adds for L2. Hamming distances use the SSE4.2 kernels */
+namespace avx2 {
 
-template <> int64_t hamming_u64<64>(const uint64_t *pa, const uint64_t *pb) { return _mm_popcnt_u64(pa[0] ^ pb[0]); }
+#define PYNEAR_AVX2 PYNEAR_TARGET("avx2,fma,popcnt")
+
+PYNEAR_AVX2 inline __m128 reduce_add(__m256 x) { return _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1)); }
+PYNEAR_AVX2 inline __m128 reduce_max(__m256 x) { return _mm_max_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1)); }
+
+PYNEAR_AVX2 inline __m128d reduce_add(__m256d x) { return _mm_add_pd(_mm256_castpd256_pd128(x), _mm256_extractf128_pd(x, 1)); }
+PYNEAR_AVX2 inline __m128d reduce_max(__m256d x) { return _mm_max_pd(_mm256_castpd256_pd128(x), _mm256_extractf128_pd(x, 1)); }
+
+PYNEAR_AVX2 inline __m256 abs_diff(__m256 x, __m256 y) {
+    return _mm256_and_ps(_mm256_sub_ps(x, y), _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF)));
+}
 
-template <> int64_t hamming_u64<128>(const uint64_t *pa, const uint64_t *pb) {
+template <bool bounded> PYNEAR_AVX2 inline float l2_squared_impl(const float *x, const float *y, size_t d, float squaredBound) {
+    __m256 sum8 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        sum8 = _mm256_fmadd_ps(diff, diff, sum8);
+        if constexpr (bounded) {
+            if ((i + 8) % early_abandon_block == 0 && i + 8 < d && sse42::sum4(reduce_add(sum8)) > squaredBound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    __m128 sum = reduce_add(sum8);
+    if (i + 4 <= d) {
+        const __m128 diff = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+        sum = _mm_fmadd_ps(diff, diff, sum);
+        i += 4;
+    }
+    float result = sse42::sum4(sum);
+    for (; i < d; i++) {
+        const float diff = x[i] - y[i];
+        result += diff * diff;
+    }
+    return !bounded || result <= squaredBound ? result : std::numeric_limits<float>::infinity();
+}
 
-    __m256d result = _mm256_set_pd(_mm_popcnt_u64(pa[0] ^ pb[0]), _mm_popcnt_u64(pa[1] ^ pb[1]), 0, 0);
-    return (int64_t)sum4(result);
+template <bool bounded> PYNEAR_AVX2 inline float l1_impl(const float *x, const float *y, size_t d, float bound) {
+    __m256 sum8 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        sum8 = _mm256_add_ps(sum8, abs_diff(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+        if constexpr (bounded) {
+            if ((i + 8) % early_abandon_block == 0 && i + 8 < d && sse42::sum4(reduce_add(sum8)) > bound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    __m128 sum = reduce_add(sum8);
+    if (i + 4 <= d) {
+        sum = _mm_add_ps(sum, sse42::abs_diff(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+        i += 4;
+    }
+    float result = sse42::sum4(sum);
+    for (; i < d; i++) {
+        result += std::fabs(x[i] - y[i]);
+    }
+    return result;
 }
 
-template <> int64_t hamming_u64<256>(const uint64_t *pa, const uint64_t *pb) {
+template <bool bounded> PYNEAR_AVX2 inline float chebyshev_impl(const float *x, const float *y, size_t d, float bound) {
+    __m256 max_diff8 = _mm256_setzero_ps();
+    const __m256 bounds = _mm256_set1_ps(bound);
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        max_diff8 = _mm256_max_ps(max_diff8, abs_diff(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+        if constexpr (bounded) {
+            if ((i + 8) % early_abandon_block == 0 && i + 8 < d && _mm256_movemask_ps(_mm256_cmp_ps(max_diff8, bounds, _CMP_GT_OQ)) != 0) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    __m128 max_diff = reduce_max(max_diff8);
+    if (i + 4 <= d) {
+        max_diff = _mm_max_ps(max_diff, sse42::abs_diff(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+        i += 4;
+    }
+    float result = sse42::max4(max_diff);
+    for (; i < d; i++) {
+        result = std::max(result, std::fabs(x[i] - y[i]));
+    }
+    return result;
+}
 
-    __m256d result =
-        _mm256_set_pd(_mm_popcnt_u64(pa[0] ^ pb[0]), _mm_popcnt_u64(pa[1] ^ pb[1]), _mm_popcnt_u64(pa[2] ^ pb[2]), _mm_popcnt_u64(pa[3] ^ pb[3]));
-    return (int64_t)sum4(result);
+PYNEAR_AVX2 inline float l2_squared(const float *x, const float *y, size_t d) { return l2_squared_impl<false>(x, y, d, 0); }
+PYNEAR_AVX2 inline float l2_squared_bounded(const float *x, const float *y, size_t d, float squaredBound) {
+    return l2_squared_impl<true>(x, y, d, squaredBound);
 }
+PYNEAR_AVX2 inline float l1(const float *x, const float *y, size_t d) { return l1_impl<false>(x, y, d, 0); }
+PYNEAR_AVX2 inline float l1_bounded(const float *x, const float *y, size_t d, float bound) { return l1_impl<true>(x, y, d, bound); }
+PYNEAR_AVX2 inline float chebyshev(const float *x, const float *y, size_t d) { return chebyshev_impl<false>(x, y, d, 0); }
+PYNEAR_AVX2 inline float chebyshev_bounded(const float *x, const float *y, size_t d, float bound) { return chebyshev_impl<true>(x, y, d, bound); }
 
-template <> int64_t hamming_u64<512>(const uint64_t *pa, const uint64_t *pb) {
-    return _mm_popcnt_u64(pa[0] ^ pb[0]) + _mm_popcnt_u64(pa[1] ^ pb[1]) + _mm_popcnt_u64(pa[2] ^ pb[2]) + _mm_popcnt_u64(pa[3] ^ pb[3]) +
-           _mm_popcnt_u64(pa[4] ^ pb[4]) + _mm_popcnt_u64(pa[5] ^ pb[5]) + _mm_popcnt_u64(pa[6] ^ pb[6]) + _mm_popcnt_u64(pa[7] ^ pb[7]);
+PYNEAR_AVX2 inline __m256d abs_diff(__m256d x, __m256d y) {
+    return _mm256_and_pd(_mm256_sub_pd(x, y), _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL)));
 }
 
-inline float sum8(__m256 x) {
-    // hiQuad = ( x7, x6, x5, x4 )
-    const __m128 hiQuad = _mm256_extractf128_ps(x, 1);
-    // loQuad = ( x3, x2, x1, x0 )
-    const __m128 loQuad = _mm256_castps256_ps128(x);
-    // sumQuad = ( x3 + x7, x2 + x6, x1 + x5, x0 + x4 )
-    const __m128 sumQuad = _mm_add_ps(loQuad, hiQuad);
-    // loDual = ( -, -, x1 + x5, x0 + x4 )
-    const __m128 loDual = sumQuad;
-    // hiDual = ( -, -, x3 + x7, x2 + x6 )
-    const __m128 hiDual = _mm_movehl_ps(sumQuad, sumQuad);
-    // sumDual = ( -, -, x1 + x3 + x5 + x7, x0 + x2 + x4 + x6 )
-    const __m128 sumDual = _mm_add_ps(loDual, hiDual);
-    // lo = ( -, -, -, x0 + x2 + x4 + x6 )
-    const __m128 lo = sumDual;
-    // hi = ( -, -, -, x1 + x3 + x5 + x7 )
-    const __m128 hi = _mm_shuffle_ps(sumDual, sumDual, 0x1);
-    // sum = ( -, -, -, x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7 )
-    const __m128 sum = _mm_add_ss(lo, hi);
-    return _mm_cvtss_f32(sum);
+PYNEAR_AVX2 inline __m256d load4(const double *p) { return _mm256_loadu_pd(p); }
+PYNEAR_AVX2 inline __m256d load4(const int32_t *p) { return _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))); }
+PYNEAR_AVX2 inline __m256d load4(const int16_t *p) {
+    return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))));
 }
 
-double dist_l2_d_avx2(const arrayd &p1, const arrayd &p2) {
+template <typename T, bool bounded> PYNEAR_AVX2 inline double l2_squared_f64_impl(const T *x, const T *y, size_t d, double squaredBound) {
+    __m256d sum4 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= d; i += 4) {
+        const __m256d diff = _mm256_sub_pd(load4(x + i), load4(y + i));
+        sum4 = _mm256_fmadd_pd(diff, diff, sum4);
+        if constexpr (bounded) {
+            if ((i + 4) % early_abandon_block == 0 && i + 4 < d && sse42::sum2(reduce_add(sum4)) > squaredBound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    __m128d sum = reduce_add(sum4);
+    if (i + 2 <= d) {
+        const __m128d diff = _mm_sub_pd(sse42::load2(x + i), sse42::load2(y + i));
+        sum = _mm_fmadd_pd(diff, diff, sum);
+        i += 2;
+    }
+    double result = sse42::sum2(sum);
+    if (i < d) {
+        const double diff = static_cast<double>(x[i]) - static_cast<double>(y[i]);
+        result += diff * diff;
+    }
+    return !bounded || result <= squaredBound ? result : std::numeric_limits<double>::infinity();
+}
 
-    unsigned int i = p1.size() / 4;
-    __m256d result = _mm256_set_pd(0, 0, 0, 0);
+template <typename T, bool bounded> PYNEAR_AVX2 inline double l1_f64_impl(const T *x, const T *y, size_t d, double bound) {
+    __m256d sum4 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= d; i += 4) {
+        sum4 = _mm256_add_pd(sum4, abs_diff(load4(x + i), load4(y + i)));
+        if constexpr (bounded) {
+            if ((i + 4) % early_abandon_block == 0 && i + 4 < d && sse42::sum2(reduce_add(sum4)) > bound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    __m128d sum = reduce_add(sum4);
+    if (i + 2 <= d) {
+        sum = _mm_add_pd(sum, sse42::abs_diff(sse42::load2(x + i), sse42::load2(y + i)));
+        i += 2;
+    }
+    double result = sse42::sum2(sum);
+    if (i < d) {
+        result += std::fabs(static_cast<double>(x[i]) - static_cast<double>(y[i]));
+    }
+    return result;
+}
 
-    while (i--) {
-        __m256d x = _mm256_load_pd(&p1[4 * i]);
-        __m256d y = _mm256_load_pd(&p2[4 * i]);
+template <typename T, bool bounded> PYNEAR_AVX2 inline double chebyshev_f64_impl(const T *x, const T *y, size_t d, double bound) {
+    __m256d max_diff4 = _mm256_setzero_pd();
+    const __m256d bounds = _mm256_set1_pd(bound);
+    size_t i = 0;
+    for (; i + 4 <= d; i += 4) {
+        max_diff4 = _mm256_max_pd(max_diff4, abs_diff(load4(x + i), load4(y + i)));
+        if constexpr (bounded) {
+            if ((i + 4) % early_abandon_block == 0 && i + 4 < d && _mm256_movemask_pd(_mm256_cmp_pd(max_diff4, bounds, _CMP_GT_OQ)) != 0) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    __m128d max_diff = reduce_max(max_diff4);
+    if (i + 2 <= d) {
+        max_diff = _mm_max_pd(max_diff, sse42::abs_diff(sse42::load2(x + i), sse42::load2(y + i)));
+        i += 2;
+    }
+    double result = sse42::max2(max_diff);
+    if (i < d) {
+        result = std::max(result, std::fabs(static_cast<double>(x[i]) - static_cast<double>(y[i])));
+    }
+    return result;
+}
 
-        /* Compute the difference between the two vectors */
-        __m256d diff = _mm256_sub_pd(x, y);
+template <typename T> PYNEAR_AVX2 inline double l2_squared_f64(const T *x, const T *y, size_t d) { return l2_squared_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> PYNEAR_AVX2 inline double l2_squared_f64_bounded(const T *x, const T *y, size_t d, double squaredBound) {
+    return l2_squared_f64_impl<T, true>(x, y, d, squaredBound);
+}
+template <typename T> PYNEAR_AVX2 inline double l1_f64(const T *x, const T *y, size_t d) { return l1_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> PYNEAR_AVX2 inline double l1_f64_bounded(const T *x, const T *y, size_t d, double bound) {
+    return l1_f64_impl<T, true>(x, y, d, bound);
+}
+template <typename T> PYNEAR_AVX2 inline double chebyshev_f64(const T *x, const T *y, size_t d) { return chebyshev_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> PYNEAR_AVX2 inline double chebyshev_f64_bounded(const T *x, const T *y, size_t d, double bound) {
+    return chebyshev_f64_impl<T, true>(x, y, d, bound);
+}
 
-        __m256d temp = _mm256_mul_pd(diff, diff);
-        result = _mm256_add_pd(temp, result);
-        /* Multipl_mm256_mul_psy and add to result */
-        /* result = _mm256_fmadd_pd(diff, diff, result); */
+} // namespace avx2
+
+/*
+ *  512 bit kernels: FMA for L2 and masked loads of the last dimensions, which cannot fault on the memory they skip. With
+ *  VPOPCNTDQ, hamming distances count the bits of 8 words per instruction.
+ */
+namespace avx512 {
+
+#define PYNEAR_AVX512 PYNEAR_TARGET("avx512f,avx512vl,avx512bw,avx512dq,avx2,fma,popcnt")
+#define PYNEAR_AVX512_POPCNT PYNEAR_TARGET("avx512f,avx512vl,avx512bw,avx512dq,avx512vpopcntdq,avx2,fma,popcnt")
+
+// first n < 16 lanes
+PYNEAR_AVX512 inline __mmask16 tail_mask(size_t n) { return static_cast<__mmask16>((1u << n) - 1); }
+
+/*
+ *  Maxima and halves use zero masked intrinsics: with GCC 12, the unmasked ones (and the _mm512_reduce_* and casts built
+ *  on them) trip uninitialized variable warnings.
+ */
+PYNEAR_AVX512 inline __m512 max_ps(__m512 x, __m512 y) { return _mm512_maskz_max_ps(0xFFFF, x, y); }
+PYNEAR_AVX512 inline __m256 low_half(__m512 x) { return _mm512_maskz_extractf32x8_ps(0xFF, x, 0); }
+PYNEAR_AVX512 inline __m256 high_half(__m512 x) { return _mm512_maskz_extractf32x8_ps(0xFF, x, 1); }
+PYNEAR_AVX512 inline float sum16(__m512 x) { return sse42::sum4(avx2::reduce_add(_mm256_add_ps(low_half(x), high_half(x)))); }
+PYNEAR_AVX512 inline float max16(__m512 x) { return sse42::max4(avx2::reduce_max(_mm256_max_ps(low_half(x), high_half(x)))); }
+
+PYNEAR_AVX512 inline int64_t sum4_epi64(__m256i x) {
+    const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+}
+
+PYNEAR_AVX512 inline int64_t sum8_epi64(__m512i x) {
+    return sum4_epi64(_mm256_add_epi64(_mm512_maskz_extracti64x4_epi64(0xF, x, 0), _mm512_maskz_extracti64x4_epi64(0xF, x, 1)));
+}
+
+template <bool bounded> PYNEAR_AVX512 inline float l2_squared_impl(const float *x, const float *y, size_t d, float squaredBound) {
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+        if constexpr (bounded) {
+            if ((i + 16) % early_abandon_block == 0 && i + 16 < d && sum16(sum) > squaredBound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
     }
+    if (i < d) {
+        const __mmask16 tail = tail_mask(d - i);
+        const __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(tail, x + i), _mm512_maskz_loadu_ps(tail, y + i));
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+    }
+    const float result = sum16(sum);
+    return !bounded || result <= squaredBound ? result : std::numeric_limits<float>::infinity();
+}
 
-    double out = sum4(result);
-    return std::sqrt(out);
+template <bool bounded> PYNEAR_AVX512 inline float l1_impl(const float *x, const float *y, size_t d, float bound) {
+    __m512 sum = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        sum = _mm512_add_ps(sum, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i))));
+        if constexpr (bounded) {
+            if ((i + 16) % early_abandon_block == 0 && i + 16 < d && sum16(sum) > bound) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    if (i < d) {
+        const __mmask16 tail = tail_mask(d - i);
+        sum = _mm512_add_ps(sum, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(tail, x + i), _mm512_maskz_loadu_ps(tail, y + i))));
+    }
+    return sum16(sum);
 }
 
-// reads 0 <= d < 4 floats as __m128
-static inline __m128 masked_read(int d, const float *x) {
-    assert(0 <= d && d < 4);
-    ALIGN_AS(16) float buf[4] = {0, 0, 0, 0};
-    switch (d) {
-    case 3:
-        buf[2] = x[2];
-    case 2:
-        buf[1] = x[1];
-    case 1:
-        buf[0] = x[0];
+template <bool bounded> PYNEAR_AVX512 inline float chebyshev_impl(const float *x, const float *y, size_t d, float bound) {
+    __m512 max_diff = _mm512_setzero_ps();
+    const __m512 bounds = _mm512_set1_ps(bound);
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+        max_diff = max_ps(max_diff, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i))));
+        if constexpr (bounded) {
+            if ((i + 16) % early_abandon_block == 0 && i + 16 < d && _mm512_cmp_ps_mask(max_diff, bounds, _CMP_GT_OQ) != 0) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    if (i < d) {
+        const __mmask16 tail = tail_mask(d - i);
+        max_diff = max_ps(max_diff, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(tail, x + i), _mm512_maskz_loadu_ps(tail, y + i))));
     }
-    return _mm_load_ps(buf);
-    // cannot use AVX2 _mm_mask_set1_epi32
+    return max16(max_diff);
+}
+
+PYNEAR_AVX512 inline float l2_squared(const float *x, const float *y, size_t d) { return l2_squared_impl<false>(x, y, d, 0); }
+PYNEAR_AVX512 inline float l2_squared_bounded(const float *x, const float *y, size_t d, float squaredBound) {
+    return l2_squared_impl<true>(x, y, d, squaredBound);
 }
+PYNEAR_AVX512 inline float l1(const float *x, const float *y, size_t d) { return l1_impl<false>(x, y, d, 0); }
+PYNEAR_AVX512 inline float l1_bounded(const float *x, const float *y, size_t d, float bound) { return l1_impl<true>(x, y, d, bound); }
+PYNEAR_AVX512 inline float chebyshev(const float *x, const float *y, size_t d) { return chebyshev_impl<false>(x, y, d, 0); }
+PYNEAR_AVX512 inline float chebyshev_bounded(const float *x, const float *y, size_t d, float bound) { return chebyshev_impl<true>(x, y, d, bound); }
 
-float dist_l2_f_avx2(const arrayf &p1, const arrayf &p2) {
-    unsigned int d = p1.size();
-    __m256 msum1 = _mm256_setzero_ps();
+/* 8 doubles, with the first n < 8 lanes of the masked loads of the last dimensions */
+PYNEAR_AVX512 inline __mmask8 tail_mask8(size_t n) { return static_cast<__mmask8>((1u << n) - 1); }
+
+PYNEAR_AVX512 inline __m512d load8(const double *p) { return _mm512_loadu_pd(p); }
+PYNEAR_AVX512 inline __m512d load8(const int32_t *p) {
+    return _mm512_maskz_cvtepi32_pd(0xFF, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+}
+PYNEAR_AVX512 inline __m512d load8(const int16_t *p) {
+    return _mm512_maskz_cvtepi32_pd(0xFF, _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))));
+}
+
+PYNEAR_AVX512 inline __m512d load8(const double *p, __mmask8 mask) { return _mm512_maskz_loadu_pd(mask, p); }
+PYNEAR_AVX512 inline __m512d load8(const int32_t *p, __mmask8 mask) { return _mm512_maskz_cvtepi32_pd(0xFF, _mm256_maskz_loadu_epi32(mask, p)); }
+PYNEAR_AVX512 inline __m512d load8(const int16_t *p, __mmask8 mask) {
+    return _mm512_maskz_cvtepi32_pd(0xFF, _mm256_cvtepi16_epi32(_mm_maskz_loadu_epi16(mask, p)));
+}
+
+PYNEAR_AVX512 inline __m512d max_pd(__m512d x, __m512d y) { return _mm512_maskz_max_pd(0xFF, x, y); }
+PYNEAR_AVX512 inline __m256d low_half(__m512d x) { return _mm512_maskz_extractf64x4_pd(0xF, x, 0); }
+PYNEAR_AVX512 inline __m256d high_half(__m512d x) { return _mm512_maskz_extractf64x4_pd(0xF, x, 1); }
+PYNEAR_AVX512 inline double sum8(__m512d x) { return sse42::sum2(avx2::reduce_add(_mm256_add_pd(low_half(x), high_half(x)))); }
+PYNEAR_AVX512 inline double max8(__m512d x) { return sse42::max2(avx2::reduce_max(_mm256_max_pd(low_half(x), high_half(x)))); }
+
+template <typename T, bool bounded> PYNEAR_AVX512 inline double l2_squared_f64_impl(const T *x, const T *y, size_t d, double squaredBound) {
+    __m512d sum = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        const __m512d diff = _mm512_sub_pd(load8(x + i), load8(y + i));
+        sum = _mm512_fmadd_pd(diff, diff, sum);
+        if constexpr (bounded) {
+            if ((i + 8) % early_abandon_block == 0 && i + 8 < d && sum8(sum) > squaredBound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    if (i < d) {
+        const __mmask8 tail = tail_mask8(d - i);
+        const __m512d diff = _mm512_sub_pd(load8(x + i, tail), load8(y + i, tail));
+        sum = _mm512_fmadd_pd(diff, diff, sum);
+    }
+    const double result = sum8(sum);
+    return !bounded || result <= squaredBound ? result : std::numeric_limits<double>::infinity();
+}
 
-    const float *x = &(p1[0]);
-    const float *y = &(p2[0]);
+template <typename T, bool bounded> PYNEAR_AVX512 inline double l1_f64_impl(const T *x, const T *y, size_t d, double bound) {
+    __m512d sum = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        sum = _mm512_add_pd(sum, _mm512_abs_pd(_mm512_sub_pd(load8(x + i), load8(y + i))));
+        if constexpr (bounded) {
+            if ((i + 8) % early_abandon_block == 0 && i + 8 < d && sum8(sum) > bound) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+    if (i < d) {
+        const __mmask8 tail = tail_mask8(d - i);
+        sum = _mm512_add_pd(sum, _mm512_abs_pd(_mm512_sub_pd(load8(x + i, tail), load8(y + i, tail))));
+    }
+    return sum8(sum);
+}
 
-    while (d >= 8) {
-        __m256 mx = _mm256_loadu_ps(x);
-        x += 8;
-        __m256 my = _mm256_loadu_ps(y);
-        y += 8;
-        const __m256 a_m_b1 = _mm256_sub_ps(mx, my);
-        msum1 = _mm256_add_ps(msum1, _mm256_mul_ps(a_m_b1, a_m_b1));
-        d -= 8;
+template <typename T, bool bounded> PYNEAR_AVX512 inline double chebyshev_f64_impl(const T *x, const T *y, size_t d, double bound) {
+    __m512d max_diff = _mm512_setzero_pd();
+    const __m512d bounds = _mm512_set1_pd(bound);
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+        max_diff = max_pd(max_diff, _mm512_abs_pd(_mm512_sub_pd(load8(x + i), load8(y + i))));
+        if constexpr (bounded) {
+            if ((i + 8) % early_abandon_block == 0 && i + 8 < d && _mm512_cmp_pd_mask(max_diff, bounds, _CMP_GT_OQ) != 0) {
+                return std::numeric_limits<double>::infinity();
+            }
+        }
     }
+    if (i < d) {
+        const __mmask8 tail = tail_mask8(d - i);
+        max_diff = max_pd(max_diff, _mm512_abs_pd(_mm512_sub_pd(load8(x + i, tail), load8(y + i, tail))));
+    }
+    return max8(max_diff);
+}
+
+template <typename T> PYNEAR_AVX512 inline double l2_squared_f64(const T *x, const T *y, size_t d) {
+    return l2_squared_f64_impl<T, false>(x, y, d, 0);
+}
+template <typename T> PYNEAR_AVX512 inline double l2_squared_f64_bounded(const T *x, const T *y, size_t d, double squaredBound) {
+    return l2_squared_f64_impl<T, true>(x, y, d, squaredBound);
+}
+template <typename T> PYNEAR_AVX512 inline double l1_f64(const T *x, const T *y, size_t d) { return l1_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> PYNEAR_AVX512 inline double l1_f64_bounded(const T *x, const T *y, size_t d, double bound) {
+    return l1_f64_impl<T, true>(x, y, d, bound);
+}
+template <typename T> PYNEAR_AVX512 inline double chebyshev_f64(const T *x, const T *y, size_t d) { return chebyshev_f64_impl<T, false>(x, y, d, 0); }
+template <typename T> PYNEAR_AVX512 inline double chebyshev_f64_bounded(const T *x, const T *y, size_t d, double bound) {
+    return chebyshev_f64_impl<T, true>(x, y, d, bound);
+}
 
-    __m128 msum2 = _mm256_extractf128_ps(msum1, 1);
-    msum2 = _mm_add_ps(msum2, _mm256_extractf128_ps(msum1, 0));
+// bit counts of the 8 words of a ^ b
+PYNEAR_AVX512_POPCNT inline __m512i popcount_xor(const uint8_t *a, const uint8_t *b) {
+    return _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(a), _mm512_loadu_si512(b)));
+}
 
-    if (d >= 4) {
-        __m128 mx = _mm_loadu_ps(x);
-        x += 4;
-        __m128 my = _mm_loadu_ps(y);
-        y += 4;
-        const __m128 a_m_b1 = _mm_sub_ps(mx, my);
-        msum2 = _mm_add_ps(msum2, _mm_mul_ps(a_m_b1, a_m_b1));
-        d -= 4;
+template <bool bounded> PYNEAR_AVX512_POPCNT inline int64_t hamming_impl(const uint8_t *a, const uint8_t *b, size_t size, int64_t bound) {
+    __m512i sum = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        sum = _mm512_add_epi64(sum, popcount_xor(a + i, b + i));
+        if constexpr (bounded) {
+            if (i + 64 < size && sum8_epi64(sum) > bound) {
+                return sum8_epi64(sum);
+            }
+        }
+    }
+    if (i < size) {
+        const __mmask64 tail = (1ULL << (size - i)) - 1;
+        const __m512i bits = _mm512_xor_si512(_mm512_maskz_loadu_epi8(tail, a + i), _mm512_maskz_loadu_epi8(tail, b + i));
+        sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(bits));
     }
+    return sum8_epi64(sum);
+}
+
+PYNEAR_AVX512_POPCNT inline int64_t hamming(const uint8_t *a, const uint8_t *b, size_t size) { return hamming_impl<false>(a, b, size, 0); }
+PYNEAR_AVX512_POPCNT inline int64_t hamming_bounded(const uint8_t *a, const uint8_t *b, size_t size, int64_t bound) {
+    return hamming_impl<true>(a, b, size, bound);
+}
 
-    if (d > 0) {
-        __m128 mx = masked_read(d, x);
-        __m128 my = masked_read(d, y);
-        const __m128 a_m_b1 = _mm_sub_ps(mx, my);
-        msum2 = _mm_add_ps(msum2, _mm_mul_ps(a_m_b1, a_m_b1));
+PYNEAR_AVX512_POPCNT inline int64_t hamming_256(const uint8_t *a, const uint8_t *b) {
+    const __m256i bits = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a)),
+                                          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b)));
+    return sum4_epi64(_mm256_popcnt_epi64(bits));
+}
+
+// a single instruction counts the whole code, so there is nothing to gain from checking a bound halfway
+PYNEAR_AVX512_POPCNT inline int64_t hamming_512(const uint8_t *a, const uint8_t *b) { return sum8_epi64(popcount_xor(a, b)); }
+PYNEAR_AVX512_POPCNT inline int64_t hamming_512_bounded(const uint8_t *a, const uint8_t *b, int64_t) { return hamming_512(a, b); }
+
+PYNEAR_AVX512_POPCNT inline int64_t hamming_1024(const uint8_t *a, const uint8_t *b) {
+    return sum8_epi64(_mm512_add_epi64(popcount_xor(a, b), popcount_xor(a + 64, b + 64)));
+}
+
+} // namespace avx512
+
+} // namespace distance_kernels
+
+/* Kernels of vectors of T (double, int16_t or int32_t) computed in double precision */
+template <typename T> struct Float64Kernels {
+    double (*l2Squared)(const T *, const T *, size_t);
+    double (*l2SquaredBounded)(const T *, const T *, size_t, double);
+    double (*l1)(const T *, const T *, size_t);
+    double (*l1Bounded)(const T *, const T *, size_t, double);
+    double (*chebyshev)(const T *, const T *, size_t);
+    double (*chebyshevBounded)(const T *, const T *, size_t, double);
+};
+
+// Float64Kernels of the given level, which the CPU must support
+template <typename T> inline Float64Kernels<T> float64KernelsFor(vptree::SimdLevel level) {
+    namespace generic = distance_kernels::generic;
+    namespace sse42 = distance_kernels::sse42;
+    namespace avx2 = distance_kernels::avx2;
+    namespace avx512 = distance_kernels::avx512;
+
+    if (level >= vptree::SimdLevel::AVX512) {
+        return {avx512::l2_squared_f64<T>, avx512::l2_squared_f64_bounded<T>, avx512::l1_f64<T>,
+                avx512::l1_f64_bounded<T>, avx512::chebyshev_f64<T>, avx512::chebyshev_f64_bounded<T>};
     }
+    if (level >= vptree::SimdLevel::AVX2) {
+        return {avx2::l2_squared_f64<T>, avx2::l2_squared_f64_bounded<T>, avx2::l1_f64<T>,
+                avx2::l1_f64_bounded<T>, avx2::chebyshev_f64<T>, avx2::chebyshev_f64_bounded<T>};
+    }
+    if (level >= vptree::SimdLevel::SSE42) {
+        return {sse42::l2_squared_f64<T>, sse42::l2_squared_f64_bounded<T>, sse42::l1_f64<T>,
+                sse42::l1_f64_bounded<T>, sse42::chebyshev_f64<T>, sse42::chebyshev_f64_bounded<T>};
+    }
+    return {generic::l2_squared_f64<T>, generic::l2_squared_f64_bounded<T>, generic::l1_f64<T>,
+            generic::l1_f64_bounded<T>, generic::chebyshev_f64<T>, generic::chebyshev_f64_bounded<T>};
+}
 
-    msum2 = _mm_hadd_ps(msum2, msum2);
-    msum2 = _mm_hadd_ps(msum2, msum2);
-    float result = _mm_cvtss_f32(msum2);
-    return std::sqrt(result);
+/*
+ *  Kernels of one instruction set level. Every level has all of them, lower levels filling in the ones a level has no
+ *  faster version of.
+ */
+struct DistanceKernels {
+    vptree::SimdLevel level;
+
+    float (*l2Squared)(const float *, const float *, size_t);
+    float (*l2SquaredBounded)(const float *, const float *, size_t, float);
+    float (*l1)(const float *, const float *, size_t);
+    float (*l1Bounded)(const float *, const float *, size_t, float);
+    float (*chebyshev)(const float *, const float *, size_t);
+    float (*chebyshevBounded)(const float *, const float *, size_t, float);
+
+    int64_t (*hamming)(const uint8_t *, const uint8_t *, size_t);
+    int64_t (*hammingBounded)(const uint8_t *, const uint8_t *, size_t, int64_t);
+    int64_t (*hamming64)(const uint8_t *, const uint8_t *);
+    int64_t (*hamming128)(const uint8_t *, const uint8_t *);
+    int64_t (*hamming256)(const uint8_t *, const uint8_t *);
+    int64_t (*hamming512)(const uint8_t *, const uint8_t *);
+    int64_t (*hamming512Bounded)(const uint8_t *, const uint8_t *, int64_t);
+    int64_t (*hamming1024)(const uint8_t *, const uint8_t *);
+
+    Float64Kernels<double> float64;
+    Float64Kernels<int16_t> int16;
+    Float64Kernels<int32_t> int32;
+};
+
+// Kernels of the given level, which the CPU must support
+inline DistanceKernels distanceKernelsFor(vptree::SimdLevel level) {
+    namespace generic = distance_kernels::generic;
+    namespace sse42 = distance_kernels::sse42;
+    namespace avx2 = distance_kernels::avx2;
+    namespace avx512 = distance_kernels::avx512;
+
+    DistanceKernels kernels = {level,
+                               generic::l2_squared,
+                               generic::l2_squared_bounded,
+                               generic::l1,
+                               generic::l1_bounded,
+                               generic::chebyshev,
+                               generic::chebyshev_bounded,
+                               generic::hamming,
+                               generic::hamming_bounded,
+                               generic::hamming_64,
+                               generic::hamming_128,
+                               generic::hamming_256,
+                               generic::hamming_512,
+                               generic::hamming_512_bounded,
+                               generic::hamming_1024,
+                               float64KernelsFor<double>(level),
+                               float64KernelsFor<int16_t>(level),
+                               float64KernelsFor<int32_t>(level)};
+
+    if (level >= vptree::SimdLevel::SSE42) {
+        kernels.l2Squared = sse42::l2_squared;
+        kernels.l2SquaredBounded = sse42::l2_squared_bounded;
+        kernels.l1 = sse42::l1;
+        kernels.l1Bounded = sse42::l1_bounded;
+        kernels.chebyshev = sse42::chebyshev;
+        kernels.chebyshevBounded = sse42::chebyshev_bounded;
+        kernels.hamming = sse42::hamming;
+        kernels.hammingBounded = sse42::hamming_bounded;
+        kernels.hamming64 = sse42::hamming_64;
+        kernels.hamming128 = sse42::hamming_128;
+        kernels.hamming256 = sse42::hamming_256;
+        kernels.hamming512 = sse42::hamming_512;
+        kernels.hamming512Bounded = sse42::hamming_512_bounded;
+        kernels.hamming1024 = sse42::hamming_1024;
+    }
+
+    if (level >= vptree::SimdLevel::AVX2) {
+        kernels.l2Squared = avx2::l2_squared;
+        kernels.l2SquaredBounded = avx2::l2_squared_bounded;
+        kernels.l1 = avx2::l1;
+        kernels.l1Bounded = avx2::l1_bounded;
+        kernels.chebyshev = avx2::chebyshev;
+        kernels.chebyshevBounded = avx2::chebyshev_bounded;
+    }
+
+    if (level >= vptree::SimdLevel::AVX512) {
+        kernels.l2Squared = avx512::l2_squared;
+        kernels.l2SquaredBounded = avx512::l2_squared_bounded;
+        kernels.l1 = avx512::l1;
+        kernels.l1Bounded = avx512::l1_bounded;
+        kernels.chebyshev = avx512::chebyshev;
+        kernels.chebyshevBounded = avx512::chebyshev_bounded;
+
+        // the 64 and 128 bit codes are a couple of POPCNT instructions already
+        if (vptree::detectAvx512Popcount()) {
+            kernels.hamming = avx512::hamming;
+            kernels.hammingBounded = avx512::hamming_bounded;
+            kernels.hamming256 = avx512::hamming_256;
+            kernels.hamming512 = avx512::hamming_512;
+            kernels.hamming512Bounded = avx512::hamming_512_bounded;
+            kernels.hamming1024 = avx512::hamming_1024;
+        }
+    }
+
+    return kernels;
 }
 
-double dist_l2_d(const arrayd &p1, const arrayd &p2) {
+// Selected when the module is loaded
+inline DistanceKernels activeDistanceKernels = distanceKernelsFor(vptree::selectSimdLevel());
+
+/* Squared L2 distance: comparisons against a squared bound need no square root */
+inline float dist_l2_squared_f_avx2(const arrayf &p1, const arrayf &p2) { return activeDistanceKernels.l2Squared(p1.data(), p2.data(), p1.size()); }
+
+inline float dist_l2_f_avx2(const arrayf &p1, const arrayf &p2) { return std::sqrt(dist_l2_squared_f_avx2(p1, p2)); }
+
+inline float dist_l2_squared_f_avx2_bounded(const arrayf &p1, const arrayf &p2, float squaredBound) {
+    return activeDistanceKernels.l2SquaredBounded(p1.data(), p2.data(), p1.size(), squaredBound);
+}
+
+/*
+ *  Points are compared in squared space, so only the ones within bound pay for a square root. Squares and partial sums
+ *  are rounded differently than the distance, so the squared bound gets a little slack: points right at the bound get
+ *  their exact distance, which may end up just above it.
+ */
+inline float dist_l2_f_avx2_bounded(const arrayf &p1, const arrayf &p2, float bound) {
+    const float squaredBound = bound * bound * (1 + 1e-6f);
+    const float squared = dist_l2_squared_f_avx2_bounded(p1, p2, squaredBound);
+    return squared <= squaredBound ? std::sqrt(squared) : std::numeric_limits<float>::infinity();
+}
+
+inline double dist_l2_d(const arrayd &p1, const arrayd &p2) {
 
     double result = 0;
     size_t i = p1.size();
@@ -276,7 +1042,7 @@ double dist_l2_d(const arrayd &p1, const arrayd &p2) {
     return std::sqrt(result);
 }
 
-float dist_l2_f(const arrayf &p1, const arrayf &p2) {
+inline float dist_l2_f(const arrayf &p1, const arrayf &p2) {
 
     float result = 0.;
     size_t i = p1.size();
@@ -288,7 +1054,7 @@ float dist_l2_f(const arrayf &p1, const arrayf &p2) {
     return std::sqrt(result);
 }
 
-float dist_l1_f(const arrayf &p1, const arrayf &p2) {
+inline float dist_l1_f(const arrayf &p1, const arrayf &p2) {
     /* L1 metric, also called Manhattan or taxicab metric */
 
     float result = 0.;
@@ -300,43 +1066,16 @@ float dist_l1_f(const arrayf &p1, const arrayf &p2) {
     return result;
 }
 
-float dist_l1_f_avx2(const arrayf &p1, const arrayf &p2) {
+inline float dist_l1_f_avx2(const arrayf &p1, const arrayf &p2) {
     /* SIMD L1 metric, also called Manhattan or taxicab metric */
+    return activeDistanceKernels.l1(p1.data(), p2.data(), p1.size());
+}
 
-    const float *vec1 = &(p1[0]);
-    const float *vec2 = &(p2[0]);
-    size_t size = p1.size();
-
-    const size_t blocksize = 8;
-    size_t i = 0;
-
-    __m256 sum = _mm256_setzero_ps();
-
-    for (; i + blocksize <= size; i += blocksize) {
-        __m256 v1 = _mm256_loadu_ps(&vec1[i]);
-        __m256 v2 = _mm256_loadu_ps(&vec2[i]);
-
-        __m256 diff = _mm256_sub_ps(v1, v2);
-        sum = _mm256_add_ps(sum, _mm256_and_ps(diff, _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF))));
-    }
-
-    ALIGN_AS(32) float result[8];
-    _mm256_store_ps(result, sum);
-
-    float total_sum = 0.;
-    for (int j = 0; j < 8; ++j) {
-        total_sum += result[j];
-    }
-
-    // Calculate the remaining elements
-    for (; i < size; ++i) {
-        total_sum += std::fabs(vec1[i] - vec2[i]);
-    }
-
-    return total_sum;
+inline float dist_l1_f_avx2_bounded(const arrayf &p1, const arrayf &p2, float bound) {
+    return activeDistanceKernels.l1Bounded(p1.data(), p2.data(), p1.size(), bound);
 }
 
-float dist_chebyshev_f(const arrayf &p1, const arrayf &p2) {
+inline float dist_chebyshev_f(const arrayf &p1, const arrayf &p2) {
     /* Chebyshev distance metric, also called maximum metric or L_inf metric */
 
     float result = 0.;
@@ -351,87 +1090,163 @@ float dist_chebyshev_f(const arrayf &p1, const arrayf &p2) {
     return result;
 }
 
-float dist_chebyshev_f_avx2(const arrayf &p1, const arrayf &p2) {
+inline float dist_chebyshev_f_avx2(const arrayf &p1, const arrayf &p2) {
     /* SIMD Chebyshev distance metric, also called maximum metric or L_inf metric */
+    return activeDistanceKernels.chebyshev(p1.data(), p2.data(), p1.size());
+}
 
-    const float *vec1 = &(p1[0]);
-    const float *vec2 = &(p2[0]);
-    size_t size = p1.size();
-
-    const size_t blocksize = 8;
-    size_t i = 0;
+inline float dist_chebyshev_f_avx2_bounded(const arrayf &p1, const arrayf &p2, float bound) {
+    return activeDistanceKernels.chebyshevBounded(p1.data(), p2.data(), p1.size(), bound);
+}
 
-    __m256 max_diff = _mm256_setzero_ps();
+/*
+ *  Distances of double, int16 and int32 vectors, all returned as doubles. L2 ones get the same squared bound slack as
+ *  dist_l2_f_avx2_bounded, scaled to double rounding.
+ */
+template <typename T>
+inline double dist_l2_f64_bounded(const Float64Kernels<T> &kernels, const std::vector<T> &p1, const std::vector<T> &p2, double bound) {
+    const double squaredBound = bound * bound * (1 + 1e-12);
+    const double squared = kernels.l2SquaredBounded(p1.data(), p2.data(), p1.size(), squaredBound);
+    return squared <= squaredBound ? std::sqrt(squared) : std::numeric_limits<double>::infinity();
+}
 
-    for (; i + blocksize <= size; i += blocksize) {
-        __m256 v1 = _mm256_loadu_ps(&vec1[i]);
-        __m256 v2 = _mm256_loadu_ps(&vec2[i]);
-        __m256 diff = _mm256_sub_ps(v1, v2);
-        diff = _mm256_and_ps(diff, _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF))); // Absolute value
-        max_diff = _mm256_max_ps(max_diff, diff);
-    }
+inline double dist_l2_d_avx2(const arrayd &p1, const arrayd &p2) {
+    return std::sqrt(activeDistanceKernels.float64.l2Squared(p1.data(), p2.data(), p1.size()));
+}
+inline double dist_l2_d_avx2_bounded(const arrayd &p1, const arrayd &p2, double bound) {
+    return dist_l2_f64_bounded(activeDistanceKernels.float64, p1, p2, bound);
+}
+inline double dist_l1_d_avx2(const arrayd &p1, const arrayd &p2) { return activeDistanceKernels.float64.l1(p1.data(), p2.data(), p1.size()); }
+inline double dist_l1_d_avx2_bounded(const arrayd &p1, const arrayd &p2, double bound) {
+    return activeDistanceKernels.float64.l1Bounded(p1.data(), p2.data(), p1.size(), bound);
+}
+inline double dist_chebyshev_d_avx2(const arrayd &p1, const arrayd &p2) {
+    return activeDistanceKernels.float64.chebyshev(p1.data(), p2.data(), p1.size());
+}
+inline double dist_chebyshev_d_avx2_bounded(const arrayd &p1, const arrayd &p2, double bound) {
+    return activeDistanceKernels.float64.chebyshevBounded(p1.data(), p2.data(), p1.size(), bound);
+}
 
-    ALIGN_AS(32) float result[8];
-    _mm256_store_ps(result, max_diff);
+inline double dist_l2_i16(const arrayi16 &p1, const arrayi16 &p2) {
+    return std::sqrt(activeDistanceKernels.int16.l2Squared(p1.data(), p2.data(), p1.size()));
+}
+inline double dist_l2_i16_bounded(const arrayi16 &p1, const arrayi16 &p2, double bound) {
+    return dist_l2_f64_bounded(activeDistanceKernels.int16, p1, p2, bound);
+}
+inline double dist_l1_i16(const arrayi16 &p1, const arrayi16 &p2) { return activeDistanceKernels.int16.l1(p1.data(), p2.data(), p1.size()); }
+inline double dist_l1_i16_bounded(const arrayi16 &p1, const arrayi16 &p2, double bound) {
+    return activeDistanceKernels.int16.l1Bounded(p1.data(), p2.data(), p1.size(), bound);
+}
+inline double dist_chebyshev_i16(const arrayi16 &p1, const arrayi16 &p2) {
+    return activeDistanceKernels.int16.chebyshev(p1.data(), p2.data(), p1.size());
+}
+inline double dist_chebyshev_i16_bounded(const arrayi16 &p1, const arrayi16 &p2, double bound) {
+    return activeDistanceKernels.int16.chebyshevBounded(p1.data(), p2.data(), p1.size(), bound);
+}
 
-    float max_distance = result[0];
-    for (int i = 1; i < 8; ++i) {
-        max_distance = std::max(max_distance, result[i]);
-    }
+inline double dist_l2_i32(const arrayi32 &p1, const arrayi32 &p2) {
+    return std::sqrt(activeDistanceKernels.int32.l2Squared(p1.data(), p2.data(), p1.size()));
+}
+inline double dist_l2_i32_bounded(const arrayi32 &p1, const arrayi32 &p2, double bound) {
+    return dist_l2_f64_bounded(activeDistanceKernels.int32, p1, p2, bound);
+}
+inline double dist_l1_i32(const arrayi32 &p1, const arrayi32 &p2) { return activeDistanceKernels.int32.l1(p1.data(), p2.data(), p1.size()); }
+inline double dist_l1_i32_bounded(const arrayi32 &p1, const arrayi32 &p2, double bound) {
+    return activeDistanceKernels.int32.l1Bounded(p1.data(), p2.data(), p1.size(), bound);
+}
+inline double dist_chebyshev_i32(const arrayi32 &p1, const arrayi32 &p2) {
+    return activeDistanceKernels.int32.chebyshev(p1.data(), p2.data(), p1.size());
+}
+inline double dist_chebyshev_i32_bounded(const arrayi32 &p1, const arrayi32 &p2, double bound) {
+    return activeDistanceKernels.int32.chebyshevBounded(p1.data(), p2.data(), p1.size(), bound);
+}
 
-    // Calculate the remaining elements
-    for (; i < size; ++i) {
-        float diff = std::fabs(vec1[i] - vec2[i]);
-        max_distance = std::max(max_distance, diff);
-    }
+inline int64_t dist_hamming(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming(p1.data(), p2.data(), p1.size()); }
 
-    return max_distance;
+inline int64_t dist_hamming_bounded(const arrayli &p1, const arrayli &p2, int64_t bound) {
+    return activeDistanceKernels.hammingBounded(p1.data(), p2.data(), p1.size(), bound);
 }
 
-int64_t dist_hamming(const arrayli &p1, const arrayli &p2) {
-    size_t size = p1.size();
+inline int64_t dist_hamming_512(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming512(p1.data(), p2.data()); }
 
-    if (size % 8 == 0) {
-        return hamming_u64(p1, p2);
-    } else if (size % 4 == 0) {
-        return static_cast<int64_t>(hamming_u32(p1, p2));
-    } else if (size % 2 == 0) {
-        return static_cast<int64_t>(hamming_u16(p1, p2));
-    } else {
-        return static_cast<int64_t>(hamming_u8(p1, p2));
-    }
+inline int64_t dist_hamming_512_bounded(const arrayli &p1, const arrayli &p2, int64_t bound) {
+    return activeDistanceKernels.hamming512Bounded(p1.data(), p2.data(), bound);
 }
 
-inline int64_t dist_hamming_512(const arrayli &p1, const arrayli &p2) {
+inline int64_t dist_hamming_1024(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming1024(p1.data(), p2.data()); }
 
-    return hamming_u64<512>(reinterpret_cast<const uint64_t *>(&p1[0]), reinterpret_cast<const uint64_t *>(&p2[0]));
-}
+inline int64_t dist_hamming_256(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming256(p1.data(), p2.data()); }
 
-inline int64_t dist_hamming_256(const arrayli &p1, const arrayli &p2) {
+inline int64_t dist_hamming_128(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming128(p1.data(), p2.data()); }
 
-    return hamming_u64<256>(reinterpret_cast<const uint64_t *>(&p1[0]), reinterpret_cast<const uint64_t *>(&p2[0]));
-}
+inline int64_t dist_hamming_64(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming64(p1.data(), p2.data()); }
 
-inline int64_t dist_hamming_128(const arrayli &p1, const arrayli &p2) {
+inline int64_t dist_hamming_32(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming(p1.data(), p2.data(), 4); }
 
-    return hamming_u64<128>(reinterpret_cast<const uint64_t *>(&p1[0]), reinterpret_cast<const uint64_t *>(&p2[0]));
-}
+inline int64_t dist_hamming_16(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming(p1.data(), p2.data(), 2); }
 
-inline int64_t dist_hamming_64(const arrayli &p1, const arrayli &p2) {
-    return hamming_u64<64>(reinterpret_cast<const uint64_t *>(&p1[0]), reinterpret_cast<const uint64_t *>(&p2[0]));
-}
+inline int64_t dist_hamming_8(const arrayli &p1, const arrayli &p2) { return activeDistanceKernels.hamming(p1.data(), p2.data(), 1); }
 
-inline int64_t dist_hamming_32(const arrayli &p1, const arrayli &p2) {
+/*
+ *  bounded_distance<distance>::function is the early abandon version of distance, or nullptr if it has none (short
+ *  vectors gain nothing from checking a bound).
+ */
+template <auto distance> struct bounded_distance {
+    static constexpr std::nullptr_t function = nullptr;
+};
 
-    return static_cast<int64_t>(hamming_u32<32>(reinterpret_cast<const uint32_t *>(&p1[0]), reinterpret_cast<const uint32_t *>(&p2[0])));
-}
+template <> struct bounded_distance<dist_l2_f_avx2> {
+    static constexpr auto function = dist_l2_f_avx2_bounded;
+};
 
-inline int64_t dist_hamming_16(const arrayli &p1, const arrayli &p2) {
+template <> struct bounded_distance<dist_l1_f_avx2> {
+    static constexpr auto function = dist_l1_f_avx2_bounded;
+};
 
-    return static_cast<int64_t>(hamming_u16<16>(reinterpret_cast<const uint16_t *>(&p1[0]), reinterpret_cast<const uint16_t *>(&p2[0])));
-}
+template <> struct bounded_distance<dist_chebyshev_f_avx2> {
+    static constexpr auto function = dist_chebyshev_f_avx2_bounded;
+};
 
-inline int64_t dist_hamming_8(const arrayli &p1, const arrayli &p2) {
+template <> struct bounded_distance<dist_hamming> {
+    static constexpr auto function = dist_hamming_bounded;
+};
 
-    return static_cast<int64_t>(hamming_u8<8>(reinterpret_cast<const uint8_t *>(&p1[0]), reinterpret_cast<const uint8_t *>(&p2[0])));
-}
+template <> struct bounded_distance<dist_hamming_512> {
+    static constexpr auto function = dist_hamming_512_bounded;
+};
+
+template <> struct bounded_distance<dist_l2_d_avx2> {
+    static constexpr auto function = dist_l2_d_avx2_bounded;
+};
+
+template <> struct bounded_distance<dist_l1_d_avx2> {
+    static constexpr auto function = dist_l1_d_avx2_bounded;
+};
+
+template <> struct bounded_distance<dist_chebyshev_d_avx2> {
+    static constexpr auto function = dist_chebyshev_d_avx2_bounded;
+};
+
+template <> struct bounded_distance<dist_l2_i16> {
+    static constexpr auto function = dist_l2_i16_bounded;
+};
+
+template <> struct bounded_distance<dist_l1_i16> {
+    static constexpr auto function = dist_l1_i16_bounded;
+};
+
+template <> struct bounded_distance<dist_chebyshev_i16> {
+    static constexpr auto function = dist_chebyshev_i16_bounded;
+};
+
+template <> struct bounded_distance<dist_l2_i32> {
+    static constexpr auto function = dist_l2_i32_bounded;
+};
+
+template <> struct bounded_distance<dist_l1_i32> {
+    static constexpr auto function = dist_l1_i32_bounded;
+};
+
+template <> struct bounded_distance<dist_chebyshev_i32> {
+    static constexpr auto function = dist_chebyshev_i32_bounded;
+};
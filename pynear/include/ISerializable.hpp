@@ -82,7 +82,7 @@ class ISerializable {
     virtual void deserialize(const SerializedState &state) = 0;
 };
 
-std::ostream &operator<<(std::ostream &os, const SerializedState &state) {
+inline std::ostream &operator<<(std::ostream &os, const SerializedState &state) {
     for (size_t i = 0; i < state.data.size(); i++) {
         os << state.data[i];
     }
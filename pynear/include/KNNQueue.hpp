@@ -0,0 +1,212 @@
+/*
+ *  MIT Licence
+ *  Copyright 2021 Pablo Carneiro Elias
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <immintrin.h>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+namespace vptree {
+
+/*
+ *  Containers keeping the k closest elements found so far during a search. Both containers share the same interface:
+ *
+ *      push(index, dist): adds an element, evicting the farthest one when k elements are already stored
+ *      worst():           distance of the farthest stored element (or max distance if empty)
+ *      fill(...):         writes stored elements from the farthest to the closest one
+ *      reset(k):          empties the container and sets a new k, reusing its storage
+ *
+ *  KNNSortedArray keeps elements sorted in a fixed size array and is meant for small k. KNNHeap keeps a bounded max heap
+ *  in a buffer preallocated for k elements and is meant for large k.
+ */
+
+// Number of elements within the first n elements of a sorted array that are smaller or equal to dist
+template <typename distance_type, size_t K> inline size_t countLessEqual(const distance_type *dists, size_t n, distance_type dist) {
+    size_t count = 0;
+    for (size_t i = 0; i < K; ++i) {
+        count += dists[i] <= dist;
+    }
+    // unused slots are padded with max distance
+    return std::min(count, n);
+}
+
+template <size_t K> inline size_t countLessEqualSSE(const float *dists, size_t n, float dist) {
+    // set bits of a 4 bit mask: plain SSE2, which every x86-64 CPU has, unlike the POPCNT instruction
+    static constexpr uint8_t maskBits[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+    const __m128 value = _mm_set1_ps(dist);
+    size_t count = 0;
+    for (size_t i = 0; i < K; i += 4) {
+        __m128 mask = _mm_cmple_ps(_mm_loadu_ps(dists + i), value);
+        count += maskBits[_mm_movemask_ps(mask)];
+    }
+    return std::min(count, n);
+}
+
+template <typename distance_type, size_t K> class KNNSortedArray {
+    public:
+    static constexpr size_t capacity = K;
+
+    KNNSortedArray(size_t k = K) : _k(k) {
+        assert(k <= K);
+        _dists.fill(std::numeric_limits<distance_type>::max());
+    }
+
+    size_t size() const { return _size; }
+    size_t k() const { return _k; }
+    bool empty() const { return _size == 0; }
+    bool full() const { return _size == _k; }
+    distance_type worst() const { return _size > 0 ? _dists[_size - 1] : std::numeric_limits<distance_type>::max(); }
+
+    void clear() {
+        _size = 0;
+        _dists.fill(std::numeric_limits<distance_type>::max());
+    }
+
+    void reset(size_t k) {
+        assert(k <= K);
+        _k = k;
+        clear();
+    }
+
+    void push(int64_t index, distance_type dist) {
+        if (_k == 0) {
+            return;
+        }
+
+        size_t pos;
+        if constexpr (std::is_same<distance_type, float>::value && K % 4 == 0) {
+            pos = countLessEqualSSE<K>(_dists.data(), _size, dist);
+        } else {
+            pos = countLessEqual<distance_type, K>(_dists.data(), _size, dist);
+        }
+
+        if (pos >= _k) {
+            // farther than every stored element and there is no space left
+            return;
+        }
+
+        // shift farther elements one position, dropping the last one if full
+        const size_t last = std::min(_size, _k - 1);
+        for (size_t i = last; i > pos; --i) {
+            _dists[i] = _dists[i - 1];
+            _indexes[i] = _indexes[i - 1];
+        }
+        _dists[pos] = dist;
+        _indexes[pos] = index;
+        _size = std::min(_size + 1, _k);
+    }
+
+    void fill(std::vector<int64_t> &indexes, std::vector<distance_type> &distances) const {
+        indexes.resize(_size);
+        distances.resize(_size);
+        fill(indexes.data(), distances.data());
+    }
+
+    void fill(int64_t *indexes, distance_type *distances) const {
+        for (size_t i = 0; i < _size; ++i) {
+            indexes[i] = _indexes[_size - 1 - i];
+            distances[i] = _dists[_size - 1 - i];
+        }
+    }
+
+    private:
+    size_t _k;
+    size_t _size = 0;
+    std::array<distance_type, K> _dists;
+    std::array<int64_t, K> _indexes;
+};
+
+template <typename distance_type> class KNNHeap {
+    public:
+    KNNHeap(size_t k = 0) : _k(k) { _heap.reserve(k); }
+
+    size_t size() const { return _heap.size(); }
+    size_t k() const { return _k; }
+    bool empty() const { return _heap.empty(); }
+    bool full() const { return _heap.size() == _k; }
+    distance_type worst() const { return _heap.empty() ? std::numeric_limits<distance_type>::max() : _heap.front().dist; }
+
+    void clear() { _heap.clear(); }
+
+    void reset(size_t k) {
+        _k = k;
+        _heap.clear();
+        _heap.reserve(k);
+    }
+
+    void push(int64_t index, distance_type dist) {
+        if (_k == 0) {
+            return;
+        }
+
+        if (_heap.size() == _k) {
+            if (!(dist < _heap.front().dist)) {
+                return;
+            }
+            std::pop_heap(_heap.begin(), _heap.end());
+            _heap.back() = {index, dist};
+        } else {
+            _heap.push_back({index, dist});
+        }
+        std::push_heap(_heap.begin(), _heap.end());
+    }
+
+    void fill(std::vector<int64_t> &indexes, std::vector<distance_type> &distances) {
+        indexes.resize(_heap.size());
+        distances.resize(_heap.size());
+        fill(indexes.data(), distances.data());
+    }
+
+    // After a call to this function, the heap gets invalidated!
+    void fill(int64_t *indexes, distance_type *distances) {
+        std::sort_heap(_heap.begin(), _heap.end());
+        const size_t n = _heap.size();
+        for (size_t i = 0; i < n; ++i) {
+            indexes[i] = _heap[n - 1 - i].index;
+            distances[i] = _heap[n - 1 - i].dist;
+        }
+        _heap.clear();
+    }
+
+    private:
+    struct Element {
+        int64_t index;
+        distance_type dist;
+        bool operator<(const Element &other) const { return dist < other.dist; }
+    };
+
+    size_t _k;
+    std::vector<Element> _heap;
+};
+
+template <typename Queue> struct KNNQueueType {
+    using type = Queue;
+};
+
+/*
+ *  Calls fn with a KNNQueueType tag for the best knn container for k: sorted arrays specialized for k up to 1, 4, 8 and 16
+ *  and a bounded heap for larger k.
+ */
+template <typename distance_type, typename Function> void dispatchKNNQueue(size_t k, Function &&fn) {
+    if (k <= 1) {
+        fn(KNNQueueType<KNNSortedArray<distance_type, 1>>());
+    } else if (k <= 4) {
+        fn(KNNQueueType<KNNSortedArray<distance_type, 4>>());
+    } else if (k <= 8) {
+        fn(KNNQueueType<KNNSortedArray<distance_type, 8>>());
+    } else if (k <= 16) {
+        fn(KNNQueueType<KNNSortedArray<distance_type, 16>>());
+    } else {
+        fn(KNNQueueType<KNNHeap<distance_type>>());
+    }
+}
+
+} // namespace vptree
@@ -0,0 +1,103 @@
+/*
+ *  MIT Licence
+ *  Copyright 2021 Pablo Carneiro Elias
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace vptree {
+
+/*
+ *  Persistent worker threads running submitted tasks in submission order. At most capacity tasks can be pending: submit
+ *  blocks while the queue is full, which throttles producers faster than the workers. Tasks submitting more tasks never
+ *  block, as their worker may be the only one able to make room. Tasks must not throw.
+ */
+class TaskQueue {
+    public:
+    TaskQueue(size_t numThreads, size_t capacity) : _capacity(std::max<size_t>(capacity, 1)) {
+        numThreads = std::max<size_t>(numThreads, 1);
+        _workers.reserve(numThreads);
+        for (size_t i = 0; i < numThreads; ++i) {
+            _workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    TaskQueue(const TaskQueue &) = delete;
+    TaskQueue &operator=(const TaskQueue &) = delete;
+
+    ~TaskQueue() { shutdown(); }
+
+    size_t numThreads() const { return _workers.size(); }
+    size_t capacity() const { return _capacity; }
+
+    void submit(std::function<void()> task) {
+        bool fromWorker = currentQueue() == this;
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notFull.wait(lock, [this, fromWorker]() { return fromWorker || _tasks.size() < _capacity || _stopped; });
+        if (_stopped) {
+            throw std::runtime_error("task queue is shut down");
+        }
+        _tasks.push_back(std::move(task));
+        _notEmpty.notify_one();
+    }
+
+    // Runs the pending tasks, then stops the workers. Later submissions throw.
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+        }
+        _notEmpty.notify_all();
+        _notFull.notify_all();
+
+        for (std::thread &worker : _workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    private:
+    // Queue whose worker is the calling thread, if any
+    static const TaskQueue *&currentQueue() {
+        static thread_local const TaskQueue *queue = nullptr;
+        return queue;
+    }
+
+    void work() {
+        currentQueue() = this;
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _notEmpty.wait(lock, [this]() { return !_tasks.empty() || _stopped; });
+                if (_tasks.empty()) {
+                    return;
+                }
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+            }
+            _notFull.notify_one();
+            task();
+        }
+    }
+
+    const size_t _capacity;
+    bool _stopped = false;
+    std::mutex _mutex;
+    std::condition_variable _notEmpty;
+    std::condition_variable _notFull;
+    std::deque<std::function<void()>> _tasks;
+    std::vector<std::thread> _workers;
+};
+
+} // namespace vptree
@@ -0,0 +1,262 @@
+/*
+ *  MIT Licence
+ *  Copyright 2021 Pablo Carneiro Elias
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <immintrin.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vptree {
+
+/*
+ *  Persistent worker threads running parallel loops. After a loop, workers spin for a short while so that loops issued
+ *  back to back start without waking any thread, then park on a condition variable. The calling thread takes part in
+ *  the loop it issues.
+ *
+ *  Iterations of a loop are split in one contiguous range per thread. With the static schedule, each thread only runs
+ *  its own range. With work stealing, threads take chunks from the front of their range and, once it is empty, take
+ *  chunks from the back of the other ranges, so a few expensive iterations do not hold the whole loop on one thread.
+ *
+ *  A pool runs one loop at a time. Loops issued from other threads while it is busy wait for it, rather than running on
+ *  more threads than there are cores, and then get every thread of the pool. Loops issued from inside a loop run inline
+ *  on the thread running that iteration, as do loops issued within a SerialScope.
+ */
+class ThreadPool {
+    public:
+    enum class Schedule { Static, WorkStealing };
+
+    // Number of threads including the calling one: 0 is every hardware thread
+    explicit ThreadPool(size_t numThreads = 0, Schedule schedule = Schedule::WorkStealing) : _schedule(schedule) {
+        if (numThreads == 0) {
+            numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        }
+        _ranges = std::vector<Range>(numThreads);
+        _workers.reserve(numThreads - 1);
+        for (size_t i = 1; i < numThreads; ++i) {
+            _workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        _stopped = true;
+        publish(_claim.load() + (uint64_t(1) << 32), _workers.size());
+        for (std::thread &worker : _workers) {
+            worker.join();
+        }
+    }
+
+    size_t numThreads() const { return _workers.size() + 1; }
+    Schedule schedule() const { return _schedule; }
+
+    // Pool shared by every index without a thread count of its own. It is never destroyed, so that no thread gets joined
+    // while the process exits.
+    static ThreadPool &defaultPool() {
+        static ThreadPool *pool = new ThreadPool();
+        return *pool;
+    }
+
+    // While alive, loops issued by this thread run inline on it
+    class SerialScope {
+        public:
+        SerialScope() { ++serialDepth(); }
+        ~SerialScope() { --serialDepth(); }
+        SerialScope(const SerialScope &) = delete;
+        SerialScope &operator=(const SerialScope &) = delete;
+    };
+
+    /*
+     *  Calls fn(i) for every i in [0, count). Small counts are split in fewer ranges than threads, so that every range gets
+     *  at least one iteration, and a single iteration runs inline. fn must not throw.
+     */
+    template <typename Function> void parallelFor(size_t count, Function &&fn) {
+        if (count <= 1 || count > 0xffffffff || _workers.empty() || serialDepth() > 0) {
+            for (size_t i = 0; i < count; ++i) {
+                fn(i);
+            }
+            return;
+        }
+        // iterations never wait for loops, as the ones they issue run inline, so a loop holding the pool always ends
+        std::lock_guard<std::mutex> loop(_loopMutex);
+
+        const size_t numParts = std::min(count, numThreads());
+        // several chunks per thread, so that stealing evens out the load without contending on every iteration
+        _chunkSize.store(_schedule == Schedule::Static ? count : std::max<size_t>(count / (numParts * 8), 1), std::memory_order_relaxed);
+        _context = &fn;
+        _invoke = [](void *context, size_t begin, size_t end) {
+            Function &function = *static_cast<Function *>(context);
+            for (size_t i = begin; i < end; ++i) {
+                function(i);
+            }
+        };
+        _remaining.store(count, std::memory_order_relaxed);
+        for (size_t part = 0; part < _ranges.size(); ++part) {
+            const uint64_t begin = std::min(part, numParts) * count / numParts;
+            const uint64_t end = std::min(part + 1, numParts) * count / numParts;
+            _ranges[part].range.store((begin << 32) | end, std::memory_order_release);
+        }
+        _numParts.store(numParts, std::memory_order_relaxed);
+
+        const uint64_t generation = (_claim.load(std::memory_order_relaxed) >> 32) + 1;
+        publish(generation << 32, numParts - 1);
+        runParts(generation);
+
+        for (size_t spin = 1; _remaining.load(std::memory_order_acquire) > 0; ++spin) {
+            _mm_pause();
+            if (spin % 256 == 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    private:
+    static int &serialDepth() {
+        thread_local int depth = 0;
+        return depth;
+    }
+
+    /*
+     *  Starts a new loop: the upper 32 bits of _claim are the loop generation and the lower ones the next part to run.
+     *  Parked workers are only woken up when spinning ones are not enough to run the other parts.
+     */
+    void publish(uint64_t claim, size_t helpers) {
+        _claim.store(claim);
+        const int parked = _parked.load();
+        const size_t spinning = _workers.size() - parked;
+        if (parked > 0 && helpers > spinning) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (helpers - spinning >= static_cast<size_t>(parked)) {
+                _wakeUp.notify_all();
+            } else {
+                for (size_t i = spinning; i < helpers; ++i) {
+                    _wakeUp.notify_one();
+                }
+            }
+        }
+    }
+
+    // Claims the range of a part of the given loop, runs it and then steals from the other ranges
+    void runParts(uint64_t generation) {
+        uint64_t claim = _claim.load(std::memory_order_acquire);
+        while (true) {
+            // a part is only claimed while its loop is current, so the loop fields read here belong to it
+            if ((claim >> 32) != generation || (claim & 0xffffffff) >= _numParts.load(std::memory_order_relaxed)) {
+                return;
+            }
+            if (_claim.compare_exchange_weak(claim, claim + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                break;
+            }
+        }
+
+        const size_t part = claim & 0xffffffff;
+        while (runChunk(_ranges[part].range, true)) {
+        }
+        if (_schedule == Schedule::Static) {
+            return;
+        }
+
+        // ranges only get refilled by the next loop, so one pass over the other ranges is enough. Chunks stolen from a
+        // next loop are fine too, they belong to it like any other
+        for (size_t offset = 1; offset < _ranges.size(); ++offset) {
+            std::atomic<uint64_t> &victim = _ranges[(part + offset) % _ranges.size()].range;
+            while (runChunk(victim, false)) {
+            }
+        }
+    }
+
+    // Takes a chunk from the front (or the back) of a range packed as begin << 32 | end and runs it
+    bool runChunk(std::atomic<uint64_t> &range, bool front) {
+        uint64_t value = range.load(std::memory_order_acquire);
+        uint64_t begin, end;
+        while (true) {
+            begin = value >> 32;
+            end = value & 0xffffffff;
+            if (begin >= end) {
+                return false;
+            }
+            const uint64_t chunk = std::min<uint64_t>(_chunkSize.load(std::memory_order_relaxed), end - begin);
+            const uint64_t taken = front ? ((begin + chunk) << 32) | end : (begin << 32) | (end - chunk);
+            if (range.compare_exchange_weak(value, taken, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                if (front) {
+                    end = begin + chunk;
+                } else {
+                    begin = end - chunk;
+                }
+                break;
+            }
+        }
+
+        {
+            SerialScope nested;
+            _invoke(_context, begin, end);
+        }
+        _remaining.fetch_sub(end - begin, std::memory_order_acq_rel);
+        return true;
+    }
+
+    void work() {
+        uint64_t generation = 0;
+        while (true) {
+            // spins for new loops for a while before parking, yielding now and then to threads waiting for a core
+            const auto spinUntil = std::chrono::steady_clock::now() + std::chrono::microseconds(100);
+            for (size_t spin = 1; (_claim.load(std::memory_order_acquire) >> 32) == generation; ++spin) {
+                _mm_pause();
+                if (spin % 256 != 0) {
+                    continue;
+                }
+                if (std::chrono::steady_clock::now() < spinUntil) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(_mutex);
+                ++_parked;
+                _wakeUp.wait(lock, [&]() { return (_claim.load() >> 32) != generation; });
+                --_parked;
+            }
+
+            if (_stopped) {
+                return;
+            }
+            generation = _claim.load(std::memory_order_acquire) >> 32;
+            runParts(generation);
+        }
+    }
+
+    std::vector<std::thread> _workers;
+    std::atomic<bool> _stopped{false};
+    // held by the thread issuing the current loop
+    std::mutex _loopMutex;
+
+    // ranges of iterations left, one per part of the current loop, on their own cache lines
+    struct alignas(64) Range {
+        std::atomic<uint64_t> range{0};
+    };
+
+    const Schedule _schedule;
+
+    // current loop
+    std::atomic<uint64_t> _claim{0};
+    std::atomic<size_t> _numParts{0};
+    std::atomic<size_t> _chunkSize{1};
+    std::atomic<size_t> _remaining{0};
+    std::vector<Range> _ranges;
+    void *_context = nullptr;
+    void (*_invoke)(void *, size_t, size_t) = nullptr;
+
+    std::mutex _mutex;
+    std::condition_variable _wakeUp;
+    std::atomic<int> _parked{0};
+};
+
+} // namespace vptree
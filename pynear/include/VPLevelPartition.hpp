@@ -8,6 +8,7 @@
 #include <limits>
 #include <queue>
 #include <sstream>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -37,6 +38,12 @@ template <typename distance_type> class VPLevelPartition : public ISerializable
 
     virtual ~VPLevelPartition() { clear(); }
 
+    /*
+     *  Radii are saved as floats, which keeps the layout of float and integer distance trees, except for double distances,
+     *  whose radii rounded to floats would prune points at the border.
+     */
+    using serialized_radius = std::conditional_t<std::is_same<distance_type, double>::value, double, float>;
+
     SerializedState serialize() const {
 
         SerializedState state;
@@ -46,19 +53,19 @@ template <typename distance_type> class VPLevelPartition : public ISerializable
         // we need to reverse since we will pop elements in reverse order when deserializing
         std::reverse(flatten_tree_state.begin(), flatten_tree_state.end());
 
-        size_t total_size = flatten_tree_state.size() * (2 * sizeof(int64_t) + sizeof(float));
+        size_t total_size = flatten_tree_state.size() * (2 * sizeof(int64_t) + sizeof(serialized_radius));
         state.reserve(total_size);
 
         // reverse the tree state since we will push it in a stack for serializing
         for (const VPLevelPartition *elem : flatten_tree_state) {
             if (elem == nullptr) {
-                state.push((float)(0));
+                state.push((serialized_radius)(0));
                 state.push((int64_t)(-1));
                 state.push((int64_t)(-1));
                 continue;
             }
 
-            state.push((float)(elem->_radius));
+            state.push((serialized_radius)(elem->_radius));
             state.push((int64_t)(elem->_indexStart));
             state.push((int64_t)(elem->_indexEnd));
         }
@@ -141,7 +148,7 @@ template <typename distance_type> class VPLevelPartition : public ISerializable
 
         int64_t indexEnd = state.pop<int64_t>();
         int64_t indexStart = state.pop<int64_t>();
-        float radius = state.pop<float>();
+        distance_type radius = state.pop<serialized_radius>();
         if (indexEnd == -1) {
             return nullptr;
         }
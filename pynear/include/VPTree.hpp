@@ -6,25 +6,85 @@
 #pragma once
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
 #include <functional>
 #include <iostream>
 #include <limits>
-#include <omp.h>
+#include <memory>
+#include <numeric>
 #include <queue>
 #include <sstream>
+#include <stdexcept>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include "ISerializable.hpp"
+#include "KNNQueue.hpp"
+#include "ThreadPool.hpp"
 #include "VPLevelPartition.hpp"
 
 namespace vptree {
 
-template <typename T, typename distance_type, distance_type (*distance)(const T &, const T &)> class VPTree : public ISerializable {
+/*
+ *  Work done by a search, to see how well the tree prunes it. A plain aggregate (no initializers) so it maps to a numpy
+ *  structured array: value initialize it to zero the counters.
+ */
+struct VPTreeSearchStats {
+    uint64_t distanceEvaluations; // distances from the query to a point
+    uint64_t nodesVisited;        // partitions whose vantage point was compared to the query
+    uint64_t nodesPruned;         // partitions skipped by the border test
+    uint64_t heapInsertions;      // points added to the results found so far
+    uint64_t maxStackDepth;       // largest number of partitions scheduled at once
+
+    // Aggregates the stats of another search: counters add up, the depth is the largest one
+    VPTreeSearchStats &operator+=(const VPTreeSearchStats &other) {
+        distanceEvaluations += other.distanceEvaluations;
+        nodesVisited += other.nodesVisited;
+        nodesPruned += other.nodesPruned;
+        heapInsertions += other.heapInsertions;
+        maxStackDepth = std::max(maxStackDepth, other.maxStackDepth);
+        return *this;
+    }
+};
+
+// Counts the work of a search into VPTreeSearchStats. The disabled recorder is empty, so searches instantiated without
+// stats compile to the same code as if it was not there.
+template <bool enabled> class VPTreeSearchStatsRecorder {
+    public:
+    explicit VPTreeSearchStatsRecorder(VPTreeSearchStats *) {}
+    void visit() {}
+    void distances(uint64_t) {}
+    void pruned(uint64_t) {}
+    void inserted() {}
+    void stackDepth(size_t) {}
+};
+
+template <> class VPTreeSearchStatsRecorder<true> {
+    public:
+    explicit VPTreeSearchStatsRecorder(VPTreeSearchStats *stats) : _stats(*stats) {}
+    void visit() { ++_stats.nodesVisited; }
+    void distances(uint64_t count) { _stats.distanceEvaluations += count; }
+    void pruned(uint64_t count) { _stats.nodesPruned += count; }
+    void inserted() { ++_stats.heapInsertions; }
+    void stackDepth(size_t depth) { _stats.maxStackDepth = std::max<uint64_t>(_stats.maxStackDepth, depth); }
+
+    private:
+    VPTreeSearchStats &_stats;
+};
+
+/*
+ *  boundedDistance, if given, is an early abandon version of distance: it returns the distance if it is at most its bound
+ *  argument, any value greater than bound otherwise. It is used for points of leaf partitions, whose exact distance is
+ *  not needed unless they make it into the results.
+ */
+template <typename T, typename distance_type, distance_type (*distance)(const T &, const T &),
+          distance_type (*boundedDistance)(const T &, const T &, distance_type) = nullptr>
+class VPTree : public ISerializable {
     public:
     struct VPTreeElement {
 
@@ -41,6 +101,190 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
     struct VPTreeSearchResultElement {
         std::vector<int64_t> indexes;
         std::vector<distance_type> distances;
+
+        // false when the result may differ from the exact k nearest neighbors (see VPTreeSearchOptions)
+        bool exact = true;
+    };
+
+    /*
+     *  Destination of kNN search results, written by the search threads: either one VPTreeSearchResultElement per query,
+     *  or row major arrays of (number of queries) x k elements, where row i holds the points found for query i from the
+     *  farthest to the closest one. Rows with fewer than k points start with -1 indexes and max distances.
+     */
+    class VPTreeSearchOutput {
+        public:
+        VPTreeSearchOutput(std::vector<VPTreeSearchResultElement> &results) : _results(&results) {}
+
+        // exact is optional and gets one flag per query
+        VPTreeSearchOutput(int64_t *indexes, distance_type *distances, size_t k, bool *exact = nullptr)
+            : _indexes(indexes), _distances(distances), _k(k), _exact(exact) {}
+
+        void resize(size_t numQueries) {
+            if (_results != nullptr) {
+                _results->resize(numQueries);
+            }
+        }
+
+        // After a call to this function, knnQueue gets invalidated!
+        template <typename KNNQueue> void write(size_t query, KNNQueue &knnQueue, bool exact = true) {
+            if (_results != nullptr) {
+                VPTreeSearchResultElement &element = (*_results)[query];
+                knnQueue.fill(element.indexes, element.distances);
+                element.exact = exact;
+                return;
+            }
+
+            int64_t *indexes = _indexes + query * _k;
+            distance_type *distances = _distances + query * _k;
+            const size_t padding = _k - knnQueue.size();
+            std::fill(indexes, indexes + padding, -1);
+            std::fill(distances, distances + padding, std::numeric_limits<distance_type>::max());
+            knnQueue.fill(indexes + padding, distances + padding);
+            if (_exact != nullptr) {
+                _exact[query] = exact;
+            }
+        }
+
+        private:
+        std::vector<VPTreeSearchResultElement> *_results = nullptr;
+        int64_t *_indexes = nullptr;
+        distance_type *_distances = nullptr;
+        size_t _k = 0;
+        bool *_exact = nullptr;
+    };
+
+    /*
+     *  Neighbors of a query from the closest to the farthest one, found incrementally. The best first search frontier,
+     *  holding both partitions (by a lower bound of their distance to the query) and points (by their distance), is
+     *  kept between calls: a point is returned once it is closer than everything left in the frontier, so each call only
+     *  searches as far as the neighbors it returns. The tree must outlive the iterator and not change while it is used.
+     */
+    class VPTreeNeighborIterator {
+        public:
+        VPTreeNeighborIterator(const VPTree &tree, const T &query) : _tree(&tree), _query(query) {
+            _frontier.push_back({0, tree._rootPartition, -1});
+        }
+
+        // Writes the next count neighbors, from the closest one, and returns how many were written: fewer than count
+        // only once every point was returned
+        size_t next(size_t count, int64_t *indexes, distance_type *distances) {
+            size_t found = 0;
+            while (found < count && !_frontier.empty()) {
+                std::pop_heap(_frontier.begin(), _frontier.end(), after);
+                const Entry entry = _frontier.back();
+                _frontier.pop_back();
+
+                if (entry.partition == nullptr) {
+                    indexes[found] = entry.index;
+                    distances[found] = entry.dist;
+                    ++found;
+                    continue;
+                }
+
+                VPLevelPartition<distance_type> *current = entry.partition;
+                const VPTreeElement &vantagePoint = _tree->_examples[current->start()];
+                auto dist = distance(_query, vantagePoint.val);
+                push({dist, nullptr, vantagePoint.originalIndex});
+
+                // same bounds as searchKNNBestFirst
+                distance_type insideBound = entry.dist;
+                distance_type outsideBound = entry.dist;
+                if (dist > current->radius()) {
+                    insideBound = std::max<distance_type>(entry.dist, dist - current->radius());
+                } else {
+                    outsideBound = std::max<distance_type>(entry.dist, current->radius() - dist);
+                }
+                if (current->left() != nullptr) {
+                    push({insideBound, current->left(), -1});
+                }
+                if (current->right() != nullptr) {
+                    push({outsideBound, current->right(), -1});
+                }
+            }
+            return found;
+        }
+
+        bool done() const { return _frontier.empty(); }
+
+        private:
+        // a point (partition is null) at distance dist, or a partition at least dist away
+        struct Entry {
+            distance_type dist;
+            VPLevelPartition<distance_type> *partition;
+            int64_t index;
+        };
+
+        // heap order: closest first, points before partitions at the same distance, then lowest index first
+        static bool after(const Entry &a, const Entry &b) {
+            if (a.dist != b.dist) {
+                return a.dist > b.dist;
+            }
+            if ((a.partition == nullptr) != (b.partition == nullptr)) {
+                return a.partition != nullptr;
+            }
+            return a.index > b.index;
+        }
+
+        void push(const Entry &entry) {
+            _frontier.push_back(entry);
+            std::push_heap(_frontier.begin(), _frontier.end(), after);
+        }
+
+        const VPTree *_tree;
+        T _query;
+        std::vector<Entry> _frontier;
+    };
+
+    // Half open ranges [first, second) of original indexes, sorted and non overlapping
+    using VPTreeIndexRanges = std::vector<std::pair<int64_t, int64_t>>;
+
+    /*
+     *  Points allowed in the results of a filtered search, built by makeAllowedSet. Besides the flag of each point, it
+     *  keeps the number of allowed points before each position of the tree, so the search can tell how many allowed
+     *  points a partition holds and skip the ones without any. It must be rebuilt whenever the tree is set again.
+     */
+    struct VPTreeAllowedSet {
+        std::vector<bool> allowed;          // by original index
+        std::vector<int64_t> allowedBefore; // by position within the tree, plus one past the end
+    };
+
+    // Optional settings for searchKNN
+    struct VPTreeSearchOptions {
+        // Visit scheduled partitions from the closest to the farthest one (by a lower bound of their distance to the query)
+        // instead of in DFS order. Tau shrinks sooner and the remaining frontier is dropped at once when its closest
+        // partition gets farther than tau.
+        bool bestFirst = false;
+
+        // Only points within maxRadius from the query are returned, so fewer than k points may be found. The search
+        // prunes with maxRadius until k points are found.
+        distance_type maxRadius = std::numeric_limits<distance_type>::max();
+
+        // Approximate search: partitions are pruned against tau / (1 + epsilon) instead of tau, so every returned distance
+        // is within a factor (1 + epsilon) of the exact one.
+        double epsilon = 0;
+
+        // Approximate search: stop searching a query once this many nodes were visited or distances evaluated, returning
+        // the best points found so far.
+        size_t maxVisitedNodes = std::numeric_limits<size_t>::max();
+        size_t maxDistanceEvaluations = std::numeric_limits<size_t>::max();
+
+        // Anytime search: stop searching a query once deadline passed (shared by the whole call) or once the query has been
+        // searched for queryTimeBudget, returning the best points found so far. The clock is read every few visited nodes.
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+        std::chrono::nanoseconds queryTimeBudget = std::chrono::nanoseconds::max();
+
+        // Filtered search: only points allowed by allowedSet and within allowedRanges[i] (for query i) are returned. Either
+        // can be null. Filtered out points still serve as vantage points, so they still prune the search.
+        const VPTreeAllowedSet *allowedSet = nullptr;
+        const std::vector<VPTreeIndexRanges> *allowedRanges = nullptr;
+
+        // Search the queries grouped by the partition of the tree they fall in, so that consecutive queries of a thread
+        // walk the same branches while these are still cached. Results keep the order of the queries.
+        bool reorderQueries = false;
+
+        // Partitions of up to leafSize points are scanned point by point instead of walking their subtree, which trades
+        // pruning within small subtrees for sequential memory access. 1 walks the whole tree.
+        size_t leafSize = 1;
     };
 
     VPTree() {
@@ -48,12 +292,12 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
         _examples.clear();
     }
 
-    VPTree(const VPTree<T, distance_type, distance> &other) {
+    VPTree(const VPTree &other) {
         auto other_state = other.serialize();
         deserialize(other_state);
     }
 
-    const VPTree<T, distance_type, distance> &operator=(const VPTree<T, distance_type, distance> &other) { this->deserialize(other.serialize()); }
+    const VPTree &operator=(const VPTree &other) { this->deserialize(other.serialize()); }
 
     ~VPTree() { clear(); };
 
@@ -85,6 +329,20 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
 
     bool isEmpty() { return _rootPartition == nullptr; }
 
+    size_t size() const { return _examples.size(); }
+
+    // Threads searches run on, including the calling one. 0 (the default) shares a pool of every hardware thread with
+    // the other trees, unless the static schedule is asked for.
+    void setNumThreads(size_t numThreads, ThreadPool::Schedule schedule = ThreadPool::Schedule::WorkStealing) {
+        if (numThreads == 0 && schedule == ThreadPool::Schedule::WorkStealing) {
+            _threadPool = nullptr;
+        } else {
+            _threadPool = std::make_shared<ThreadPool>(numThreads, schedule);
+        }
+    }
+
+    size_t numThreads() const { return threadPool().numThreads(); }
+
     void print_state() {
         if (_rootPartition == nullptr) {
             return;
@@ -175,33 +433,297 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
         _rootPartition->deserialize(copy);
     }
 
-    void searchKNN(const std::vector<T> &queries, size_t k, std::vector<VPTreeSearchResultElement> &results) {
+    // allowed is indexed by the original index of each point and must have one flag per point
+    VPTreeAllowedSet makeAllowedSet(const std::vector<bool> &allowed) const {
+        if (allowed.size() != _examples.size()) {
+            throw std::invalid_argument("allowed set must have one flag per indexed point");
+        }
+
+        VPTreeAllowedSet allowedSet;
+        allowedSet.allowed = allowed;
+        allowedSet.allowedBefore.resize(_examples.size() + 1);
+        allowedSet.allowedBefore[0] = 0;
+        for (size_t i = 0; i < _examples.size(); ++i) {
+            allowedSet.allowedBefore[i + 1] = allowedSet.allowedBefore[i] + allowed[_examples[i].originalIndex];
+        }
+        return allowedSet;
+    }
+
+    void searchKNN(const std::vector<T> &queries, size_t k, VPTreeSearchOutput results) { searchKNN(queries, k, results, VPTreeSearchOptions()); }
+
+    void searchKNN(const std::vector<T> &queries, size_t k, VPTreeSearchOutput results, const VPTreeSearchOptions &options) {
+        searchKNN<false>(queries, k, results, options, nullptr);
+    }
+
+    // Same as above, also counting the work of the search of each query into stats
+    void searchKNN(const std::vector<T> &queries, size_t k, VPTreeSearchOutput results, const VPTreeSearchOptions &options,
+                   std::vector<VPTreeSearchStats> &stats) {
+        stats.assign(queries.size(), VPTreeSearchStats{});
+        searchKNN<true>(queries, k, results, options, stats.data());
+    }
+
+    template <bool collectStats>
+    void searchKNN(const std::vector<T> &queries, size_t k, VPTreeSearchOutput results, const VPTreeSearchOptions &options,
+                   VPTreeSearchStats *stats) {
 
         if (isEmpty()) {
             throw std::runtime_error("index must be first initialized with .set() function and non empty dataset");
         }
 
+        if (options.allowedSet != nullptr && options.allowedSet->allowedBefore.size() != _examples.size() + 1) {
+            throw std::invalid_argument("allowed set was built for another tree");
+        }
+        if (options.allowedRanges != nullptr && options.allowedRanges->size() != queries.size()) {
+            throw std::invalid_argument("allowed ranges must be given for every query");
+        }
+
         // we must return one result per queries
         results.resize(queries.size());
 
-#if (ENABLE_OMP_PARALLEL)
-#pragma omp parallel for schedule(static, 1) if (queries.size() > 1)
-#endif
-        // i should be size_t, however msvc requires signed integral loop variables (except with -openmp:llvm)
-        for (int i = 0; i < static_cast<int>(queries.size()); ++i) {
-            const T &query = queries[i];
-            std::priority_queue<VPTreeSearchElement> knnQueue;
-            searchKNN(_rootPartition, query, k, knnQueue);
+        std::vector<size_t> order;
+        if (options.reorderQueries) {
+            order = localityOrder(queries);
+        }
+
+        dispatchKNNQueue<distance_type>(k, [&](auto queueType) {
+            using KNNQueue = typename decltype(queueType)::type;
+
+            threadPool().parallelFor(queries.size(), [&](size_t position) {
+                const size_t i = order.empty() ? position : order[position];
+                const T &query = queries[i];
+                KNNQueue &knnQueue = threadKNNQueue<KNNQueue>(k);
+                KNNSearchState<KNNQueue, collectStats> state(knnQueue, k, options, i, collectStats ? &stats[i] : nullptr);
+                if (options.bestFirst) {
+                    searchKNNBestFirst(_rootPartition, query, state);
+                } else {
+                    searchKNN(_rootPartition, query, state);
+                }
+
+                // we must always return k elements for each search unless there is no k elements (or the search is
+                // bounded by maxRadius, a budget or a filter)
+                assert(knnQueue.size() == std::min<size_t>(_examples.size(), k) || options.maxRadius != std::numeric_limits<distance_type>::max() ||
+                       !state.exact || options.allowedSet != nullptr || options.allowedRanges != nullptr);
+
+                results.write(i, knnQueue, state.exact);
+            });
+        });
+    }
+
+    /*
+     *  Same as searchKNN, but queries are split in blocks of blockSize queries that walk the tree together. Each vantage
+     *  point is compared against the whole block at once, so top level nodes are loaded once per block instead of once
+     *  per query. A partition is skipped only when every query of the block prunes it.
+     */
+    void searchKNNBatched(const std::vector<T> &queries, size_t k, VPTreeSearchOutput results, size_t blockSize = 32) {
+
+        if (isEmpty()) {
+            throw std::runtime_error("index must be first initialized with .set() function and non empty dataset");
+        }
+
+        if (blockSize == 0) {
+            throw std::invalid_argument("block size must be greater than zero");
+        }
+
+        results.resize(queries.size());
+
+        const size_t numBlocks = (queries.size() + blockSize - 1) / blockSize;
+
+        dispatchKNNQueue<distance_type>(k, [&](auto queueType) {
+            using KNNQueue = typename decltype(queueType)::type;
+
+            threadPool().parallelFor(numBlocks, [&](size_t b) {
+                const size_t first = b * blockSize;
+                const size_t count = std::min(blockSize, queries.size() - first);
+
+                std::vector<KNNQueue> &knnQueues = threadKNNQueues<KNNQueue>(count, k);
+                searchKNNBlock(_rootPartition, &queries[first], count, k, knnQueues);
+
+                for (size_t q = 0; q < count; ++q) {
+                    assert(knnQueues[q].size() == std::min<size_t>(_examples.size(), k));
+                    results.write(first + q, knnQueues[q]);
+                }
+            });
+        });
+    }
+
+    /*
+     *  Finds every point within radius from each query. radii holds either one radius per query or a single radius shared
+     *  by all queries. Results are returned in CSR layout: neighbors of query i are indexes[offsets[i]] to
+     *  indexes[offsets[i + 1] - 1] (and the same range of distances), sorted from the closest to the farthest one.
+     */
+    void searchRadius(const std::vector<T> &queries, const std::vector<distance_type> &radii, std::vector<int64_t> &offsets,
+                      std::vector<int64_t> &indexes, std::vector<distance_type> &distances) {
+
+        if (isEmpty()) {
+            throw std::runtime_error("index must be first initialized with .set() function and non empty dataset");
+        }
+
+        if (radii.size() != 1 && radii.size() != queries.size()) {
+            throw std::invalid_argument("radii must contain either one radius or one radius per query");
+        }
+
+        std::vector<VPTreeSearchResultElement> results(queries.size());
+
+        threadPool().parallelFor(queries.size(), [&](size_t i) {
+            const distance_type radius = radii.size() == 1 ? radii[0] : radii[i];
+            searchRadius(_rootPartition, queries[i], radius, results[i]);
+        });
+
+        offsets.resize(queries.size() + 1);
+        offsets[0] = 0;
+        for (size_t i = 0; i < queries.size(); ++i) {
+            offsets[i + 1] = offsets[i] + results[i].indexes.size();
+        }
+
+        indexes.resize(offsets.back());
+        distances.resize(offsets.back());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            std::copy(results[i].indexes.begin(), results[i].indexes.end(), indexes.begin() + offsets[i]);
+            std::copy(results[i].distances.begin(), results[i].distances.end(), distances.begin() + offsets[i]);
+        }
+    }
+
+    /*
+     *  k nearest neighbors of every indexed point (an all kNN self join). indexes and distances are row major n x k arrays
+     *  where row i holds the neighbors of the point of original index i, from the farthest to the closest one. Rows with
+     *  fewer than k neighbors start with -1 indexes and max distances. With excludeSelf, a point is not its own neighbor
+     *  (duplicates of it still are).
+     *
+     *  Points are searched in tree order, so consecutive searches of a thread walk the same branches. Each search is seeded
+     *  with the points around it in tree order, which mostly belong to the same small partitions, so tau is tight from the
+     *  root on.
+     */
+    void knnGraph(size_t k, bool excludeSelf, std::vector<int64_t> &indexes, std::vector<distance_type> &distances) {
+
+        if (isEmpty()) {
+            throw std::runtime_error("index must be first initialized with .set() function and non empty dataset");
+        }
+
+        const int64_t n = _examples.size();
+        indexes.resize(n * k);
+        distances.resize(n * k);
+        VPTreeSearchOutput output(indexes.data(), distances.data(), k);
+
+        const VPTreeSearchOptions options;
+        dispatchKNNQueue<distance_type>(k, [&](auto queueType) {
+            using KNNQueue = typename decltype(queueType)::type;
+
+            threadPool().parallelFor(n, [&](int64_t i) {
+                const T &val = _examples[i].val;
+                KNNQueue &knnQueue = threadKNNQueue<KNNQueue>(k);
+                KNNSearchState<KNNQueue> state(knnQueue, k, options, 0);
+
+                auto &seedDistances = searchScratch().seedDistances;
+                const int64_t seedBegin = std::max<int64_t>(0, i - static_cast<int64_t>(k));
+                const int64_t seedEnd = std::min<int64_t>(n, i + static_cast<int64_t>(k) + 1);
+                seedDistances.resize(seedEnd - seedBegin);
+                for (int64_t j = seedBegin; j < seedEnd; ++j) {
+                    seedDistances[j - seedBegin] = distance(val, _examples[j].val);
+                    if (j != i || !excludeSelf) {
+                        state.add(_examples[j].originalIndex, seedDistances[j - seedBegin]);
+                    }
+                }
+                state.seed(seedBegin, seedEnd, seedDistances.data());
 
-            // we must always return k elements for each search unless there is no k elements
-            assert(knnQueue.size() == std::min<size_t>(_examples.size(), k));
+                searchKNN(_rootPartition, val, state);
 
-            fillSearchResult(knnQueue, results[i]);
+                output.write(_examples[i].originalIndex, knnQueue);
+            });
+        });
+    }
+
+    /*
+     *  Same as searchKNN, but computed as a dual tree join: a tree is built over the queries and each of its partitions of
+     *  up to blockSize queries walks the index tree as a single block (see searchKNNBlock). The queries of a partition are
+     *  close to each other, so they visit mostly the same index partitions and a pair of query and index partitions is
+     *  dropped as soon as every query of the former prunes the latter. Vantage points of the larger query partitions are
+     *  searched alone.
+     */
+    void searchKNNDualTree(const std::vector<T> &queries, size_t k, VPTreeSearchOutput results, size_t blockSize = 32) {
+
+        if (isEmpty()) {
+            throw std::runtime_error("index must be first initialized with .set() function and non empty dataset");
+        }
+
+        if (blockSize == 0) {
+            throw std::invalid_argument("block size must be greater than zero");
+        }
+
+        results.resize(queries.size());
+        if (queries.empty()) {
+            return;
+        }
+
+        const VPTree queryTree(queries);
+
+        // queries in query tree order, so each query partition is a contiguous block
+        std::vector<T> orderedQueries(queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            orderedQueries[i] = queryTree._examples[i].val;
         }
+
+        // query partitions of up to blockSize queries, and the vantage points above them
+        std::vector<std::pair<int64_t, int64_t>> blocks;
+        std::vector<VPLevelPartition<distance_type> *> toSplit = {queryTree._rootPartition};
+        while (!toSplit.empty()) {
+            VPLevelPartition<distance_type> *current = toSplit.back();
+            toSplit.pop_back();
+
+            if (static_cast<size_t>(current->size()) <= blockSize) {
+                blocks.push_back({current->start(), current->size()});
+                continue;
+            }
+
+            blocks.push_back({current->start(), 1});
+            for (VPLevelPartition<distance_type> *child : {current->left(), current->right()}) {
+                if (child != nullptr) {
+                    toSplit.push_back(child);
+                }
+            }
+        }
+
+        dispatchKNNQueue<distance_type>(k, [&](auto queueType) {
+            using KNNQueue = typename decltype(queueType)::type;
+
+            threadPool().parallelFor(blocks.size(), [&](size_t b) {
+                const auto [first, count] = blocks[b];
+
+                std::vector<KNNQueue> &knnQueues = threadKNNQueues<KNNQueue>(count, k);
+                searchKNNBlock(_rootPartition, &orderedQueries[first], count, k, knnQueues);
+
+                for (int64_t q = 0; q < count; ++q) {
+                    assert(knnQueues[q].size() == std::min<size_t>(_examples.size(), k));
+                    results.write(queryTree._examples[first + q].originalIndex, knnQueues[q]);
+                }
+            });
+        });
+    }
+
+    // Iterator over the neighbors of query, from the closest to the farthest one (see VPTreeNeighborIterator)
+    VPTreeNeighborIterator neighbors(const T &query) const {
+
+        if (_rootPartition == nullptr) {
+            throw std::runtime_error("index must be first initialized with .set() function and non empty dataset");
+        }
+
+        return VPTreeNeighborIterator(*this, query);
     }
 
     // An optimized version for 1 NN search
     void search1NN(const std::vector<T> &queries, std::vector<int64_t> &indices, std::vector<distance_type> &distances) {
+        search1NN<false>(queries, indices, distances, nullptr);
+    }
+
+    // Same as above, also counting the work of the search of each query into stats
+    void search1NN(const std::vector<T> &queries, std::vector<int64_t> &indices, std::vector<distance_type> &distances,
+                   std::vector<VPTreeSearchStats> &stats) {
+        stats.assign(queries.size(), VPTreeSearchStats{});
+        search1NN<true>(queries, indices, distances, stats.data());
+    }
+
+    template <bool collectStats>
+    void search1NN(const std::vector<T> &queries, std::vector<int64_t> &indices, std::vector<distance_type> &distances,
+                   VPTreeSearchStats *stats) {
 
         if (isEmpty()) {
             throw std::runtime_error("index must be first initialized with .set() function and non empty dataset");
@@ -211,21 +733,17 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
         indices.resize(queries.size());
         distances.resize(queries.size());
 
-#if (ENABLE_OMP_PARALLEL)
-#pragma omp parallel for schedule(static, 1) if (queries.size() > 1)
-#endif
-        // i should be size_t, see above
-        for (int i = 0; i < static_cast<int>(queries.size()); ++i) {
+        threadPool().parallelFor(queries.size(), [&](size_t i) {
             const T &query = queries[i];
             distance_type dist = 0;
             int64_t index = -1;
-            search1NN(_rootPartition, query, index, dist);
+            search1NN(_rootPartition, query, index, dist, VPTreeSearchStatsRecorder<collectStats>(collectStats ? &stats[i] : nullptr));
             distances[i] = dist;
             indices[i] = index;
-        }
+        });
     }
 
-    friend std::ostream &operator<<(std::ostream &os, const VPTree<T, distance_type, distance> &vptree) {
+    friend std::ostream &operator<<(std::ostream &os, const VPTree &vptree) {
         os << "####################" << std::endl;
         os << "# [VPTree state]" << std::endl;
         os << "Num Data Points: " << vptree._examples.size() << std::endl;
@@ -309,64 +827,252 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
         }
     }
 
-    // Internal temporary struct to organize K closest elements in a priorty queue
-    struct VPTreeSearchElement {
-        VPTreeSearchElement(int index, distance_type dist) : index(index), dist(dist) {}
-        int index;
-        distance_type dist;
-        bool operator<(const VPTreeSearchElement &v) const { return dist < v.dist; }
-    };
-
-    void exaustivePartitionSearch(VPLevelPartition<distance_type> *partition, const T &val, unsigned int k,
-                                  std::priority_queue<VPTreeSearchElement> &knnQueue, distance_type tau) {
-        for (int i = partition->start(); i <= partition->end(); ++i) {
+    // KNNQueue is one of the bounded containers of KNNQueue.hpp (see dispatchKNNQueue)
+    template <typename KNNQueue>
+    void exaustivePartitionSearch(VPLevelPartition<distance_type> *partition, const T &val, unsigned int k, KNNQueue &knnQueue,
+                                  distance_type tau) {
+        for (int64_t i = partition->start(); i <= partition->end(); ++i) {
 
             auto dist = distance(val, _examples[i].val);
             if (dist < tau || knnQueue.size() < k) {
+                knnQueue.push(_examples[i].originalIndex, dist);
+                tau = knnQueue.worst();
+            }
+        }
+    }
+
+    /*
+     *  Per query state of searchKNN and searchKNNBestFirst: the knn queue, the pruning bounds and the search budget.
+     *
+     *  tau is the distance to the k-th closest point found so far, capped by maxRadius. Until k points are found, it is
+     *  maxRadius itself, so no partition that might hold one of the k closest points is skipped. Partitions are pruned
+     *  against bound, which is tau relaxed by epsilon. exact is cleared whenever the relaxation or the budget actually
+     *  skips a partition that the exact search would have searched. Points rejected by the filters of options are visited
+     *  but never added. With collectStats, the work of the search is counted into the stats given to the constructor.
+     */
+    template <typename KNNQueue, bool collectStats = false> struct KNNSearchState {
+        KNNSearchState(KNNQueue &knnQueue, unsigned int k, const VPTreeSearchOptions &options, size_t query, VPTreeSearchStats *searchStats = nullptr)
+            : knnQueue(knnQueue), k(k), options(options), tau(options.maxRadius), bound(options.maxRadius), deadline(options.deadline),
+              ranges(options.allowedRanges != nullptr ? &(*options.allowedRanges)[query] : nullptr), stats(searchStats) {
+            if (options.queryTimeBudget != std::chrono::nanoseconds::max()) {
+                deadline = std::min(deadline, std::chrono::steady_clock::now() + options.queryTimeBudget);
+            }
+        }
+
+        // true if a partition whose points are all at least lowerBound away from the query can be skipped
+        bool prune(distance_type lowerBound) {
+            if (lowerBound <= bound) {
+                return false;
+            }
+            if (lowerBound <= tau) {
+                exact = false;
+            }
+            stats.pruned(1);
+            return true;
+        }
+
+        // true if the search must stop instead of visiting another node
+        bool outOfBudget() {
+            if (numVisited < options.maxVisitedNodes && numDistances < options.maxDistanceEvaluations && !pastDeadline()) {
+                return false;
+            }
+            exact = false;
+            return true;
+        }
+
+        bool pastDeadline() const {
+            // reading the clock costs about as much as a few distance evaluations
+            constexpr size_t deadlineCheckInterval = 32;
+            if (deadline == std::chrono::steady_clock::time_point::max() || numVisited % deadlineCheckInterval != 0) {
+                return false;
+            }
+            return std::chrono::steady_clock::now() >= deadline;
+        }
+
+        void visit() {
+            ++numVisited;
+            ++numDistances;
+            stats.visit();
+            stats.distances(1);
+        }
+
+        // a partition of count points is scanned: it counts as one visited node, but as count distance evaluations
+        void scan(size_t count) {
+            ++numVisited;
+            numDistances += count;
+            stats.visit();
+            stats.distances(count);
+        }
 
+        bool isScanned(VPLevelPartition<distance_type> *partition) const {
+            const size_t size = partition->end() - partition->start() + 1;
+            return size > 1 && size <= options.leafSize;
+        }
+
+        // false if no point of partition can be returned
+        bool hasAllowed(VPLevelPartition<distance_type> *partition) const {
+            if (options.allowedSet == nullptr) {
+                return true;
+            }
+            const auto &allowedBefore = options.allowedSet->allowedBefore;
+            return allowedBefore[partition->end() + 1] > allowedBefore[partition->start()];
+        }
+
+        bool isAllowed(int64_t index) const {
+            if (options.allowedSet != nullptr && !options.allowedSet->allowed[index]) {
+                return false;
+            }
+            if (ranges != nullptr) {
+                // last range starting at or before index
+                auto range = std::upper_bound(ranges->begin(), ranges->end(), index,
+                                              [](int64_t value, const std::pair<int64_t, int64_t> &r) { return value < r.first; });
+                return range != ranges->begin() && index < std::prev(range)->second;
+            }
+            return true;
+        }
+
+        // Tree positions [begin, end) were added before the search, their distances to the query are in distances
+        void seed(int64_t begin, int64_t end, const distance_type *distances) {
+            seedBegin = begin;
+            seedEnd = end;
+            seedDistances = distances;
+        }
+
+        bool isSeeded(int64_t position) const { return position >= seedBegin && position < seedEnd; }
+
+        // points farther than this from the query are not added
+        distance_type addBound() const { return knnQueue.size() < k ? options.maxRadius : tau; }
+
+        void add(int64_t index, distance_type dist) {
+            if (!isAllowed(index)) {
+                return;
+            }
+            if (knnQueue.size() < k ? dist <= options.maxRadius : dist < tau) {
+                knnQueue.push(index, dist);
+                stats.inserted();
                 if (knnQueue.size() == k) {
-                    knnQueue.pop();
+                    tau = std::min(knnQueue.worst(), options.maxRadius);
+                    bound = options.epsilon > 0 ? static_cast<distance_type>(tau / (1 + options.epsilon)) : tau;
                 }
-                int64_t indexToAdd = _examples[i].originalIndex;
-                knnQueue.push(VPTreeSearchElement(indexToAdd, dist));
+            }
+        }
+
+        KNNQueue &knnQueue;
+        const unsigned int k;
+        const VPTreeSearchOptions &options;
+
+        distance_type tau;
+        distance_type bound;
+        std::chrono::steady_clock::time_point deadline;
+        const VPTreeIndexRanges *ranges;
+        int64_t seedBegin = 0;
+        int64_t seedEnd = 0;
+        const distance_type *seedDistances = nullptr;
+        size_t numVisited = 0;
+        size_t numDistances = 0;
+        bool exact = true;
+        VPTreeSearchStatsRecorder<collectStats> stats;
+    };
+
+    // Distance from val to the vantage point of partition, which is added to the results of the search
+    template <typename KNNQueue, bool collectStats>
+    distance_type visitVantagePoint(VPLevelPartition<distance_type> *partition, const T &val, KNNSearchState<KNNQueue, collectStats> &state) {
+        const int64_t position = partition->start();
+        if (state.isSeeded(position)) {
+            return state.seedDistances[position - state.seedBegin];
+        }
+
+        state.visit();
+        auto dist = isLeaf(partition) ? leafDistance(val, position, state.addBound()) : distance(val, _examples[position].val);
+        state.add(_examples[position].originalIndex, dist);
+        return dist;
+    }
 
-                tau = knnQueue.top().dist;
+    // Adds every point of a partition scanned instead of walked (see VPTreeSearchOptions::leafSize)
+    template <typename KNNQueue, bool collectStats>
+    void scanLeaf(VPLevelPartition<distance_type> *partition, const T &val, KNNSearchState<KNNQueue, collectStats> &state) {
+        state.scan(partition->end() - partition->start() + 1);
+        for (int64_t position = partition->start(); position <= partition->end(); ++position) {
+            if (!state.isSeeded(position)) {
+                state.add(_examples[position].originalIndex, leafDistance(val, position, state.addBound()));
             }
         }
     }
 
-    void searchKNN(VPLevelPartition<distance_type> *partition, const T &val, unsigned int k, std::priority_queue<VPTreeSearchElement> &knnQueue) {
+    static bool isLeaf(const VPLevelPartition<distance_type> *partition) { return partition->left() == nullptr && partition->right() == nullptr; }
+
+    // Distance from val to the point at position if it is at most bound, any value greater than bound otherwise
+    distance_type leafDistance(const T &val, int64_t position, distance_type bound) const {
+        if constexpr (boundedDistance != nullptr) {
+            return boundedDistance(val, _examples[position].val, bound);
+        } else {
+            return distance(val, _examples[position].val);
+        }
+    }
+
+    /*
+     *  Positions of the queries sorted by the leaf partition each one falls in, following the side of every vantage point
+     *  it is on from the root. Partitions are contiguous ranges of tree positions, so queries falling in the same subtree,
+     *  at any level, end up next to each other.
+     */
+    std::vector<size_t> localityOrder(const std::vector<T> &queries) {
+        std::vector<int64_t> leaves(queries.size());
+        threadPool().parallelFor(queries.size(), [&](size_t i) {
+            VPLevelPartition<distance_type> *current = _rootPartition;
+            while (true) {
+                auto dist = distance(queries[i], _examples[current->start()].val);
+                VPLevelPartition<distance_type> *next = dist > current->radius() ? current->right() : current->left();
+                if (next == nullptr) {
+                    break;
+                }
+                current = next;
+            }
+            leaves[i] = current->start();
+        });
+
+        std::vector<size_t> order(queries.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return leaves[a] < leaves[b]; });
+        return order;
+    }
 
-        auto tau = std::numeric_limits<distance_type>::max();
+    template <typename KNNQueue, bool collectStats>
+    void searchKNN(VPLevelPartition<distance_type> *partition, const T &val, KNNSearchState<KNNQueue, collectStats> &state) {
 
         // stores the distance to the partition border at the time of the storage. Since tau value will change
         // whiling performing the DFS search from on level, the storage distance will be checked again when about
         // to dive into that partition. It might not be necessary to dig into the partition anymore if tau decreased.
-        std::vector<std::tuple<distance_type, VPLevelPartition<distance_type> *>> toSearch = {{-1, partition}};
+        auto &toSearch = searchScratch().toSearch;
+        toSearch.clear();
+        toSearch.push_back({-1, partition});
 
         while (!toSearch.empty()) {
+            if (state.outOfBudget()) {
+                break;
+            }
+            state.stats.stackDepth(toSearch.size());
+
             auto [distToBorder, current] = toSearch.back();
             toSearch.pop_back();
 
-            auto dist = distance(val, _examples[current->start()].val);
-            if (dist < tau || knnQueue.size() < k) {
+            if (distToBorder >= 0 && state.prune(distToBorder)) {
 
-                if (knnQueue.size() == k) {
-                    knnQueue.pop();
-                }
-                int64_t indexToAdd = _examples[current->start()].originalIndex;
-                knnQueue.push(VPTreeSearchElement(indexToAdd, dist));
-
-                tau = knnQueue.top().dist;
+                // distance to this partition border change and its not necessary to search within it anymore
+                continue;
             }
 
-            if (distToBorder >= 0 && distToBorder > tau) {
+            if (!state.hasAllowed(current)) {
+                // nothing to find within this partition
+                continue;
+            }
 
-                // distance to this partition border change and its not necessary to search within it anymore
+            if (state.isScanned(current)) {
+                scanLeaf(current, val, state);
                 continue;
             }
 
-            size_t neighborsSoFar = knnQueue.size();
+            auto dist = visitVantagePoint(current, val, state);
+
             if (dist > current->radius()) {
                 // must search outside
 
@@ -384,16 +1090,8 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
 
                 */
                 if (current->left() != nullptr) {
-
-                    size_t rightPartitionSize = (current->right() != nullptr) ? current->right()->size() : 0;
-                    bool notEnoughPointsOutside = rightPartitionSize < (k - neighborsSoFar);
                     auto toBorder = dist - current->radius();
-
-                    // we might not have enough point outside to reject the inside partition, so we might need to search
-                    // for both
-                    if (notEnoughPointsOutside) {
-                        toSearch.push_back({-1, current->left()});
-                    } else if (toBorder <= tau) {
+                    if (!state.prune(toBorder)) {
                         toSearch.push_back({toBorder, current->left()});
                     }
                 }
@@ -407,14 +1105,8 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
                 // logic is analogous to the outside case
 
                 if (current->right() != nullptr) {
-
-                    size_t leftPartitionSize = (current->left() != nullptr) ? current->left()->size() : 0;
-                    bool notEnoughPointsInside = leftPartitionSize < (k - neighborsSoFar);
                     auto toBorder = current->radius() - dist;
-
-                    if (notEnoughPointsInside) {
-                        toSearch.push_back({-1, current->right()});
-                    } else if (toBorder <= tau) {
+                    if (!state.prune(toBorder)) {
                         toSearch.push_back({toBorder, current->right()});
                     }
                 }
@@ -427,27 +1119,310 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
         }
     }
 
-    void search1NN(VPLevelPartition<distance_type> *partition, const T &val, int64_t &resultIndex, distance_type &resultDist) {
+    /*
+     *  Collects every point within radius from the query. Unlike searchKNN, partitions are pruned with the fixed radius
+     *  so there is no need to revisit scheduled partitions.
+     */
+    void searchRadius(VPLevelPartition<distance_type> *partition, const T &val, distance_type radius, VPTreeSearchResultElement &result) {
+
+        VPTreeSearchScratch &scratch = searchScratch();
+        auto &toSearch = scratch.partitions;
+        auto &found = scratch.found;
+        toSearch.clear();
+        found.clear();
+        toSearch.push_back(partition);
+
+        while (!toSearch.empty()) {
+            VPLevelPartition<distance_type> *current = toSearch.back();
+            toSearch.pop_back();
+
+            auto dist = isLeaf(current) ? leafDistance(val, current->start(), radius) : distance(val, _examples[current->start()].val);
+            if (dist <= radius) {
+                found.push_back({dist, _examples[current->start()].originalIndex});
+            }
+
+            // by triangle inequality, inside points are at least dist - radius() away from the query and outside points
+            // at least radius() - dist
+            if (current->left() != nullptr && dist - current->radius() <= radius) {
+                toSearch.push_back(current->left());
+            }
+            if (current->right() != nullptr && current->radius() - dist <= radius) {
+                toSearch.push_back(current->right());
+            }
+        }
+
+        std::sort(found.begin(), found.end());
+        result.indexes.resize(found.size());
+        result.distances.resize(found.size());
+        for (size_t i = 0; i < found.size(); ++i) {
+            result.distances[i] = found[i].first;
+            result.indexes[i] = found[i].second;
+        }
+    }
+
+    /*
+     *  Best first version of searchKNN. Scheduled partitions are kept in a min heap by a lower bound of the distance from
+     *  the query to any of their points, so the most promising partition is always searched next. When the closest
+     *  scheduled partition is farther than tau, so is every other scheduled partition and the search is over.
+     */
+    template <typename KNNQueue, bool collectStats>
+    void searchKNNBestFirst(VPLevelPartition<distance_type> *partition, const T &val, KNNSearchState<KNNQueue, collectStats> &state) {
+
+        auto &frontier = searchScratch().frontier;
+        frontier.clear();
+        frontier.push_back({0, partition});
+
+        while (!frontier.empty()) {
+            if (state.outOfBudget()) {
+                break;
+            }
+            state.stats.stackDepth(frontier.size());
+
+            std::pop_heap(frontier.begin(), frontier.end(), std::greater<>());
+            auto [lowerBound, current] = frontier.back();
+            frontier.pop_back();
+
+            if (state.prune(lowerBound)) {
+                // prune the whole frontier at once
+                state.stats.pruned(frontier.size());
+                break;
+            }
+
+            if (!state.hasAllowed(current)) {
+                continue;
+            }
+
+            if (state.isScanned(current)) {
+                scanLeaf(current, val, state);
+                continue;
+            }
+
+            auto dist = visitVantagePoint(current, val, state);
+
+            // points inside are within radius from the vantage point and points outside are beyond it, so by triangle
+            // inequality their distance to the query is at least |dist - radius| on the side the query is not in
+            distance_type insideBound = lowerBound;
+            distance_type outsideBound = lowerBound;
+            if (dist > current->radius()) {
+                insideBound = std::max<distance_type>(lowerBound, dist - current->radius());
+            } else {
+                outsideBound = std::max<distance_type>(lowerBound, current->radius() - dist);
+            }
+
+            auto schedule = [&](distance_type bound, VPLevelPartition<distance_type> *child) {
+                if (child != nullptr && !state.prune(bound)) {
+                    frontier.push_back({bound, child});
+                    std::push_heap(frontier.begin(), frontier.end(), std::greater<>());
+                }
+            };
+            schedule(insideBound, current->left());
+            schedule(outsideBound, current->right());
+        }
+    }
+
+    // One query of a block scheduled to be searched within a partition, along with its distance to the partition border
+    // (-1 when the partition must be searched regardless of tau).
+    struct VPTreeScheduledQuery {
+        int query;
+        distance_type distToBorder;
+    };
+
+    /*
+     *  Buffers used by the search functions. They are kept per thread and reused across queries and calls, so once they
+     *  have grown to the needed size there are no allocations left in the search path.
+     */
+    struct VPTreeSearchScratch {
+        std::vector<std::tuple<distance_type, VPLevelPartition<distance_type> *>> toSearch;
+
+        // searchKNNBestFirst min heap of (distance lower bound, partition)
+        std::vector<std::pair<distance_type, VPLevelPartition<distance_type> *>> frontier;
+
+        // searchRadius stack and (distance, index) of the points found
+        std::vector<VPLevelPartition<distance_type> *> partitions;
+        std::vector<std::pair<distance_type, int64_t>> found;
+
+        // searchKNNBlock buffers
+        std::vector<std::tuple<size_t, VPLevelPartition<distance_type> *>> blockToSearch;
+        std::vector<VPTreeScheduledQuery> scheduled, active, inside, outside;
+        std::vector<distance_type> taus, dists;
+
+        // knnGraph distances to the points around the query in tree order
+        std::vector<distance_type> seedDistances;
+    };
+
+    static VPTreeSearchScratch &searchScratch() {
+        thread_local VPTreeSearchScratch scratch;
+        return scratch;
+    }
+
+    template <typename KNNQueue> static KNNQueue &threadKNNQueue(size_t k) {
+        thread_local KNNQueue knnQueue;
+        knnQueue.reset(k);
+        return knnQueue;
+    }
+
+    // Returns at least count reset knn queues
+    template <typename KNNQueue> static std::vector<KNNQueue> &threadKNNQueues(size_t count, size_t k) {
+        thread_local std::vector<KNNQueue> knnQueues;
+        if (knnQueues.size() < count) {
+            knnQueues.resize(count);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            knnQueues[i].reset(k);
+        }
+        return knnQueues;
+    }
+
+    /*
+     *  Block version of searchKNN. The same DFS is performed, but each scheduled partition carries the list of queries that
+     *  still need to search it. Those lists are stored contiguously in a single buffer: since partitions are processed in
+     *  LIFO order, the list of the partition on the top of the stack is always at the end of the buffer.
+     */
+    template <typename KNNQueue>
+    void searchKNNBlock(VPLevelPartition<distance_type> *partition, const T *queries, size_t count, unsigned int k,
+                        std::vector<KNNQueue> &knnQueues) {
+
+        VPTreeSearchScratch &scratch = searchScratch();
+        auto &taus = scratch.taus;
+        auto &dists = scratch.dists;
+        auto &scheduled = scratch.scheduled;
+        auto &active = scratch.active;
+        auto &inside = scratch.inside;
+        auto &outside = scratch.outside;
+
+        taus.assign(count, std::numeric_limits<distance_type>::max());
+        scheduled.clear();
+        for (size_t q = 0; q < count; ++q) {
+            scheduled.push_back({static_cast<int>(q), -1});
+        }
+
+        // (offset of the query list within scheduled, partition)
+        auto &toSearch = scratch.blockToSearch;
+        toSearch.clear();
+        toSearch.push_back({0, partition});
+
+        while (!toSearch.empty()) {
+            auto [offset, current] = toSearch.back();
+            toSearch.pop_back();
+
+            // drop queries for which the partition border got farther than tau since the partition was scheduled
+            active.clear();
+            for (size_t i = offset; i < scheduled.size(); ++i) {
+                const VPTreeScheduledQuery &s = scheduled[i];
+                if (s.distToBorder < 0 || s.distToBorder <= taus[s.query]) {
+                    active.push_back(s);
+                }
+            }
+            scheduled.resize(offset);
+
+            if (active.empty()) {
+                continue;
+            }
+
+            // one-to-many: the vantage point stays in cache while it is compared against the whole block
+            const VPTreeElement &vantagePoint = _examples[current->start()];
+            dists.resize(active.size());
+            if (isLeaf(current)) {
+                for (size_t j = 0; j < active.size(); ++j) {
+                    const int q = active[j].query;
+                    const distance_type bound = knnQueues[q].size() < k ? std::numeric_limits<distance_type>::max() : taus[q];
+                    dists[j] = leafDistance(queries[q], current->start(), bound);
+                }
+            } else {
+                for (size_t j = 0; j < active.size(); ++j) {
+                    dists[j] = distance(queries[active[j].query], vantagePoint.val);
+                }
+            }
+
+            inside.clear();
+            outside.clear();
+            size_t numNearInside = 0;
+
+            for (size_t j = 0; j < active.size(); ++j) {
+                const int q = active[j].query;
+                const distance_type dist = dists[j];
+                auto &knnQueue = knnQueues[q];
+
+                if (dist < taus[q] || knnQueue.size() < k) {
+                    knnQueue.push(vantagePoint.originalIndex, dist);
+                    if (knnQueue.size() == k) {
+                        taus[q] = knnQueue.worst();
+                    }
+                }
+
+                // same scheduling rules as searchKNN, applied to each query of the block
+                if (dist > current->radius()) {
+                    if (current->left() != nullptr) {
+                        auto toBorder = dist - current->radius();
+                        if (toBorder <= taus[q]) {
+                            inside.push_back({q, toBorder});
+                        }
+                    }
+                    if (current->right() != nullptr) {
+                        outside.push_back({q, -1});
+                    }
+                } else {
+                    ++numNearInside;
+                    if (current->right() != nullptr) {
+                        auto toBorder = current->radius() - dist;
+                        if (toBorder <= taus[q]) {
+                            outside.push_back({q, toBorder});
+                        }
+                    }
+                    if (current->left() != nullptr) {
+                        inside.push_back({q, -1});
+                    }
+                }
+            }
+
+            // the side closer to most of the block is scheduled last so it is searched first
+            auto schedule = [&](std::vector<VPTreeScheduledQuery> &list, VPLevelPartition<distance_type> *child) {
+                if (!list.empty()) {
+                    toSearch.push_back({scheduled.size(), child});
+                    scheduled.insert(scheduled.end(), list.begin(), list.end());
+                }
+            };
+
+            if (2 * numNearInside >= active.size()) {
+                schedule(outside, current->right());
+                schedule(inside, current->left());
+            } else {
+                schedule(inside, current->left());
+                schedule(outside, current->right());
+            }
+        }
+    }
+
+    template <bool collectStats>
+    void search1NN(VPLevelPartition<distance_type> *partition, const T &val, int64_t &resultIndex, distance_type &resultDist,
+                   VPTreeSearchStatsRecorder<collectStats> stats) {
 
         resultDist = std::numeric_limits<distance_type>::max();
         resultIndex = -1;
 
-        std::vector<std::tuple<distance_type, VPLevelPartition<distance_type> *>> toSearch = {{-1, partition}};
+        auto &toSearch = searchScratch().toSearch;
+        toSearch.clear();
+        toSearch.push_back({-1, partition});
 
         while (!toSearch.empty()) {
+            stats.stackDepth(toSearch.size());
 
             auto [distToBorder, current] = toSearch.back();
             toSearch.pop_back();
 
-            auto dist = distance(val, _examples[current->start()].val);
+            auto dist = isLeaf(current) ? leafDistance(val, current->start(), resultDist) : distance(val, _examples[current->start()].val);
+            stats.visit();
+            stats.distances(1);
             if (dist < resultDist) {
                 resultDist = dist;
                 resultIndex = _examples[current->start()].originalIndex;
+                stats.inserted();
             }
 
             if (distToBorder >= 0 && distToBorder > resultDist) {
 
                 // distance to this partition border change and its not necessary to search within it anymore
+                stats.pruned(1);
                 continue;
             }
 
@@ -456,6 +1431,8 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
                 auto toBorder = dist - current->radius();
                 if (toBorder < resultDist && current->left() != nullptr) {
                     toSearch.push_back({toBorder, current->left()});
+                } else if (current->left() != nullptr) {
+                    stats.pruned(1);
                 }
 
                 // must search outside
@@ -467,6 +1444,8 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
                 // may need to search outside as well
                 if (toBorder < resultDist && current->right() != nullptr) {
                     toSearch.push_back({toBorder, current->right()});
+                } else if (current->right() != nullptr) {
+                    stats.pruned(1);
                 }
 
                 // must search inside
@@ -485,23 +1464,17 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
         assert(fromIndex >= 0 && fromIndex < _examples.size() && toIndex >= 0 && toIndex < _examples.size() && fromIndex <= toIndex &&
                "fromIndex and toIndex must be in a valid range");
 
+        // the pick is a hash of the range instead of rand(), so there is no generator state shared between threads (query
+        // trees are built concurrently by searchKNNDualTree) and building the same data always gives the same tree
+        uint64_t hash = (static_cast<uint64_t>(fromIndex) << 32) ^ static_cast<uint64_t>(toIndex);
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+        hash ^= hash >> 31;
+
         int64_t range = (toIndex - fromIndex) + 1;
-        return fromIndex + (rand() % range);
+        return fromIndex + static_cast<int64_t>(hash % static_cast<uint64_t>(range));
     }
 
-    // Fill result element from serach element internal structure
-    // After a call to that function, knnQueue gets invalidated!
-    void fillSearchResult(std::priority_queue<VPTreeSearchElement> &knnQueue, VPTreeSearchResultElement &element) {
-        element.distances.reserve(knnQueue.size());
-        element.indexes.reserve(knnQueue.size());
-
-        while (!knnQueue.empty()) {
-            const VPTreeSearchElement &top = knnQueue.top();
-            element.distances.push_back(top.dist);
-            element.indexes.push_back(top.index);
-            knnQueue.pop();
-        }
-    }
     /*
      * A vantage point distance comparator. Will check which from two points are closer to the reference vantage point.
      * This is used to find the median distance from vantage point in order to split the VPLevelPartition into two sets.
@@ -513,9 +1486,12 @@ template <typename T, typename distance_type, distance_type (*distance)(const T
         bool operator()(const VPTreeElement &a, const VPTreeElement &b) { return distance(item, a.val) < distance(item, b.val); }
     };
 
+    ThreadPool &threadPool() const { return _threadPool != nullptr ? *_threadPool : ThreadPool::defaultPool(); }
+
     protected:
     std::vector<VPTreeElement> _examples;
     VPLevelPartition<distance_type> *_rootPartition = nullptr;
+    std::shared_ptr<ThreadPool> _threadPool;
 };
 
 } // namespace vptree
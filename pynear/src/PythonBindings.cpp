@@ -7,15 +7,30 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <omp.h>
+#include <shared_mutex>
 #include <sstream>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
 
 #include <BKTree.hpp>
+#include <BindingUtils.hpp>
+#include <BruteForceIndex.hpp>
+#include <CostModel.hpp>
 #include <DistanceFunctions.hpp>
 #include <ISerializable.hpp>
+#include <TaskQueue.hpp>
 #include <VPTree.hpp>
 
 namespace py = pybind11;
@@ -23,122 +38,853 @@ namespace py = pybind11;
 typedef float (*distance_func_f)(const arrayf &, const arrayf &);
 typedef int64_t (*distance_func_li)(const arrayli &, const arrayli &);
 
-template <distance_func_f distance> class VPTreeNumpyAdapter {
+// Point and distance types of a distance function
+template <typename Function> struct DistanceSignature;
+
+template <typename PointType, typename DistanceType> struct DistanceSignature<DistanceType (*)(const PointType &, const PointType &)> {
+    using Point = PointType;
+    using Distance = DistanceType;
+};
+
+// Converts a time budget in seconds given from python
+static std::chrono::nanoseconds toNanoseconds(double seconds) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(std::max(seconds, 0.0)));
+}
+
+typedef py::array_t<bool, py::array::c_style | py::array::forcecast> ndarrayb;
+typedef std::vector<std::pair<int64_t, int64_t>> IndexRanges;
+
+// Sorts and merges overlapping [first, second) index ranges given from python
+static void normalizeRanges(IndexRanges &ranges) {
+    std::sort(ranges.begin(), ranges.end());
+
+    size_t merged = 0;
+    for (const auto &range : ranges) {
+        if (range.first >= range.second) {
+            continue;
+        }
+        if (merged > 0 && range.first <= ranges[merged - 1].second) {
+            ranges[merged - 1].second = std::max(ranges[merged - 1].second, range.second);
+        } else {
+            ranges[merged++] = range;
+        }
+    }
+    ranges.resize(merged);
+}
+
+// Search stats as a numpy structured array: one row per query, or a single row summing them with aggregate
+static py::array_t<vptree::VPTreeSearchStats> statsToNumpyArray(std::vector<vptree::VPTreeSearchStats> &&stats, bool aggregate) {
+    if (aggregate) {
+        vptree::VPTreeSearchStats total{};
+        for (const vptree::VPTreeSearchStats &queryStats : stats) {
+            total += queryStats;
+        }
+        stats.assign(1, total);
+    }
+    return BindingUtils::vectorToNumpyArray(std::move(stats));
+}
+
+// Workers behind submit(), created on first use and shut down at interpreter exit, while they can still deliver results.
+// There is one worker per hardware thread, unless the PYNEAR_SUBMIT_THREADS environment variable sets their number.
+static vptree::TaskQueue *asyncQueueInstance = nullptr;
+
+static vptree::TaskQueue &asyncQueue() {
+    // callers hold the GIL, so there is no concurrent creation
+    if (asyncQueueInstance == nullptr) {
+        size_t numThreads = std::thread::hardware_concurrency();
+        if (const char *threads = std::getenv("PYNEAR_SUBMIT_THREADS")) {
+            numThreads = std::strtoul(threads, nullptr, 10);
+        }
+        asyncQueueInstance = new vptree::TaskQueue(numThreads, 256);
+    }
+    return *asyncQueueInstance;
+}
+
+static void shutdownAsyncQueue() {
+    if (asyncQueueInstance != nullptr) {
+        py::gil_scoped_release release;
+        asyncQueueInstance->shutdown();
+    }
+}
+
+/*
+ *  Reader/writer lock of an index: searches hold it shared and set() holds it exclusively, so that the index is never
+ *  rebuilt under a running search. Holders may need the GIL to finish, so it is only ever waited on with the GIL released.
+ */
+class IndexGuard {
     public:
+    void lock() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _released.wait(lock, [this]() { return !_writing && _readers == 0; });
+        _writing = true;
+    }
+
+    void unlock() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _writing = false;
+        }
+        _released.notify_all();
+    }
+
+    void lock_shared() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _released.wait(lock, [this]() { return !_writing; });
+        ++_readers;
+    }
+
+    void unlock_shared() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            --_readers;
+        }
+        _released.notify_all();
+    }
+
+    // Runs fn without the GIL, holding the guard shared
+    template <typename Function> auto read(Function &&fn) {
+        py::gil_scoped_release release;
+        std::shared_lock<IndexGuard> lock(*this);
+        return fn();
+    }
+
+    // Runs fn without the GIL, holding the guard exclusively
+    template <typename Function> auto write(Function &&fn) {
+        py::gil_scoped_release release;
+        std::unique_lock<IndexGuard> lock(*this);
+        return fn();
+    }
+
+    private:
+    std::mutex _mutex;
+    std::condition_variable _released;
+    size_t _readers = 0;
+    bool _writing = false;
+};
+
+/*
+ *  Queues a search on the async workers and returns a concurrent.futures.Future of its (n, k) indices and distances arrays.
+ *  search(indexes, distances) fills the arrays without the GIL. index is the python object searched, kept alive until the
+ *  search is done, and guard its guard, held shared while the search runs: the search answers from the vectors indexed
+ *  when it starts, and a set() waits for the running searches only, so callbacks of the futures may call set() even when
+ *  searches are pending on the worker running them. Submitting blocks while the queue is full, except from a worker.
+ */
+template <typename distance_type, typename Search>
+static py::object submitKNN(py::handle index, IndexGuard &guard, size_t numQueries, size_t k, Search search) {
+    py::object future = py::module_::import("concurrent.futures").attr("Future")();
+
+    // python references are handed over to the task, which only drops them while holding the GIL
+    py::handle futureHandle = future.inc_ref();
+    index.inc_ref();
+    auto task = [futureHandle, index, &guard, numQueries, k, search = std::move(search)]() {
+        {
+            py::gil_scoped_acquire acquire;
+            if (!futureHandle.attr("set_running_or_notify_cancel")().cast<bool>()) {
+                futureHandle.dec_ref();
+                index.dec_ref();
+                return;
+            }
+        }
+
+        std::vector<int64_t> indexes(numQueries * k);
+        std::vector<distance_type> distances(numQueries * k);
+        std::string error;
+        try {
+            // released before delivering the result, as callbacks of the future may call set()
+            std::shared_lock<IndexGuard> hold(guard);
+            search(indexes.data(), distances.data());
+        } catch (const std::exception &e) {
+            error = e.what();
+        }
+
+        py::gil_scoped_acquire acquire;
+        try {
+            if (error.empty()) {
+                futureHandle.attr("set_result")(py::make_tuple(BindingUtils::vectorToNumpyArray(std::move(indexes), numQueries, k),
+                                                               BindingUtils::vectorToNumpyArray(std::move(distances), numQueries, k)));
+            } else {
+                futureHandle.attr("set_exception")(py::reinterpret_borrow<py::object>(PyExc_RuntimeError)(error));
+            }
+        } catch (py::error_already_set &e) {
+            e.discard_as_unraisable("pynear submit");
+        }
+        futureHandle.dec_ref();
+        index.dec_ref();
+    };
+
+    vptree::TaskQueue &queue = asyncQueue();
+    try {
+        // workers need the GIL to deliver their results, so it must not be held while waiting for a free slot
+        py::gil_scoped_release release;
+        queue.submit(std::move(task));
+    } catch (...) {
+        futureHandle.dec_ref();
+        index.dec_ref();
+        throw;
+    }
+    return future;
+}
+
+/*
+ *  Python iterator yielding (indices, distances) arrays of up to chunk size neighbors of a query, from the closest to the
+ *  farthest one, through nextChunk (None once every neighbor was yielded). The same class serves every index type.
+ */
+class NeighborChunkIterator {
+    public:
+    explicit NeighborChunkIterator(std::function<py::object()> nextChunk) : _nextChunk(std::move(nextChunk)) {}
+
+    py::object next() {
+        py::object chunk = _nextChunk();
+        if (chunk.is_none()) {
+            throw py::stop_iteration();
+        }
+        return chunk;
+    }
+
+    private:
+    std::function<py::object()> _nextChunk;
+};
+
+/*
+ *  Wraps a VPTreeNeighborIterator of an index whose set() bumps generation. Chunks are searched with the GIL held, so the
+ *  tree cannot be rebuilt in the middle of one, and iterating over a rebuilt index raises.
+ */
+template <typename distance_type, typename Iterator>
+static NeighborChunkIterator makeNeighborIterator(Iterator iterator, size_t chunkSize, const size_t &generation) {
+    if (chunkSize == 0) {
+        throw std::invalid_argument("chunk size must be greater than zero");
+    }
+
+    auto state = std::make_shared<Iterator>(std::move(iterator));
+    return NeighborChunkIterator([state, chunkSize, &generation, startGeneration = generation]() -> py::object {
+        if (generation != startGeneration) {
+            throw std::runtime_error("index was modified while iterating over the neighbors of a query");
+        }
+
+        std::vector<int64_t> indexes(chunkSize);
+        std::vector<distance_type> distances(chunkSize);
+        const size_t found = state->next(chunkSize, indexes.data(), distances.data());
+        if (found == 0) {
+            return py::none();
+        }
+        indexes.resize(found);
+        distances.resize(found);
+        return py::make_tuple(BindingUtils::vectorToNumpyArray(std::move(indexes)), BindingUtils::vectorToNumpyArray(std::move(distances)));
+    });
+}
+
+/*
+ *  Index over points of any dtype, whose type and the type of their distances are the ones of the distance function:
+ *  float32 points and float distances, float64, int16 or int32 points and double distances.
+ */
+template <auto distance> class VPTreeNumpyAdapter {
+    public:
+    using Point = typename DistanceSignature<decltype(distance)>::Point;
+    using distance_type = typename DistanceSignature<decltype(distance)>::Distance;
+    using Points = std::vector<Point>;
+    using Tree = vptree::VPTree<Point, distance_type, distance, bounded_distance<distance>::function>;
+
     VPTreeNumpyAdapter() = default;
 
-    void set(const ndarrayf &array) { tree.set(array); }
+    /*
+     *  With tune, searches of the new points are measured to pick the leaf size of tree searches and, for L2, whether
+     *  large batches are better answered by a GEMM brute force scan, kept alongside the tree only if it ever wins.
+     */
+    void set(const Points &array, bool tune) {
+        ++generation;
+        guard.write([&]() {
+            tree.set(array);
+            plan = vptree::SearchPlan();
+            bruteForce = nullptr;
+            if (!tune) {
+                return;
+            }
+
+            if constexpr (std::is_same<Point, arrayf>::value) {
+                if constexpr (distance == dist_l2_f_avx2) {
+                    if (array.size() > 0) {
+                        bruteForce = std::make_shared<vptree::BruteForceIndex>();
+                        bruteForce->set(array);
+                        bruteForce->setNumThreads(threadCount, schedule);
+                    }
+                }
+            }
+            plan = vptree::planSearch(tree, array, bruteForce.get());
+            if (!plan.bruteForceEverWins()) {
+                bruteForce = nullptr;
+            }
+        });
+    }
+
+    void setNumThreads(size_t num_threads, bool work_stealing) {
+        guard.write([&]() {
+            threadCount = num_threads;
+            schedule = work_stealing ? vptree::ThreadPool::Schedule::WorkStealing : vptree::ThreadPool::Schedule::Static;
+            tree.setNumThreads(threadCount, schedule);
+            if (bruteForce != nullptr) {
+                bruteForce->setNumThreads(threadCount, schedule);
+            }
+        });
+    }
+    size_t numThreads() const {
+        return guard.read([this]() { return tree.numThreads(); });
+    }
+
+    py::dict searchPlan() const {
+        const auto [current, keepsBruteForce] = guard.read([this]() { return std::make_pair(plan, bruteForce != nullptr); });
+        py::dict result;
+        result["leaf_size"] = current.leafSize;
+        result["evaluated_fraction"] = current.evaluatedFraction;
+        result["tree_seconds_per_query"] = current.treeSecondsPerQuery;
+        result["brute_force"] = keepsBruteForce;
+        result["brute_force_seconds_per_block"] = current.bruteForceSecondsPerBlock;
+        result["brute_force_seconds_per_query"] = current.bruteForceSecondsPerQuery;
+        return result;
+    }
+
+    /*
+     *  Options of tree searches following the measured plan. Every search taking options starts from these, while
+     *  searchKNNBatched, searchKNNDualTree, knnGraph, searchRadius and neighbor iterators walk the tree their own way and
+     *  are not tuned. Called with the guard held.
+     */
+    typename Tree::VPTreeSearchOptions searchOptions(bool bestFirst) const {
+        typename Tree::VPTreeSearchOptions options;
+        options.bestFirst = bestFirst;
+        options.leafSize = plan.leafSize;
+        return options;
+    }
 
-    std::tuple<std::vector<std::vector<int64_t>>, std::vector<std::vector<float>>> searchKNN(const ndarrayf &queries, size_t k) {
+    /*
+     *  Answers a kNN search with the brute force index, and returns true, when the plan measured it faster than the tree
+     *  for that many queries on numThreads threads. Filtered and radius bounded searches are only supported by the tree.
+     *  Results are the ones of the tree, so best_first and reorder_queries, which only order its traversal, are ignored.
+     *  Called with the guard held.
+     */
+    bool searchKNNBruteForce(const Points &queries, size_t k, int64_t *indexes, distance_type *distances, size_t numThreads) {
+        // only float32 L2 indexes ever get a brute force index
+        if constexpr (std::is_same<Point, arrayf>::value) {
+            if (bruteForce != nullptr && plan.useBruteForce(queries.size(), numThreads)) {
+                bruteForce->searchKNN(queries, k, indexes, distances);
+                return true;
+            }
+        }
+        return false;
+    }
 
-        std::vector<typename vptree::VPTree<arrayf, float, distance>::VPTreeSearchResultElement> results;
-        tree.searchKNN(queries, k, results);
+    std::tuple<py::array_t<int64_t>, py::array_t<distance_type>>
+    searchKNN(const Points &queries, size_t k, bool best_first, std::optional<distance_type> max_radius, std::optional<ndarrayb> allowed,
+              std::optional<std::vector<IndexRanges>> allowed_ranges, std::optional<py::tuple> out, bool reorder_queries) {
 
-        std::vector<std::vector<int64_t>> indexes;
-        std::vector<std::vector<float>> distances;
-        indexes.resize(results.size());
-        distances.resize(results.size());
-        for (size_t i = 0; i < results.size(); ++i) {
-            indexes[i] = std::move(results[i].indexes);
-            distances[i] = std::move(results[i].distances);
+        std::vector<bool> allowedFlags;
+        if (allowed.has_value()) {
+            allowedFlags.assign(allowed->data(), allowed->data() + allowed->size());
         }
+        if (allowed_ranges.has_value()) {
+            for (IndexRanges &ranges : allowed_ranges.value()) {
+                normalizeRanges(ranges);
+            }
+        }
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<distance_type>(out, queries.size(), k);
+        int64_t *indexesData = indexes.mutable_data();
+        distance_type *distancesData = distances.mutable_data();
+        guard.read([&]() {
+            const bool filtered = max_radius.has_value() || allowed.has_value() || allowed_ranges.has_value();
+            if (!filtered && searchKNNBruteForce(queries, k, indexesData, distancesData, tree.numThreads())) {
+                return;
+            }
+
+            typename Tree::VPTreeSearchOptions options = searchOptions(best_first);
+            options.reorderQueries = reorder_queries;
+            if (max_radius.has_value()) {
+                options.maxRadius = max_radius.value();
+            }
+            typename Tree::VPTreeAllowedSet allowedSet;
+            if (allowed.has_value()) {
+                allowedSet = tree.makeAllowedSet(allowedFlags);
+                options.allowedSet = &allowedSet;
+            }
+            if (allowed_ranges.has_value()) {
+                options.allowedRanges = &allowed_ranges.value();
+            }
+            tree.searchKNN(queries, k, {indexesData, distancesData, k}, options);
+        });
+
+        return std::make_tuple(indexes, distances);
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<distance_type>, py::array_t<bool>>
+    searchKNNApprox(const Points &queries, size_t k, double epsilon, std::optional<size_t> max_distance_evaluations,
+                    std::optional<size_t> max_visited_nodes, std::optional<double> time_budget, std::optional<double> query_time_budget,
+                    bool best_first) {
+
+        // the budget of the whole call also covers waiting for a set() in progress
+        const auto start = std::chrono::steady_clock::now();
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<distance_type>(std::nullopt, queries.size(), k);
+        py::array_t<bool> exact(queries.size());
+        int64_t *indexesData = indexes.mutable_data();
+        distance_type *distancesData = distances.mutable_data();
+        bool *exactData = exact.mutable_data();
+        guard.read([&]() {
+            typename Tree::VPTreeSearchOptions options = searchOptions(best_first);
+            options.epsilon = epsilon;
+            if (max_distance_evaluations.has_value()) {
+                options.maxDistanceEvaluations = max_distance_evaluations.value();
+            }
+            if (max_visited_nodes.has_value()) {
+                options.maxVisitedNodes = max_visited_nodes.value();
+            }
+            if (time_budget.has_value()) {
+                options.deadline = start + toNanoseconds(time_budget.value());
+            }
+            if (query_time_budget.has_value()) {
+                options.queryTimeBudget = toNanoseconds(query_time_budget.value());
+            }
+            tree.searchKNN(queries, k, {indexesData, distancesData, k, exactData}, options);
+        });
+
+        return std::make_tuple(indexes, distances, exact);
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<distance_type>> searchKNNBatched(const Points &queries, size_t k, size_t block_size) {
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<distance_type>(std::nullopt, queries.size(), k);
+        int64_t *indexesData = indexes.mutable_data();
+        distance_type *distancesData = distances.mutable_data();
+        guard.read([&]() { tree.searchKNNBatched(queries, k, {indexesData, distancesData, k}, block_size); });
+
+        return std::make_tuple(indexes, distances);
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>, py::array_t<distance_type>>
+    searchRadius(const Points &queries, py::array_t<distance_type, py::array::c_style | py::array::forcecast> radius) {
+
+        std::vector<distance_type> radii(radius.data(), radius.data() + radius.size());
+        std::vector<int64_t> offsets;
+        std::vector<int64_t> indexes;
+        std::vector<distance_type> distances;
+        guard.read([&]() { tree.searchRadius(queries, radii, offsets, indexes, distances); });
+
+        return std::make_tuple(BindingUtils::vectorToNumpyArray(std::move(offsets)), BindingUtils::vectorToNumpyArray(std::move(indexes)),
+                               BindingUtils::vectorToNumpyArray(std::move(distances)));
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<distance_type>> searchKNNDualTree(const Points &queries, size_t k, size_t block_size) {
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<distance_type>(std::nullopt, queries.size(), k);
+        int64_t *indexesData = indexes.mutable_data();
+        distance_type *distancesData = distances.mutable_data();
+        guard.read([&]() { tree.searchKNNDualTree(queries, k, {indexesData, distancesData, k}, block_size); });
 
         return std::make_tuple(indexes, distances);
     }
 
-    std::tuple<std::vector<int64_t>, std::vector<float>> search1NN(const ndarrayf &queries) {
+    std::tuple<py::array_t<int64_t>, py::array_t<distance_type>> knnGraph(size_t k, bool exclude_self) {
+
+        std::vector<int64_t> indexes;
+        std::vector<distance_type> distances;
+        const size_t numPoints = guard.read([&]() {
+            tree.knnGraph(k, exclude_self, indexes, distances);
+            return tree.size();
+        });
+
+        return std::make_tuple(BindingUtils::vectorToNumpyArray(std::move(indexes), numPoints, k),
+                               BindingUtils::vectorToNumpyArray(std::move(distances), numPoints, k));
+    }
+
+    NeighborChunkIterator iterNeighbors(const Point &query, size_t chunk_size) {
+        return makeNeighborIterator<distance_type>(guard.read([&]() { return tree.neighbors(query); }), chunk_size, generation);
+    }
+
+    py::object submit(Points queries, size_t k) {
+        const size_t numQueries = queries.size();
+        return submitKNN<distance_type>(py::cast(this, py::return_value_policy::reference), guard, numQueries, k,
+                                        [this, queries = std::move(queries), k](int64_t *indexes, distance_type *distances) {
+                                            // batches in flight run in parallel, so each one runs on its worker thread only
+                                            vptree::ThreadPool::SerialScope serial;
+                                            if (!searchKNNBruteForce(queries, k, indexes, distances, 1)) {
+                                                tree.searchKNN(queries, k, {indexes, distances, k}, searchOptions(false));
+                                            }
+                                        });
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<distance_type>> search1NN(const Points &queries) {
 
         std::vector<int64_t> indices;
-        std::vector<float> distances;
-        tree.search1NN(queries, indices, distances);
+        std::vector<distance_type> distances;
+        guard.read([&]() {
+            if (bruteForce != nullptr && plan.useBruteForce(queries.size(), tree.numThreads())) {
+                if constexpr (std::is_same<Point, arrayf>::value) {
+                    bruteForce->search1NN(queries, indices, distances);
+                }
+            } else {
+                tree.search1NN(queries, indices, distances);
+            }
+        });
 
-        return std::make_tuple(std::move(indices), std::move(distances));
+        return std::make_tuple(BindingUtils::vectorToNumpyArray(std::move(indices)), BindingUtils::vectorToNumpyArray(std::move(distances)));
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<distance_type>, py::array_t<vptree::VPTreeSearchStats>>
+    searchKNNStats(const Points &queries, size_t k, bool best_first, bool aggregate) {
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<distance_type>(std::nullopt, queries.size(), k);
+        int64_t *indexesData = indexes.mutable_data();
+        distance_type *distancesData = distances.mutable_data();
+        std::vector<vptree::VPTreeSearchStats> stats;
+        guard.read([&]() { tree.searchKNN(queries, k, {indexesData, distancesData, k}, searchOptions(best_first), stats); });
+
+        return std::make_tuple(indexes, distances, statsToNumpyArray(std::move(stats), aggregate));
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<distance_type>, py::array_t<vptree::VPTreeSearchStats>>
+    search1NNStats(const Points &queries, bool aggregate) {
+
+        std::vector<int64_t> indices;
+        std::vector<distance_type> distances;
+        std::vector<vptree::VPTreeSearchStats> stats;
+        guard.read([&]() { tree.search1NN(queries, indices, distances, stats); });
+
+        return std::make_tuple(BindingUtils::vectorToNumpyArray(std::move(indices)), BindingUtils::vectorToNumpyArray(std::move(distances)),
+                               statsToNumpyArray(std::move(stats), aggregate));
     }
 
     std::string to_string() {
-        std::stringstream stream;
-        stream << tree;
+        return guard.read([this]() {
+            std::stringstream stream;
+            stream << tree;
 
-        return stream.str();
+            return stream.str();
+        });
     }
 
-    static py::tuple get_state(const VPTreeNumpyAdapter<distance> &p) {
-        vptree::SerializedState state = p.tree.serialize();
+    static py::tuple get_state(const VPTreeNumpyAdapter &p) {
+        vptree::SerializedState state = p.guard.read([&p]() { return p.tree.serialize(); });
         py::tuple t = py::make_tuple(state.data, state.checksum);
         return t;
     }
 
-    static VPTreeNumpyAdapter<distance> set_state(py::tuple t) {
-        VPTreeNumpyAdapter<distance> p;
+    // unpickling builds a new index, which no other thread can reach yet
+    static std::unique_ptr<VPTreeNumpyAdapter> set_state(py::tuple t) {
+        auto p = std::make_unique<VPTreeNumpyAdapter>();
         std::vector<uint8_t> state = t[0].cast<std::vector<uint8_t>>();
         uint8_t checksum = t[1].cast<uint8_t>();
-        p.tree.deserialize(vptree::SerializedState(state, checksum));
+        p->tree.deserialize(vptree::SerializedState(state, checksum));
         return p;
     }
 
-    vptree::VPTree<arrayf, float, distance> tree;
+    Tree tree;
+    size_t generation = 0;
+    mutable IndexGuard guard;
+
+    // measured by set(tune=True), not pickled: unpickled indexes use the default plan
+    vptree::SearchPlan plan;
+    std::shared_ptr<vptree::BruteForceIndex> bruteForce;
+    size_t threadCount = 0;
+    vptree::ThreadPool::Schedule schedule = vptree::ThreadPool::Schedule::WorkStealing;
 };
 
 template <distance_func_li distance> class VPTreeNumpyAdapterBinary {
     public:
+    using Tree = vptree::VPTree<arrayli, int64_t, distance, bounded_distance<distance>::function>;
+
     VPTreeNumpyAdapterBinary() = default;
 
-    void set(const ndarrayli &array) { tree.set(array); }
+    void set(const ndarrayli &array) {
+        ++generation;
+        guard.write([&]() { tree.set(array); });
+    }
+
+    void setNumThreads(size_t num_threads, bool work_stealing) {
+        guard.write([&]() {
+            tree.setNumThreads(num_threads, work_stealing ? vptree::ThreadPool::Schedule::WorkStealing : vptree::ThreadPool::Schedule::Static);
+        });
+    }
+    size_t numThreads() const {
+        return guard.read([this]() { return tree.numThreads(); });
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>>
+    searchKNN(const ndarrayli &queries, size_t k, bool best_first, std::optional<int64_t> max_radius, std::optional<ndarrayb> allowed,
+              std::optional<std::vector<IndexRanges>> allowed_ranges, std::optional<py::tuple> out, bool reorder_queries) {
+
+        typename Tree::VPTreeSearchOptions options;
+        options.bestFirst = best_first;
+        options.reorderQueries = reorder_queries;
+        if (max_radius.has_value()) {
+            options.maxRadius = max_radius.value();
+        }
+
+        std::vector<bool> allowedFlags;
+        if (allowed.has_value()) {
+            allowedFlags.assign(allowed->data(), allowed->data() + allowed->size());
+        }
+        if (allowed_ranges.has_value()) {
+            for (IndexRanges &ranges : allowed_ranges.value()) {
+                normalizeRanges(ranges);
+            }
+            options.allowedRanges = &allowed_ranges.value();
+        }
 
-    std::tuple<std::vector<std::vector<int64_t>>, std::vector<std::vector<int64_t>>> searchKNN(const ndarrayli &queries, size_t k) {
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<int64_t>(out, queries.size(), k);
+        int64_t *indexesData = indexes.mutable_data();
+        int64_t *distancesData = distances.mutable_data();
+        guard.read([&]() {
+            typename Tree::VPTreeAllowedSet allowedSet;
+            if (allowed.has_value()) {
+                allowedSet = tree.makeAllowedSet(allowedFlags);
+                options.allowedSet = &allowedSet;
+            }
+            tree.searchKNN(queries, k, {indexesData, distancesData, k}, options);
+        });
+
+        return std::make_tuple(indexes, distances);
+    }
 
-        std::vector<typename vptree::VPTree<arrayli, int64_t, distance>::VPTreeSearchResultElement> results;
-        tree.searchKNN(queries, k, results);
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>, py::array_t<bool>>
+    searchKNNApprox(const ndarrayli &queries, size_t k, double epsilon, std::optional<size_t> max_distance_evaluations,
+                    std::optional<size_t> max_visited_nodes, std::optional<double> time_budget, std::optional<double> query_time_budget,
+                    bool best_first) {
 
-        std::vector<std::vector<int64_t>> indexes;
-        std::vector<std::vector<int64_t>> distances;
-        indexes.resize(results.size());
-        distances.resize(results.size());
-        for (size_t i = 0; i < results.size(); ++i) {
-            indexes[i] = std::move(results[i].indexes);
-            distances[i] = std::move(results[i].distances);
+        typename Tree::VPTreeSearchOptions options;
+        options.bestFirst = best_first;
+        options.epsilon = epsilon;
+        if (max_distance_evaluations.has_value()) {
+            options.maxDistanceEvaluations = max_distance_evaluations.value();
         }
+        if (max_visited_nodes.has_value()) {
+            options.maxVisitedNodes = max_visited_nodes.value();
+        }
+        if (time_budget.has_value()) {
+            options.deadline = std::chrono::steady_clock::now() + toNanoseconds(time_budget.value());
+        }
+        if (query_time_budget.has_value()) {
+            options.queryTimeBudget = toNanoseconds(query_time_budget.value());
+        }
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<int64_t>(std::nullopt, queries.size(), k);
+        py::array_t<bool> exact(queries.size());
+        int64_t *indexesData = indexes.mutable_data();
+        int64_t *distancesData = distances.mutable_data();
+        bool *exactData = exact.mutable_data();
+        guard.read([&]() { tree.searchKNN(queries, k, {indexesData, distancesData, k, exactData}, options); });
+
+        return std::make_tuple(indexes, distances, exact);
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>> searchKNNBatched(const ndarrayli &queries, size_t k, size_t block_size) {
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<int64_t>(std::nullopt, queries.size(), k);
+        int64_t *indexesData = indexes.mutable_data();
+        int64_t *distancesData = distances.mutable_data();
+        guard.read([&]() { tree.searchKNNBatched(queries, k, {indexesData, distancesData, k}, block_size); });
+
+        return std::make_tuple(indexes, distances);
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>, py::array_t<int64_t>>
+    searchRadius(const ndarrayli &queries, py::array_t<int64_t, py::array::c_style | py::array::forcecast> radius) {
+
+        std::vector<int64_t> radii(radius.data(), radius.data() + radius.size());
+        std::vector<int64_t> offsets;
+        std::vector<int64_t> indexes;
+        std::vector<int64_t> distances;
+        guard.read([&]() { tree.searchRadius(queries, radii, offsets, indexes, distances); });
+
+        return std::make_tuple(BindingUtils::vectorToNumpyArray(std::move(offsets)), BindingUtils::vectorToNumpyArray(std::move(indexes)),
+                               BindingUtils::vectorToNumpyArray(std::move(distances)));
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>> searchKNNDualTree(const ndarrayli &queries, size_t k, size_t block_size) {
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<int64_t>(std::nullopt, queries.size(), k);
+        int64_t *indexesData = indexes.mutable_data();
+        int64_t *distancesData = distances.mutable_data();
+        guard.read([&]() { tree.searchKNNDualTree(queries, k, {indexesData, distancesData, k}, block_size); });
+
         return std::make_tuple(indexes, distances);
     }
 
-    std::tuple<std::vector<int64_t>, std::vector<int64_t>> search1NN(const ndarrayli &queries) {
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>> knnGraph(size_t k, bool exclude_self) {
+
+        std::vector<int64_t> indexes;
+        std::vector<int64_t> distances;
+        const size_t numPoints = guard.read([&]() {
+            tree.knnGraph(k, exclude_self, indexes, distances);
+            return tree.size();
+        });
+
+        return std::make_tuple(BindingUtils::vectorToNumpyArray(std::move(indexes), numPoints, k),
+                               BindingUtils::vectorToNumpyArray(std::move(distances), numPoints, k));
+    }
+
+    NeighborChunkIterator iterNeighbors(const arrayli &query, size_t chunk_size) {
+        return makeNeighborIterator<int64_t>(guard.read([&]() { return tree.neighbors(query); }), chunk_size, generation);
+    }
+
+    py::object submit(ndarrayli queries, size_t k) {
+        const size_t numQueries = queries.size();
+        return submitKNN<int64_t>(py::cast(this, py::return_value_policy::reference), guard, numQueries, k,
+                              [this, queries = std::move(queries), k](int64_t *indexes, int64_t *distances) {
+                                  // batches in flight run in parallel, so each one runs on its worker thread only
+                                  vptree::ThreadPool::SerialScope serial;
+                                  tree.searchKNN(queries, k, {indexes, distances, k});
+                              });
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>> search1NN(const ndarrayli &queries) {
+
+        std::vector<int64_t> indices;
+        std::vector<int64_t> distances;
+        guard.read([&]() { tree.search1NN(queries, indices, distances); });
+
+        return std::make_tuple(BindingUtils::vectorToNumpyArray(std::move(indices)), BindingUtils::vectorToNumpyArray(std::move(distances)));
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>, py::array_t<vptree::VPTreeSearchStats>>
+    searchKNNStats(const ndarrayli &queries, size_t k, bool best_first, bool aggregate) {
+
+        typename Tree::VPTreeSearchOptions options;
+        options.bestFirst = best_first;
+
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<int64_t>(std::nullopt, queries.size(), k);
+        int64_t *indexesData = indexes.mutable_data();
+        int64_t *distancesData = distances.mutable_data();
+        std::vector<vptree::VPTreeSearchStats> stats;
+        guard.read([&]() { tree.searchKNN(queries, k, {indexesData, distancesData, k}, options, stats); });
+
+        return std::make_tuple(indexes, distances, statsToNumpyArray(std::move(stats), aggregate));
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<int64_t>, py::array_t<vptree::VPTreeSearchStats>>
+    search1NNStats(const ndarrayli &queries, bool aggregate) {
 
         std::vector<int64_t> indices;
         std::vector<int64_t> distances;
-        tree.search1NN(queries, indices, distances);
+        std::vector<vptree::VPTreeSearchStats> stats;
+        guard.read([&]() { tree.search1NN(queries, indices, distances, stats); });
 
-        return std::make_tuple(std::move(indices), std::move(distances));
+        return std::make_tuple(BindingUtils::vectorToNumpyArray(std::move(indices)), BindingUtils::vectorToNumpyArray(std::move(distances)),
+                               statsToNumpyArray(std::move(stats), aggregate));
     }
 
     std::string to_string() {
-        std::stringstream stream;
-        stream << tree;
+        return guard.read([this]() {
+            std::stringstream stream;
+            stream << tree;
 
-        return stream.str();
+            return stream.str();
+        });
     }
 
     static py::tuple get_state(const VPTreeNumpyAdapterBinary<distance> &p) {
-        vptree::SerializedState state = p.tree.serialize();
+        vptree::SerializedState state = p.guard.read([&p]() { return p.tree.serialize(); });
         py::tuple t = py::make_tuple(state.data, state.checksum);
         return t;
     }
 
-    static VPTreeNumpyAdapterBinary<distance> set_state(py::tuple t) {
-        VPTreeNumpyAdapterBinary<distance> p;
+    // unpickling builds a new index, which no other thread can reach yet
+    static std::unique_ptr<VPTreeNumpyAdapterBinary<distance>> set_state(py::tuple t) {
+        auto p = std::make_unique<VPTreeNumpyAdapterBinary<distance>>();
+        std::vector<uint8_t> state = t[0].cast<std::vector<uint8_t>>();
+        uint8_t checksum = t[1].cast<uint8_t>();
+        p->tree.deserialize(vptree::SerializedState(state, checksum));
+        return p;
+    }
+
+    Tree tree;
+    size_t generation = 0;
+    mutable IndexGuard guard;
+};
+
+typedef py::array_t<float, py::array::c_style | py::array::forcecast> ndarrayfc;
+
+template <vptree::GemmMetric metric> class BruteForceNumpyAdapter {
+    public:
+    BruteForceNumpyAdapter() = default;
+
+    void set(const ndarrayfc &array) {
+        validate(array);
+        guard.write([&]() { index.set(array.data(), array.shape(0), array.shape(1)); });
+    }
+
+    void setNumThreads(size_t num_threads, bool work_stealing) {
+        guard.write([&]() {
+            index.setNumThreads(num_threads, work_stealing ? vptree::ThreadPool::Schedule::WorkStealing : vptree::ThreadPool::Schedule::Static);
+        });
+    }
+    size_t numThreads() const {
+        return guard.read([this]() { return index.numThreads(); });
+    }
+    size_t size() const {
+        return guard.read([this]() { return index.size(); });
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<float>> searchKNN(const ndarrayfc &queries, size_t k) {
+        validate(queries);
+        const size_t numQueries = queries.shape(0);
+        auto [indexes, distances] = BindingUtils::knnOutputArrays<float>(std::nullopt, numQueries, k);
+        int64_t *indexesData = indexes.mutable_data();
+        float *distancesData = distances.mutable_data();
+        guard.read([&]() { index.searchKNN(queries.data(), numQueries, queries.shape(1), k, indexesData, distancesData); });
+
+        return std::make_tuple(indexes, distances);
+    }
+
+    std::tuple<py::array_t<int64_t>, py::array_t<float>> search1NN(const ndarrayfc &queries) {
+        validate(queries);
+        const size_t numQueries = queries.shape(0);
+        py::array_t<int64_t> indices(numQueries);
+        py::array_t<float> distances(numQueries);
+        int64_t *indicesData = indices.mutable_data();
+        float *distancesData = distances.mutable_data();
+        guard.read([&]() { index.searchKNN(queries.data(), numQueries, queries.shape(1), 1, indicesData, distancesData); });
+
+        return std::make_tuple(indices, distances);
+    }
+
+    static py::tuple get_state(const BruteForceNumpyAdapter<metric> &p) {
+        vptree::SerializedState state = p.guard.read([&p]() { return p.index.serialize(); });
+        return py::make_tuple(state.data, state.checksum);
+    }
+
+    // unpickling builds a new index, which no other thread can reach yet
+    static std::unique_ptr<BruteForceNumpyAdapter<metric>> set_state(py::tuple t) {
+        auto p = std::make_unique<BruteForceNumpyAdapter<metric>>();
         std::vector<uint8_t> state = t[0].cast<std::vector<uint8_t>>();
         uint8_t checksum = t[1].cast<uint8_t>();
-        p.tree.deserialize(vptree::SerializedState(state, checksum));
+        p->index.deserialize(vptree::SerializedState(state, checksum));
         return p;
     }
 
-    vptree::VPTree<arrayli, int64_t, distance> tree;
+    vptree::BruteForceIndex index{metric};
+    mutable IndexGuard guard;
+
+    private:
+    static void validate(const ndarrayfc &array) {
+        if (array.ndim() != 2) {
+            throw std::invalid_argument("vectors must be a 2D array");
+        }
+    }
 };
 
 template <distance_func_li distance_f> class HammingMetric : Metric<arrayli, int64_t> {
     public:
     static int64_t distance(const arrayli &a, const arrayli &b) { return distance_f(a, b); }
 
-    static std::optional<int64_t> threshold_distance(const arrayli &a, const arrayli &b, int64_t threshold) { return distance_f(a, b); }
+    static std::optional<int64_t> threshold_distance(const arrayli &a, const arrayli &b, int64_t threshold) {
+        int64_t dist;
+        if constexpr (bounded_distance<distance_f>::function != nullptr) {
+            dist = bounded_distance<distance_f>::function(a, b, threshold);
+        } else {
+            dist = distance_f(a, b);
+        }
+        if (dist > threshold) {
+            return std::nullopt;
+        }
+        return dist;
+    }
 };
 
 template <distance_func_li distance> class BKTreeBinaryNumpyAdapter {
@@ -150,90 +896,359 @@ template <distance_func_li distance> class BKTreeBinaryNumpyAdapter {
 
     BKTreeBinaryNumpyAdapter() = default;
 
-    void set(const std::vector<key_t> &array) { tree.update(array); }
+    void set(const std::vector<key_t> &array) {
+        guard.write([&]() { tree.update(array); });
+    }
 
     std::tuple<std::vector<std::vector<index_t>>, std::vector<std::vector<distance_t>>, std::vector<std::vector<key_t>>>
     find_threshold(const std::vector<key_t> &queries, distance_t threshold) {
-        return tree.find_batch(queries, threshold);
+        return guard.read([&]() { return tree.find_batch(queries, threshold); });
     }
 
-    bool empty() { return tree.empty(); }
-    size_t size() { return tree.size(); }
-    std::vector<key_t> values() { return tree.values(); }
+    bool empty() {
+        return guard.read([this]() { return tree.empty(); });
+    }
+    size_t size() {
+        return guard.read([this]() { return tree.size(); });
+    }
+    std::vector<key_t> values() {
+        return guard.read([this]() { return tree.values(); });
+    }
+
+    IndexGuard guard;
 };
 
 static const char *index_set = "Add vectors to index";
-static const char *index_topk = "Batch find top-k vectors in index and return indices and distances";
+static const char *index_set_tune = "Add vectors to index. With tune, searches of a sample of the vectors are timed to choose the leaf size of "
+                                    "searchKNN, searchKNNApprox, searchKNNStats and submit and, for L2, whether batches large enough are "
+                                    "answered by a brute force scan instead of the tree (by searchKNN, search1NN and submit), which finds the "
+                                    "same neighbors and ignores best_first and reorder_queries. Other searches are not tuned. The plan is "
+                                    "not pickled";
+static const char *index_search_plan = "Return the plan measured by set(tune=True): leaf_size, evaluated_fraction (of the vectors whose "
+                                       "distance to a query is computed), whether brute_force is kept and the measured seconds per query";
+static const char *index_topk = "Batch find top-k vectors in index and return indices and distances. With best_first, partitions are "
+                                "searched from the closest to the farthest one instead of in depth first order. With max_radius, only "
+                                "vectors within max_radius are returned. allowed (one flag per indexed vector) and allowed_ranges (a list of "
+                                "[begin, end) index ranges per query) restrict which vectors can be returned. Results are written into the "
+                                "(indices, distances) arrays given in out, if any. With reorder_queries, queries are searched grouped by "
+                                "the tree partition they fall in, which speeds up large batches, and results keep the order of the queries";
+static const char *index_topk_approx = "Approximate searchKNN: partitions are pruned against the k-th distance divided by (1 + epsilon) and "
+                                       "each query stops after the given number of distance evaluations or visited nodes. Returns indices, "
+                                       "distances and, per query, whether the result is exact. time_budget (for the whole call) and "
+                                       "query_time_budget (for each query) are given in seconds";
+static const char *index_topk_batched = "Same as searchKNN, but queries walk the tree together in blocks of block_size queries";
+static const char *index_topk_dual_tree = "Same as searchKNN, but a tree is built over the queries and its partitions of up to block_size "
+                                         "close queries walk the index tree together. Meant for large query sets";
+static const char *index_radius = "Batch find all vectors within radius (one radius or one per query) and return CSR offsets, indices and "
+                                  "distances sorted by distance";
+static const char *index_iter_neighbors = "Return an iterator over the neighbors of a single vector, from the closest to the farthest one, "
+                                          "yielding (indices, distances) arrays of up to chunk_size neighbors. The search resumes where the "
+                                          "previous chunk stopped, so neighbors can be consumed until any condition is met without knowing k";
+static const char *index_knn_graph = "Find the top-k vectors of every indexed vector and return (n, k) arrays of indices and distances, "
+                                     "where row i holds the neighbors of vector i. With exclude_self, a vector is not its own neighbor";
+static const char *index_submit = "Queue a searchKNN on background worker threads and return a concurrent.futures.Future of its indices "
+                                  "and distances, answered from the vectors indexed when the search starts. Blocks while too many searches "
+                                  "are pending, unless called from a callback of a future";
 static const char *index_top1 = "Batch find closest vectors in index and return indices and distances";
+static const char *index_topk_brute_force = "Batch find top-k vectors in index and return (n, k) arrays of indices and distances, each row "
+                                            "from the farthest to the closest vector";
+static const char *index_topk_stats = "Same as searchKNN, also returning a numpy structured array of search stats: distance_evaluations, "
+                                      "nodes_visited, nodes_pruned (by the border test), heap_insertions and max_stack_depth. It holds "
+                                      "one row per query, or a single row summing them (with the largest depth) with aggregate";
+static const char *index_top1_stats = "Same as search1NN, also returning search stats as searchKNNStats does";
+static const char *index_set_num_threads = "Set the number of threads searches run on, including the calling one. 0 (the default) "
+                                           "shares a pool of every hardware thread with the other indices. Loops over queries are split evenly "
+                                           "between threads, which then steal work from each other unless work_stealing is False. A pool "
+                                           "searches one batch at a time: batches searched meanwhile from other threads wait for it";
+static const char *index_num_threads = "Return the number of threads searches run on";
 static const char *index_string = "Return a debug string representation of the tree";
 static const char *index_find_threshold = "Batch find all vectors below the distance threshold";
 static const char *index_values = "Return all stored vectors in arbitrary order";
+static const char *brute_force_l2 = "Exact L2 index scanning every vector, with distances of blocks of queries computed as matrix products. "
+                                    "Faster than a tree at high dimensions, where a tree prunes almost nothing";
+static const char *brute_force_inner_product = "Exact maximum inner product index scanning every vector. Returned distances are the inner "
+                                               "products, from the smallest to the largest one";
+static const char *brute_force_size = "Return the number of indexed vectors";
+static const char *simd_level = "Return the instruction set distances are computed with (generic, sse4.2, avx2 or avx512), the widest "
+                                "one the CPU supports unless the PYNEAR_SIMD environment variable asks for a lower one";
 
-PYBIND11_MODULE(_pynear, m) {
-    py::class_<VPTreeNumpyAdapter<dist_l2_f_avx2>>(m, "VPTreeL2Index")
-        .def(py::init<>())
-        .def("set", &VPTreeNumpyAdapter<dist_l2_f_avx2>::set, index_set, py::arg("vectors"))
-        .def("to_string", &VPTreeNumpyAdapter<dist_l2_f_avx2>::to_string, index_string)
-        .def("searchKNN", &VPTreeNumpyAdapter<dist_l2_f_avx2>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"))
-        .def("search1NN", &VPTreeNumpyAdapter<dist_l2_f_avx2>::search1NN, index_top1, py::arg("vectors"))
-        .def(py::pickle(&VPTreeNumpyAdapter<dist_l2_f_avx2>::get_state, &VPTreeNumpyAdapter<dist_l2_f_avx2>::set_state));
+// Binds the VPTreeNumpyAdapter of distance as the python class name
+template <auto distance> static void bindVPTreeIndex(py::module_ &m, const char *name) {
+    using Adapter = VPTreeNumpyAdapter<distance>;
 
-    py::class_<VPTreeNumpyAdapter<dist_l1_f_avx2>>(m, "VPTreeL1Index")
+    py::class_<Adapter>(m, name)
         .def(py::init<>())
-        .def("set", &VPTreeNumpyAdapter<dist_l1_f_avx2>::set, index_set, py::arg("vectors"))
-        .def("to_string", &VPTreeNumpyAdapter<dist_l1_f_avx2>::to_string, index_string)
-        .def("searchKNN", &VPTreeNumpyAdapter<dist_l1_f_avx2>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"))
-        .def("search1NN", &VPTreeNumpyAdapter<dist_l1_f_avx2>::search1NN, index_top1, py::arg("vectors"))
-        .def(py::pickle(&VPTreeNumpyAdapter<dist_l1_f_avx2>::get_state, &VPTreeNumpyAdapter<dist_l1_f_avx2>::set_state));
+        .def("set", &Adapter::set, index_set_tune, py::arg("vectors"), py::arg("tune") = false)
+        .def("search_plan", &Adapter::searchPlan, index_search_plan)
+        .def("to_string", &Adapter::to_string, index_string)
+        .def("set_num_threads", &Adapter::setNumThreads, index_set_num_threads, py::arg("num_threads"),
+             py::arg("work_stealing") = true)
+        .def("num_threads", &Adapter::numThreads, index_num_threads)
+        .def("searchKNN", &Adapter::searchKNN, index_topk, py::arg("vectors"), py::arg("k"),
+             py::arg("best_first") = false, py::arg("max_radius") = py::none(), py::arg("allowed") = py::none(),
+             py::arg("allowed_ranges") = py::none(), py::arg("out") = py::none(),
+             py::arg("reorder_queries") = false)
+        .def("searchKNNApprox", &Adapter::searchKNNApprox, index_topk_approx, py::arg("vectors"), py::arg("k"),
+             py::arg("epsilon") = 0.0, py::arg("max_distance_evaluations") = py::none(), py::arg("max_visited_nodes") = py::none(),
+             py::arg("time_budget") = py::none(), py::arg("query_time_budget") = py::none(), py::arg("best_first") = false)
+        .def("searchKNNBatched", &Adapter::searchKNNBatched, index_topk_batched, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
+        .def("searchKNNDualTree", &Adapter::searchKNNDualTree, index_topk_dual_tree, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
+        .def("search1NN", &Adapter::search1NN, index_top1, py::arg("vectors"))
+        .def("searchKNNStats", &Adapter::searchKNNStats, index_topk_stats, py::arg("vectors"),
+             py::arg("k"), py::arg("best_first") = false, py::arg("aggregate") = false)
+        .def("search1NNStats", &Adapter::search1NNStats, index_top1_stats, py::arg("vectors"),
+             py::arg("aggregate") = false)
+        .def("submit", &Adapter::submit, index_submit, py::arg("vectors"), py::arg("k"))
+        .def("searchRadius", &Adapter::searchRadius, index_radius, py::arg("vectors"), py::arg("radius"))
+        .def("knn_graph", &Adapter::knnGraph, index_knn_graph, py::arg("k"), py::arg("exclude_self") = true)
+        .def("iter_neighbors", &Adapter::iterNeighbors, index_iter_neighbors, py::arg("vector"),
+             py::arg("chunk_size") = 16, py::keep_alive<0, 1>())
+        .def(py::pickle(&Adapter::get_state, &Adapter::set_state));
+}
 
-    py::class_<VPTreeNumpyAdapter<dist_chebyshev_f_avx2>>(m, "VPTreeChebyshevIndex")
+PYBIND11_MODULE(_pynear, m) {
+    py::module_::import("atexit").attr("register")(py::cpp_function(&shutdownAsyncQueue));
+
+    m.def("simd_level", []() { return vptree::simdLevelName(activeDistanceKernels.level); }, simd_level);
+
+    PYBIND11_NUMPY_DTYPE_EX(vptree::VPTreeSearchStats, distanceEvaluations, "distance_evaluations", nodesVisited, "nodes_visited", nodesPruned,
+                            "nodes_pruned", heapInsertions, "heap_insertions", maxStackDepth, "max_stack_depth");
+
+    py::class_<NeighborChunkIterator>(m, "NeighborIterator")
+        .def("__iter__", [](NeighborChunkIterator &self) -> NeighborChunkIterator & { return self; })
+        .def("__next__", &NeighborChunkIterator::next);
+
+    bindVPTreeIndex<dist_l2_f_avx2>(m, "VPTreeL2Index");
+    bindVPTreeIndex<dist_l1_f_avx2>(m, "VPTreeL1Index");
+    bindVPTreeIndex<dist_chebyshev_f_avx2>(m, "VPTreeChebyshevIndex");
+
+    bindVPTreeIndex<dist_l2_d_avx2>(m, "VPTreeL2Float64Index");
+    bindVPTreeIndex<dist_l1_d_avx2>(m, "VPTreeL1Float64Index");
+    bindVPTreeIndex<dist_chebyshev_d_avx2>(m, "VPTreeChebyshevFloat64Index");
+    bindVPTreeIndex<dist_l2_i16>(m, "VPTreeL2Int16Index");
+    bindVPTreeIndex<dist_l1_i16>(m, "VPTreeL1Int16Index");
+    bindVPTreeIndex<dist_chebyshev_i16>(m, "VPTreeChebyshevInt16Index");
+    bindVPTreeIndex<dist_l2_i32>(m, "VPTreeL2Int32Index");
+    bindVPTreeIndex<dist_l1_i32>(m, "VPTreeL1Int32Index");
+    bindVPTreeIndex<dist_chebyshev_i32>(m, "VPTreeChebyshevInt32Index");
+
+    py::class_<VPTreeNumpyAdapterBinary<dist_hamming_1024>>(m, "VPTreeBinaryIndex1024")
         .def(py::init<>())
-        .def("set", &VPTreeNumpyAdapter<dist_chebyshev_f_avx2>::set, index_set, py::arg("vectors"))
-        .def("to_string", &VPTreeNumpyAdapter<dist_chebyshev_f_avx2>::to_string, index_string)
-        .def("searchKNN", &VPTreeNumpyAdapter<dist_chebyshev_f_avx2>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"))
-        .def("search1NN", &VPTreeNumpyAdapter<dist_chebyshev_f_avx2>::search1NN, index_top1, py::arg("vectors"))
-        .def(py::pickle(&VPTreeNumpyAdapter<dist_chebyshev_f_avx2>::get_state, &VPTreeNumpyAdapter<dist_chebyshev_f_avx2>::set_state));
+        .def("set", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::set, index_set, py::arg("vectors"))
+        .def("to_string", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::to_string, index_string)
+        .def("set_num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::setNumThreads, index_set_num_threads, py::arg("num_threads"),
+             py::arg("work_stealing") = true)
+        .def("num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::numThreads, index_num_threads)
+        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"),
+             py::arg("best_first") = false, py::arg("max_radius") = py::none(), py::arg("allowed") = py::none(),
+             py::arg("allowed_ranges") = py::none(), py::arg("out") = py::none(),
+             py::arg("reorder_queries") = false)
+        .def("searchKNNApprox", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::searchKNNApprox, index_topk_approx, py::arg("vectors"), py::arg("k"),
+             py::arg("epsilon") = 0.0, py::arg("max_distance_evaluations") = py::none(), py::arg("max_visited_nodes") = py::none(),
+             py::arg("time_budget") = py::none(), py::arg("query_time_budget") = py::none(), py::arg("best_first") = false)
+        .def("searchKNNBatched", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::searchKNNBatched, index_topk_batched, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
+        .def("searchKNNDualTree", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::searchKNNDualTree, index_topk_dual_tree, py::arg("vectors"),
+             py::arg("k"), py::arg("block_size") = 32)
+        .def("search1NN", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::search1NN, index_top1, py::arg("vectors"))
+        .def("searchKNNStats", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::searchKNNStats, index_topk_stats, py::arg("vectors"),
+             py::arg("k"), py::arg("best_first") = false, py::arg("aggregate") = false)
+        .def("search1NNStats", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::search1NNStats, index_top1_stats, py::arg("vectors"),
+             py::arg("aggregate") = false)
+        .def("submit", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::submit, index_submit, py::arg("vectors"), py::arg("k"))
+        .def("searchRadius", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::searchRadius, index_radius, py::arg("vectors"), py::arg("radius"))
+        .def("knn_graph", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::knnGraph, index_knn_graph, py::arg("k"), py::arg("exclude_self") = true)
+        .def("iter_neighbors", &VPTreeNumpyAdapterBinary<dist_hamming_1024>::iterNeighbors, index_iter_neighbors, py::arg("vector"),
+             py::arg("chunk_size") = 16, py::keep_alive<0, 1>())
+        .def(py::pickle(&VPTreeNumpyAdapterBinary<dist_hamming_1024>::get_state, &VPTreeNumpyAdapterBinary<dist_hamming_1024>::set_state));
 
     py::class_<VPTreeNumpyAdapterBinary<dist_hamming_512>>(m, "VPTreeBinaryIndex512")
         .def(py::init<>())
         .def("set", &VPTreeNumpyAdapterBinary<dist_hamming_512>::set, index_set, py::arg("vectors"))
         .def("to_string", &VPTreeNumpyAdapterBinary<dist_hamming_512>::to_string, index_string)
-        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_512>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"))
+        .def("set_num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_512>::setNumThreads, index_set_num_threads, py::arg("num_threads"),
+             py::arg("work_stealing") = true)
+        .def("num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_512>::numThreads, index_num_threads)
+        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_512>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"),
+             py::arg("best_first") = false, py::arg("max_radius") = py::none(), py::arg("allowed") = py::none(),
+             py::arg("allowed_ranges") = py::none(), py::arg("out") = py::none(),
+             py::arg("reorder_queries") = false)
+        .def("searchKNNApprox", &VPTreeNumpyAdapterBinary<dist_hamming_512>::searchKNNApprox, index_topk_approx, py::arg("vectors"), py::arg("k"),
+             py::arg("epsilon") = 0.0, py::arg("max_distance_evaluations") = py::none(), py::arg("max_visited_nodes") = py::none(),
+             py::arg("time_budget") = py::none(), py::arg("query_time_budget") = py::none(), py::arg("best_first") = false)
+        .def("searchKNNBatched", &VPTreeNumpyAdapterBinary<dist_hamming_512>::searchKNNBatched, index_topk_batched, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
+        .def("searchKNNDualTree", &VPTreeNumpyAdapterBinary<dist_hamming_512>::searchKNNDualTree, index_topk_dual_tree, py::arg("vectors"),
+             py::arg("k"), py::arg("block_size") = 32)
         .def("search1NN", &VPTreeNumpyAdapterBinary<dist_hamming_512>::search1NN, index_top1, py::arg("vectors"))
+        .def("searchKNNStats", &VPTreeNumpyAdapterBinary<dist_hamming_512>::searchKNNStats, index_topk_stats, py::arg("vectors"),
+             py::arg("k"), py::arg("best_first") = false, py::arg("aggregate") = false)
+        .def("search1NNStats", &VPTreeNumpyAdapterBinary<dist_hamming_512>::search1NNStats, index_top1_stats, py::arg("vectors"),
+             py::arg("aggregate") = false)
+        .def("submit", &VPTreeNumpyAdapterBinary<dist_hamming_512>::submit, index_submit, py::arg("vectors"), py::arg("k"))
+        .def("searchRadius", &VPTreeNumpyAdapterBinary<dist_hamming_512>::searchRadius, index_radius, py::arg("vectors"), py::arg("radius"))
+        .def("knn_graph", &VPTreeNumpyAdapterBinary<dist_hamming_512>::knnGraph, index_knn_graph, py::arg("k"), py::arg("exclude_self") = true)
+        .def("iter_neighbors", &VPTreeNumpyAdapterBinary<dist_hamming_512>::iterNeighbors, index_iter_neighbors, py::arg("vector"),
+             py::arg("chunk_size") = 16, py::keep_alive<0, 1>())
         .def(py::pickle(&VPTreeNumpyAdapterBinary<dist_hamming_512>::get_state, &VPTreeNumpyAdapterBinary<dist_hamming_512>::set_state));
 
     py::class_<VPTreeNumpyAdapterBinary<dist_hamming_256>>(m, "VPTreeBinaryIndex256")
         .def(py::init<>())
         .def("set", &VPTreeNumpyAdapterBinary<dist_hamming_256>::set, index_set, py::arg("vectors"))
         .def("to_string", &VPTreeNumpyAdapterBinary<dist_hamming_256>::to_string, index_string)
-        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_256>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"))
+        .def("set_num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_256>::setNumThreads, index_set_num_threads, py::arg("num_threads"),
+             py::arg("work_stealing") = true)
+        .def("num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_256>::numThreads, index_num_threads)
+        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_256>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"),
+             py::arg("best_first") = false, py::arg("max_radius") = py::none(), py::arg("allowed") = py::none(),
+             py::arg("allowed_ranges") = py::none(), py::arg("out") = py::none(),
+             py::arg("reorder_queries") = false)
+        .def("searchKNNApprox", &VPTreeNumpyAdapterBinary<dist_hamming_256>::searchKNNApprox, index_topk_approx, py::arg("vectors"), py::arg("k"),
+             py::arg("epsilon") = 0.0, py::arg("max_distance_evaluations") = py::none(), py::arg("max_visited_nodes") = py::none(),
+             py::arg("time_budget") = py::none(), py::arg("query_time_budget") = py::none(), py::arg("best_first") = false)
+        .def("searchKNNBatched", &VPTreeNumpyAdapterBinary<dist_hamming_256>::searchKNNBatched, index_topk_batched, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
+        .def("searchKNNDualTree", &VPTreeNumpyAdapterBinary<dist_hamming_256>::searchKNNDualTree, index_topk_dual_tree, py::arg("vectors"),
+             py::arg("k"), py::arg("block_size") = 32)
         .def("search1NN", &VPTreeNumpyAdapterBinary<dist_hamming_256>::search1NN, index_top1, py::arg("vectors"))
+        .def("searchKNNStats", &VPTreeNumpyAdapterBinary<dist_hamming_256>::searchKNNStats, index_topk_stats, py::arg("vectors"),
+             py::arg("k"), py::arg("best_first") = false, py::arg("aggregate") = false)
+        .def("search1NNStats", &VPTreeNumpyAdapterBinary<dist_hamming_256>::search1NNStats, index_top1_stats, py::arg("vectors"),
+             py::arg("aggregate") = false)
+        .def("submit", &VPTreeNumpyAdapterBinary<dist_hamming_256>::submit, index_submit, py::arg("vectors"), py::arg("k"))
+        .def("searchRadius", &VPTreeNumpyAdapterBinary<dist_hamming_256>::searchRadius, index_radius, py::arg("vectors"), py::arg("radius"))
+        .def("knn_graph", &VPTreeNumpyAdapterBinary<dist_hamming_256>::knnGraph, index_knn_graph, py::arg("k"), py::arg("exclude_self") = true)
+        .def("iter_neighbors", &VPTreeNumpyAdapterBinary<dist_hamming_256>::iterNeighbors, index_iter_neighbors, py::arg("vector"),
+             py::arg("chunk_size") = 16, py::keep_alive<0, 1>())
         .def(py::pickle(&VPTreeNumpyAdapterBinary<dist_hamming_256>::get_state, &VPTreeNumpyAdapterBinary<dist_hamming_256>::set_state));
 
     py::class_<VPTreeNumpyAdapterBinary<dist_hamming_128>>(m, "VPTreeBinaryIndex128")
         .def(py::init<>())
         .def("set", &VPTreeNumpyAdapterBinary<dist_hamming_128>::set, index_set, py::arg("vectors"))
         .def("to_string", &VPTreeNumpyAdapterBinary<dist_hamming_128>::to_string, index_string)
-        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_128>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"))
+        .def("set_num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_128>::setNumThreads, index_set_num_threads, py::arg("num_threads"),
+             py::arg("work_stealing") = true)
+        .def("num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_128>::numThreads, index_num_threads)
+        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_128>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"),
+             py::arg("best_first") = false, py::arg("max_radius") = py::none(), py::arg("allowed") = py::none(),
+             py::arg("allowed_ranges") = py::none(), py::arg("out") = py::none(),
+             py::arg("reorder_queries") = false)
+        .def("searchKNNApprox", &VPTreeNumpyAdapterBinary<dist_hamming_128>::searchKNNApprox, index_topk_approx, py::arg("vectors"), py::arg("k"),
+             py::arg("epsilon") = 0.0, py::arg("max_distance_evaluations") = py::none(), py::arg("max_visited_nodes") = py::none(),
+             py::arg("time_budget") = py::none(), py::arg("query_time_budget") = py::none(), py::arg("best_first") = false)
+        .def("searchKNNBatched", &VPTreeNumpyAdapterBinary<dist_hamming_128>::searchKNNBatched, index_topk_batched, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
+        .def("searchKNNDualTree", &VPTreeNumpyAdapterBinary<dist_hamming_128>::searchKNNDualTree, index_topk_dual_tree, py::arg("vectors"),
+             py::arg("k"), py::arg("block_size") = 32)
         .def("search1NN", &VPTreeNumpyAdapterBinary<dist_hamming_128>::search1NN, index_top1, py::arg("vectors"))
+        .def("searchKNNStats", &VPTreeNumpyAdapterBinary<dist_hamming_128>::searchKNNStats, index_topk_stats, py::arg("vectors"),
+             py::arg("k"), py::arg("best_first") = false, py::arg("aggregate") = false)
+        .def("search1NNStats", &VPTreeNumpyAdapterBinary<dist_hamming_128>::search1NNStats, index_top1_stats, py::arg("vectors"),
+             py::arg("aggregate") = false)
+        .def("submit", &VPTreeNumpyAdapterBinary<dist_hamming_128>::submit, index_submit, py::arg("vectors"), py::arg("k"))
+        .def("searchRadius", &VPTreeNumpyAdapterBinary<dist_hamming_128>::searchRadius, index_radius, py::arg("vectors"), py::arg("radius"))
+        .def("knn_graph", &VPTreeNumpyAdapterBinary<dist_hamming_128>::knnGraph, index_knn_graph, py::arg("k"), py::arg("exclude_self") = true)
+        .def("iter_neighbors", &VPTreeNumpyAdapterBinary<dist_hamming_128>::iterNeighbors, index_iter_neighbors, py::arg("vector"),
+             py::arg("chunk_size") = 16, py::keep_alive<0, 1>())
         .def(py::pickle(&VPTreeNumpyAdapterBinary<dist_hamming_128>::get_state, &VPTreeNumpyAdapterBinary<dist_hamming_128>::set_state));
 
     py::class_<VPTreeNumpyAdapterBinary<dist_hamming_64>>(m, "VPTreeBinaryIndex64")
         .def(py::init<>())
         .def("set", &VPTreeNumpyAdapterBinary<dist_hamming_64>::set, index_set, py::arg("vectors"))
         .def("to_string", &VPTreeNumpyAdapterBinary<dist_hamming_64>::to_string, index_string)
-        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_64>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"))
+        .def("set_num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_64>::setNumThreads, index_set_num_threads, py::arg("num_threads"),
+             py::arg("work_stealing") = true)
+        .def("num_threads", &VPTreeNumpyAdapterBinary<dist_hamming_64>::numThreads, index_num_threads)
+        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming_64>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"),
+             py::arg("best_first") = false, py::arg("max_radius") = py::none(), py::arg("allowed") = py::none(),
+             py::arg("allowed_ranges") = py::none(), py::arg("out") = py::none(),
+             py::arg("reorder_queries") = false)
+        .def("searchKNNApprox", &VPTreeNumpyAdapterBinary<dist_hamming_64>::searchKNNApprox, index_topk_approx, py::arg("vectors"), py::arg("k"),
+             py::arg("epsilon") = 0.0, py::arg("max_distance_evaluations") = py::none(), py::arg("max_visited_nodes") = py::none(),
+             py::arg("time_budget") = py::none(), py::arg("query_time_budget") = py::none(), py::arg("best_first") = false)
+        .def("searchKNNBatched", &VPTreeNumpyAdapterBinary<dist_hamming_64>::searchKNNBatched, index_topk_batched, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
+        .def("searchKNNDualTree", &VPTreeNumpyAdapterBinary<dist_hamming_64>::searchKNNDualTree, index_topk_dual_tree, py::arg("vectors"),
+             py::arg("k"), py::arg("block_size") = 32)
         .def("search1NN", &VPTreeNumpyAdapterBinary<dist_hamming_64>::search1NN, index_top1, py::arg("vectors"))
+        .def("searchKNNStats", &VPTreeNumpyAdapterBinary<dist_hamming_64>::searchKNNStats, index_topk_stats, py::arg("vectors"),
+             py::arg("k"), py::arg("best_first") = false, py::arg("aggregate") = false)
+        .def("search1NNStats", &VPTreeNumpyAdapterBinary<dist_hamming_64>::search1NNStats, index_top1_stats, py::arg("vectors"),
+             py::arg("aggregate") = false)
+        .def("submit", &VPTreeNumpyAdapterBinary<dist_hamming_64>::submit, index_submit, py::arg("vectors"), py::arg("k"))
+        .def("searchRadius", &VPTreeNumpyAdapterBinary<dist_hamming_64>::searchRadius, index_radius, py::arg("vectors"), py::arg("radius"))
+        .def("knn_graph", &VPTreeNumpyAdapterBinary<dist_hamming_64>::knnGraph, index_knn_graph, py::arg("k"), py::arg("exclude_self") = true)
+        .def("iter_neighbors", &VPTreeNumpyAdapterBinary<dist_hamming_64>::iterNeighbors, index_iter_neighbors, py::arg("vector"),
+             py::arg("chunk_size") = 16, py::keep_alive<0, 1>())
         .def(py::pickle(&VPTreeNumpyAdapterBinary<dist_hamming_64>::get_state, &VPTreeNumpyAdapterBinary<dist_hamming_64>::set_state));
 
     py::class_<VPTreeNumpyAdapterBinary<dist_hamming>>(m, "VPTreeBinaryIndex")
         .def(py::init<>())
         .def("set", &VPTreeNumpyAdapterBinary<dist_hamming>::set, index_set, py::arg("vectors"))
         .def("to_string", &VPTreeNumpyAdapterBinary<dist_hamming>::to_string, index_string)
-        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"))
+        .def("set_num_threads", &VPTreeNumpyAdapterBinary<dist_hamming>::setNumThreads, index_set_num_threads, py::arg("num_threads"),
+             py::arg("work_stealing") = true)
+        .def("num_threads", &VPTreeNumpyAdapterBinary<dist_hamming>::numThreads, index_num_threads)
+        .def("searchKNN", &VPTreeNumpyAdapterBinary<dist_hamming>::searchKNN, index_topk, py::arg("vectors"), py::arg("k"),
+             py::arg("best_first") = false, py::arg("max_radius") = py::none(), py::arg("allowed") = py::none(),
+             py::arg("allowed_ranges") = py::none(), py::arg("out") = py::none(),
+             py::arg("reorder_queries") = false)
+        .def("searchKNNApprox", &VPTreeNumpyAdapterBinary<dist_hamming>::searchKNNApprox, index_topk_approx, py::arg("vectors"), py::arg("k"),
+             py::arg("epsilon") = 0.0, py::arg("max_distance_evaluations") = py::none(), py::arg("max_visited_nodes") = py::none(),
+             py::arg("time_budget") = py::none(), py::arg("query_time_budget") = py::none(), py::arg("best_first") = false)
+        .def("searchKNNBatched", &VPTreeNumpyAdapterBinary<dist_hamming>::searchKNNBatched, index_topk_batched, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
+        .def("searchKNNDualTree", &VPTreeNumpyAdapterBinary<dist_hamming>::searchKNNDualTree, index_topk_dual_tree, py::arg("vectors"), py::arg("k"),
+             py::arg("block_size") = 32)
         .def("search1NN", &VPTreeNumpyAdapterBinary<dist_hamming>::search1NN, index_top1, py::arg("vectors"))
+        .def("searchKNNStats", &VPTreeNumpyAdapterBinary<dist_hamming>::searchKNNStats, index_topk_stats, py::arg("vectors"),
+             py::arg("k"), py::arg("best_first") = false, py::arg("aggregate") = false)
+        .def("search1NNStats", &VPTreeNumpyAdapterBinary<dist_hamming>::search1NNStats, index_top1_stats, py::arg("vectors"),
+             py::arg("aggregate") = false)
+        .def("submit", &VPTreeNumpyAdapterBinary<dist_hamming>::submit, index_submit, py::arg("vectors"), py::arg("k"))
+        .def("searchRadius", &VPTreeNumpyAdapterBinary<dist_hamming>::searchRadius, index_radius, py::arg("vectors"), py::arg("radius"))
+        .def("knn_graph", &VPTreeNumpyAdapterBinary<dist_hamming>::knnGraph, index_knn_graph, py::arg("k"), py::arg("exclude_self") = true)
+        .def("iter_neighbors", &VPTreeNumpyAdapterBinary<dist_hamming>::iterNeighbors, index_iter_neighbors, py::arg("vector"),
+             py::arg("chunk_size") = 16, py::keep_alive<0, 1>())
         .def(py::pickle(&VPTreeNumpyAdapterBinary<dist_hamming>::get_state, &VPTreeNumpyAdapterBinary<dist_hamming>::set_state));
 
+    py::class_<BruteForceNumpyAdapter<vptree::GemmMetric::L2>>(m, "BruteForceL2Index", brute_force_l2)
+        .def(py::init<>())
+        .def("set", &BruteForceNumpyAdapter<vptree::GemmMetric::L2>::set, index_set, py::arg("vectors"))
+        .def("set_num_threads", &BruteForceNumpyAdapter<vptree::GemmMetric::L2>::setNumThreads, index_set_num_threads,
+             py::arg("num_threads"), py::arg("work_stealing") = true)
+        .def("num_threads", &BruteForceNumpyAdapter<vptree::GemmMetric::L2>::numThreads, index_num_threads)
+        .def("size", &BruteForceNumpyAdapter<vptree::GemmMetric::L2>::size, brute_force_size)
+        .def("searchKNN", &BruteForceNumpyAdapter<vptree::GemmMetric::L2>::searchKNN, index_topk_brute_force, py::arg("vectors"),
+             py::arg("k"))
+        .def("search1NN", &BruteForceNumpyAdapter<vptree::GemmMetric::L2>::search1NN, index_top1, py::arg("vectors"))
+        .def(py::pickle(&BruteForceNumpyAdapter<vptree::GemmMetric::L2>::get_state,
+                        &BruteForceNumpyAdapter<vptree::GemmMetric::L2>::set_state));
+
+    py::class_<BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>>(m, "BruteForceInnerProductIndex", brute_force_inner_product)
+        .def(py::init<>())
+        .def("set", &BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>::set, index_set, py::arg("vectors"))
+        .def("set_num_threads", &BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>::setNumThreads, index_set_num_threads,
+             py::arg("num_threads"), py::arg("work_stealing") = true)
+        .def("num_threads", &BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>::numThreads, index_num_threads)
+        .def("size", &BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>::size, brute_force_size)
+        .def("searchKNN", &BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>::searchKNN, index_topk_brute_force, py::arg("vectors"),
+             py::arg("k"))
+        .def("search1NN", &BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>::search1NN, index_top1, py::arg("vectors"))
+        .def(py::pickle(&BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>::get_state,
+                        &BruteForceNumpyAdapter<vptree::GemmMetric::InnerProduct>::set_state));
+
+    py::class_<BKTreeBinaryNumpyAdapter<dist_hamming_1024>>(m, "BKTreeBinaryIndex1024")
+        .def(py::init<>())
+        .def("set", &BKTreeBinaryNumpyAdapter<dist_hamming_1024>::set, index_set, py::arg("vectors"))
+        .def("find_threshold", &BKTreeBinaryNumpyAdapter<dist_hamming_1024>::find_threshold, index_find_threshold, py::arg("vectors"),
+             py::arg("threshold"))
+        .def("empty", &BKTreeBinaryNumpyAdapter<dist_hamming_1024>::empty)
+        .def("size", &BKTreeBinaryNumpyAdapter<dist_hamming_1024>::size)
+        .def("values", &BKTreeBinaryNumpyAdapter<dist_hamming_1024>::values, index_values);
+
     py::class_<BKTreeBinaryNumpyAdapter<dist_hamming_512>>(m, "BKTreeBinaryIndex512")
         .def(py::init<>())
         .def("set", &BKTreeBinaryNumpyAdapter<dist_hamming_512>::set, index_set, py::arg("vectors"))
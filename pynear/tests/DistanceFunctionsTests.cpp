@@ -0,0 +1,304 @@
+#include "gtest/gtest.h"
+
+#include <CpuFeatures.hpp>
+#include <DistanceFunctions.hpp>
+#include <VPTree.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace vptree::tests {
+
+// Every level the CPU supports, from the generic one
+static std::vector<SimdLevel> supportedLevels() {
+    std::vector<SimdLevel> levels;
+    for (SimdLevel level : {SimdLevel::Generic, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (level <= detectSimdLevel()) {
+            levels.push_back(level);
+        }
+    }
+    return levels;
+}
+
+TEST(DistanceTests, TestSelectedLevel) {
+    EXPECT_LE(activeDistanceKernels.level, detectSimdLevel());
+    EXPECT_EQ(distanceKernelsFor(SimdLevel::Generic).l2Squared, distance_kernels::generic::l2_squared);
+}
+
+TEST(DistanceTests, TestFloatKernels) {
+    std::mt19937 generator(7);
+    std::normal_distribution<float> distribution;
+    const DistanceKernels generic = distanceKernelsFor(SimdLevel::Generic);
+
+    for (SimdLevel level : supportedLevels()) {
+        SCOPED_TRACE(simdLevelName(level));
+        const DistanceKernels kernels = distanceKernelsFor(level);
+
+        // every tail length around the vector widths and the early abandon blocks
+        for (size_t d = 1; d <= 150; ++d) {
+            arrayf x(d), y(d);
+            for (size_t i = 0; i < d; ++i) {
+                x[i] = distribution(generator);
+                y[i] = distribution(generator);
+            }
+
+            const float l2 = kernels.l2Squared(x.data(), y.data(), d);
+            const float l1 = kernels.l1(x.data(), y.data(), d);
+            const float chebyshev = kernels.chebyshev(x.data(), y.data(), d);
+            EXPECT_NEAR(l2, generic.l2Squared(x.data(), y.data(), d), 1e-5f * l2);
+            EXPECT_NEAR(l1, generic.l1(x.data(), y.data(), d), 1e-5f * l1);
+            EXPECT_EQ(chebyshev, generic.chebyshev(x.data(), y.data(), d));
+
+            // distances within bound are the exact unbounded ones, the others anything greater than bound
+            EXPECT_EQ(kernels.l2SquaredBounded(x.data(), y.data(), d, l2), l2);
+            EXPECT_EQ(kernels.l1Bounded(x.data(), y.data(), d, l1), l1);
+            EXPECT_EQ(kernels.chebyshevBounded(x.data(), y.data(), d, chebyshev), chebyshev);
+            EXPECT_GT(kernels.l2SquaredBounded(x.data(), y.data(), d, l2 / 2), l2 / 2);
+            EXPECT_GT(kernels.l1Bounded(x.data(), y.data(), d, l1 / 2), l1 / 2);
+            EXPECT_GT(kernels.chebyshevBounded(x.data(), y.data(), d, chebyshev / 2), chebyshev / 2);
+        }
+    }
+}
+
+TEST(DistanceTests, TestL2SquaredDistances) {
+    std::mt19937 generator(7);
+    std::normal_distribution<float> distribution;
+
+    // tail lengths that are not multiples of the vector widths, around the early abandon blocks
+    for (size_t d = 1; d <= 150; ++d) {
+        arrayf x(d), y(d);
+        double expected = 0;
+        for (size_t i = 0; i < d; ++i) {
+            x[i] = distribution(generator);
+            y[i] = distribution(generator);
+            expected += (static_cast<double>(x[i]) - y[i]) * (static_cast<double>(x[i]) - y[i]);
+        }
+
+        const float squared = dist_l2_squared_f_avx2(x, y);
+        const float l2 = dist_l2_f_avx2(x, y);
+        EXPECT_EQ(std::sqrt(squared), l2) << "dimension " << d;
+        EXPECT_NEAR(squared, l2 * l2, 1e-6f * squared) << "dimension " << d;
+        EXPECT_NEAR(squared, expected, 1e-5 * expected) << "dimension " << d;
+
+        EXPECT_EQ(dist_l2_squared_f_avx2_bounded(x, y, squared), squared) << "dimension " << d;
+        EXPECT_GT(dist_l2_squared_f_avx2_bounded(x, y, squared / 2), squared / 2) << "dimension " << d;
+
+        // exact at the bound and just below it, where bound * bound may round below the squared distance
+        EXPECT_EQ(dist_l2_f_avx2_bounded(x, y, l2), l2) << "dimension " << d;
+        EXPECT_EQ(dist_l2_f_avx2_bounded(x, y, std::nextafter(l2, 0.0f)), l2) << "dimension " << d;
+        EXPECT_EQ(dist_l2_f_avx2_bounded(x, y, std::nextafter(l2, 0.0f) * (1 - 1e-4f)), std::numeric_limits<float>::infinity())
+            << "dimension " << d;
+        EXPECT_EQ(dist_l2_f_avx2_bounded(x, y, l2 / 2), std::numeric_limits<float>::infinity()) << "dimension " << d;
+        EXPECT_EQ(dist_l2_f_avx2_bounded(x, y, 2 * l2), l2) << "dimension " << d;
+    }
+}
+
+// Squared space comparisons keep the points lying exactly at the k-th distance of a query
+TEST(DistanceTests, TestL2TreeTies) {
+    const size_t dimension = 19;
+    const arrayf query(dimension, 3.0f);
+    auto moved = [&](std::initializer_list<std::pair<size_t, float>> offsets) {
+        arrayf point = query;
+        for (const auto &[i, offset] : offsets) {
+            point[i] += offset;
+        }
+        return point;
+    };
+
+    // a few close points, then many at exactly distance 1 and a few farther ones
+    ndarrayf points;
+    for (size_t i = 0; i < 4; ++i) {
+        points.push_back(moved({{i, 0.25f}}));
+    }
+    for (size_t i = 0; i < dimension; ++i) {
+        points.push_back(moved({{i, 1.0f}}));
+        points.push_back(moved({{i, -1.0f}}));
+        points.push_back(moved({{i, 0.5f}, {(i + 1) % dimension, 0.5f}, {(i + 2) % dimension, -0.5f}, {(i + 3) % dimension, 0.5f}}));
+        points.push_back(moved({{i, 2.0f}}));
+    }
+
+    const size_t k = 10;
+    std::vector<float> expected;
+    for (const arrayf &point : points) {
+        expected.push_back(dist_l2_f_avx2(query, point));
+    }
+    std::sort(expected.begin(), expected.end());
+    expected.resize(k);
+    std::reverse(expected.begin(), expected.end());
+    ASSERT_EQ(expected.front(), 1.0f);
+
+    using Tree = VPTree<arrayf, float, dist_l2_f_avx2, dist_l2_f_avx2_bounded>;
+    Tree tree(points);
+    for (bool bestFirst : {false, true}) {
+        for (size_t leafSize : {1, 16}) {
+            Tree::VPTreeSearchOptions options;
+            options.bestFirst = bestFirst;
+            options.leafSize = leafSize;
+            std::vector<Tree::VPTreeSearchResultElement> results;
+            tree.searchKNN({query}, k, results, options);
+            EXPECT_EQ(results[0].distances, expected) << "best first " << bestFirst << ", leaf size " << leafSize;
+
+            // every point at the radius is within it
+            options.maxRadius = 1.0f;
+            tree.searchKNN({query}, points.size(), results, options);
+            EXPECT_EQ(results[0].indexes.size(), 4 + 3 * dimension) << "best first " << bestFirst << ", leaf size " << leafSize;
+        }
+    }
+}
+
+// Kernels of double, int16 and int32 vectors against plain double precision loops, for every element type
+template <typename T> static void testFloat64Kernels(const Float64Kernels<T> &kernels, std::mt19937 &generator, double scale) {
+    std::uniform_real_distribution<double> distribution(-scale, scale);
+
+    for (size_t d = 1; d <= 150; ++d) {
+        std::vector<T> x(d), y(d);
+        double l2 = 0, l1 = 0, chebyshev = 0;
+        for (size_t i = 0; i < d; ++i) {
+            x[i] = static_cast<T>(distribution(generator));
+            y[i] = static_cast<T>(distribution(generator));
+            const double diff = static_cast<double>(x[i]) - static_cast<double>(y[i]);
+            l2 += diff * diff;
+            l1 += std::fabs(diff);
+            chebyshev = std::max(chebyshev, std::fabs(diff));
+        }
+
+        EXPECT_NEAR(kernels.l2Squared(x.data(), y.data(), d), l2, 1e-12 * l2);
+        EXPECT_NEAR(kernels.l1(x.data(), y.data(), d), l1, 1e-12 * l1);
+        EXPECT_EQ(kernels.chebyshev(x.data(), y.data(), d), chebyshev);
+
+        l2 = kernels.l2Squared(x.data(), y.data(), d);
+        l1 = kernels.l1(x.data(), y.data(), d);
+        EXPECT_EQ(kernels.l2SquaredBounded(x.data(), y.data(), d, l2), l2);
+        EXPECT_EQ(kernels.l1Bounded(x.data(), y.data(), d, l1), l1);
+        EXPECT_EQ(kernels.chebyshevBounded(x.data(), y.data(), d, chebyshev), chebyshev);
+        EXPECT_GT(kernels.l2SquaredBounded(x.data(), y.data(), d, l2 / 2), l2 / 2);
+        EXPECT_GT(kernels.l1Bounded(x.data(), y.data(), d, l1 / 2), l1 / 2);
+        EXPECT_GT(kernels.chebyshevBounded(x.data(), y.data(), d, chebyshev / 2), chebyshev / 2);
+    }
+}
+
+TEST(DistanceTests, TestFloat64Kernels) {
+    std::mt19937 generator(7);
+
+    for (SimdLevel level : supportedLevels()) {
+        SCOPED_TRACE(simdLevelName(level));
+        const DistanceKernels kernels = distanceKernelsFor(level);
+
+        testFloat64Kernels(kernels.float64, generator, 1e6);
+        // full ranges, whose differences overflow the element types
+        testFloat64Kernels(kernels.int16, generator, 32767);
+        testFloat64Kernels(kernels.int32, generator, 2147483647);
+    }
+
+    // vectors are not aligned to more than their elements
+    arrayd x(9), y(9);
+    for (size_t i = 0; i < x.size(); ++i) {
+        x[i] = i;
+        y[i] = 2.0 * i;
+    }
+    const arrayd xTail(x.begin() + 1, x.end()), yTail(y.begin() + 1, y.end());
+    EXPECT_DOUBLE_EQ(dist_l2_d_avx2(xTail, yTail), dist_l2_d(xTail, yTail));
+}
+
+TEST(DistanceTests, TestInt16Tree) {
+    std::mt19937 generator(7);
+    std::uniform_int_distribution<int> distribution(-1000, 1000);
+
+    ndarrayi16 points(2000, arrayi16(5)), queries(50, arrayi16(5));
+    for (ndarrayi16 *vectors : {&points, &queries}) {
+        for (arrayi16 &point : *vectors) {
+            std::generate(point.begin(), point.end(), [&]() { return distribution(generator); });
+        }
+    }
+
+    const size_t k = 5;
+    VPTree<arrayi16, double, dist_l2_i16, dist_l2_i16_bounded> tree(points);
+    std::vector<VPTree<arrayi16, double, dist_l2_i16, dist_l2_i16_bounded>::VPTreeSearchResultElement> results;
+    tree.searchKNN(queries, k, results);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        std::vector<double> expected;
+        for (const arrayi16 &point : points) {
+            expected.push_back(dist_l2_i16(queries[i], point));
+        }
+        std::sort(expected.begin(), expected.end());
+        expected.resize(k);
+        std::reverse(expected.begin(), expected.end());
+        EXPECT_EQ(results[i].distances, expected) << "Results differ for query " << i;
+    }
+}
+
+// Trees of double distances keep their exact radii through serialization: points right at a radius are found again
+TEST(DistanceTests, TestFloat64TreeSerialization) {
+    std::mt19937 generator(7);
+    std::normal_distribution<double> distribution;
+
+    ndarrayd points(2000, arrayd(4));
+    for (arrayd &point : points) {
+        std::generate(point.begin(), point.end(), [&]() { return distribution(generator); });
+    }
+
+    VPTree<arrayd, double, dist_l2_d_avx2, dist_l2_d_avx2_bounded> tree(points);
+    VPTree<arrayd, double, dist_l2_d_avx2, dist_l2_d_avx2_bounded> copy;
+    copy.deserialize(tree.serialize());
+
+    std::vector<int64_t> offsets, indexes;
+    std::vector<double> distances;
+    copy.searchRadius(points, {0.0}, offsets, indexes, distances);
+    for (size_t i = 0; i < points.size(); ++i) {
+        EXPECT_GE(offsets[i + 1] - offsets[i], 1) << "Point " << i << " not found";
+    }
+}
+
+TEST(DistanceTests, TestHammingKernels) {
+    std::mt19937 generator(7);
+    std::uniform_int_distribution<int> distribution(0, 255);
+    const DistanceKernels generic = distanceKernelsFor(SimdLevel::Generic);
+
+    auto naive = [](const arrayli &x, const arrayli &y) {
+        int64_t h = 0;
+        for (size_t i = 0; i < x.size(); ++i) {
+            for (uint8_t bits = x[i] ^ y[i]; bits != 0; bits &= bits - 1) {
+                ++h;
+            }
+        }
+        return h;
+    };
+
+    for (SimdLevel level : supportedLevels()) {
+        SCOPED_TRACE(simdLevelName(level));
+        const DistanceKernels kernels = distanceKernelsFor(level);
+
+        for (size_t size = 1; size <= 200; ++size) {
+            arrayli x(size), y(size);
+            for (size_t i = 0; i < size; ++i) {
+                x[i] = distribution(generator);
+                y[i] = distribution(generator);
+            }
+
+            const int64_t h = naive(x, y);
+            EXPECT_EQ(kernels.hamming(x.data(), y.data(), size), h);
+            EXPECT_EQ(kernels.hammingBounded(x.data(), y.data(), size, h), h);
+            EXPECT_GT(kernels.hammingBounded(x.data(), y.data(), size, h / 2), h / 2);
+
+            if (size == 8) {
+                EXPECT_EQ(kernels.hamming64(x.data(), y.data()), h);
+            } else if (size == 16) {
+                EXPECT_EQ(kernels.hamming128(x.data(), y.data()), h);
+            } else if (size == 32) {
+                EXPECT_EQ(kernels.hamming256(x.data(), y.data()), h);
+            } else if (size == 64) {
+                EXPECT_EQ(kernels.hamming512(x.data(), y.data()), h);
+                EXPECT_EQ(kernels.hamming512Bounded(x.data(), y.data(), h), h);
+                EXPECT_GT(kernels.hamming512Bounded(x.data(), y.data(), h / 2), h / 2);
+                EXPECT_EQ(generic.hamming512(x.data(), y.data()), h);
+            } else if (size == 128) {
+                EXPECT_EQ(kernels.hamming1024(x.data(), y.data()), h);
+            }
+        }
+    }
+}
+
+} // namespace vptree::tests
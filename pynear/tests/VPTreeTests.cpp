@@ -1,53 +1,70 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
+#include <BruteForceIndex.hpp>
+#include <CostModel.hpp>
+#include <DistanceFunctions.hpp>
 #include <MathUtils.hpp>
+#include <TaskQueue.hpp>
+#include <ThreadPool.hpp>
 #include <VPTree.hpp>
 
 #include <Eigen/Core>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <exception>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <random>
+#include <set>
 #include <sstream>
 #include <stdint.h>
+#include <thread>
 #include <vector>
 
-#if defined(_MSC_VER)
-#include <intrin.h>
-#else
-#include <nmmintrin.h>
-#endif
-
 using namespace testing;
 
 float distance(const Eigen::Vector3d &v1, const Eigen::Vector3d &v2) { return (v2 - v1).norm(); }
 
-/* inline uint_fast8_t popcnt_u128(__uint128_t n) */
-/* { */
-/*     const uint64_t      n_hi    = n >> 64; */
-/*     const uint64_t      n_lo    = n; */
-/*     const uint_fast8_t  cnt_hi  = __builtin_popcountll(n_hi); */
-/*     const uint_fast8_t  cnt_lo  = __builtin_popcountll(n_lo); */
-/*     const uint_fast8_t  cnt     = cnt_hi + cnt_lo; */
+namespace vptree::tests {
 
-/*     return  cnt; */
-/* } */
+// points with random coordinates in [-10, 10)
+static std::vector<Eigen::Vector3d> randomPoints(size_t count, std::default_random_engine &generator) {
+    std::uniform_real_distribution<float> distribution(-10, 10);
+    std::vector<Eigen::Vector3d> points(count);
+    for (Eigen::Vector3d &point : points) {
+        point[0] = distribution(generator);
+        point[1] = distribution(generator);
+        point[2] = distribution(generator);
+    }
+    return points;
+}
 
-int64_t dist_hamming(const std::vector<unsigned char> &p1, const std::vector<unsigned char> &p2) {
+// the k smallest distances, from the farthest to the closest one as kNN searches return them
+static std::vector<float> closestDistances(std::vector<float> distances, size_t k) {
+    std::sort(distances.begin(), distances.end());
+    distances.resize(std::min(distances.size(), k));
+    std::reverse(distances.begin(), distances.end());
+    return distances;
+}
 
-    // assume v1 and v2 sizes are multiple of 8
-    // assume 32 bytes for now
-    int64_t result = 0;
-    const uint64_t *a = (reinterpret_cast<const uint64_t *>(&p1[0]));
-    const uint64_t *b = (reinterpret_cast<const uint64_t *>(&p2[0]));
-    for (int i = 0; i < p1.size() / sizeof(uint64_t); i++) {
-        result += _mm_popcnt_u64(a[i] ^ b[i]);
+// exact kNN distances of every query, scanning all the points
+static std::vector<std::vector<float>> bruteForceKNN(const std::vector<Eigen::Vector3d> &queries, const std::vector<Eigen::Vector3d> &points,
+                                                     size_t k) {
+    std::vector<std::vector<float>> expected(queries.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+        for (const Eigen::Vector3d &point : points) {
+            expected[i].push_back(distance(queries[i], point));
+        }
+        expected[i] = closestDistances(std::move(expected[i]), k);
     }
-    return result;
+    return expected;
 }
 
-namespace vptree::tests {
 TEST(VPTests, TestHamming) {
 
     std::vector<unsigned char> b1 = {255, 255, 255, 255, 255, 255, 255, 255};
@@ -102,15 +119,7 @@ TEST(VPTests, TestEmpty) {
     tree.set(std::vector<Eigen::Vector3d>());
 
     std::default_random_engine generator;
-    std::uniform_real_distribution<float> distribution(-10, 10);
-
-    std::vector<Eigen::Vector3d> queries;
-    queries.resize(100);
-    for (Eigen::Vector3d &point : queries) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> queries = randomPoints(100, generator);
 
     std::vector<int64_t> indices;
     std::vector<float> distances;
@@ -126,17 +135,9 @@ TEST(VPTests, TestEmpty) {
 
 TEST(VPTests, TestToString) {
     std::default_random_engine generator;
-    std::uniform_real_distribution<float> distribution(-10, 10);
 
     const unsigned int numPoints = 14001;
-    std::vector<Eigen::Vector3d> points;
-    points.reserve(numPoints);
-    points.resize(numPoints);
-    for (Eigen::Vector3d &point : points) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
 
     VPTree<Eigen::Vector3d, float, distance> tree(points);
 
@@ -146,30 +147,16 @@ TEST(VPTests, TestToString) {
 
 TEST(VPTests, TestCopy) {
     std::default_random_engine generator;
-    std::uniform_real_distribution<float> distribution(-10, 10);
 
     const unsigned int numPoints = 14001;
-    std::vector<Eigen::Vector3d> points;
-    points.reserve(numPoints);
-    points.resize(numPoints);
-    for (Eigen::Vector3d &point : points) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
 
     VPTree<Eigen::Vector3d, float, distance> tree2;
     VPTree<Eigen::Vector3d, float, distance> tree(points);
 
     tree2 = tree;
 
-    std::vector<Eigen::Vector3d> queries;
-    queries.resize(100);
-    for (Eigen::Vector3d &point : queries) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> queries = randomPoints(100, generator);
 
     std::vector<int64_t> indices;
     std::vector<float> distances;
@@ -188,30 +175,16 @@ TEST(VPTests, TestCopy) {
 TEST(VPTests, TestSerialization) {
 
     std::default_random_engine generator;
-    std::uniform_real_distribution<float> distribution(-10, 10);
 
     const unsigned int numPoints = 14001;
-    std::vector<Eigen::Vector3d> points;
-    points.reserve(numPoints);
-    points.resize(numPoints);
-    for (Eigen::Vector3d &point : points) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
 
     VPTree<Eigen::Vector3d, float, distance> tree2;
     VPTree<Eigen::Vector3d, float, distance> tree(points);
     auto state = tree.serialize();
     tree2.deserialize(state);
 
-    std::vector<Eigen::Vector3d> queries;
-    queries.resize(100);
-    for (Eigen::Vector3d &point : queries) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> queries = randomPoints(100, generator);
 
     std::vector<int64_t> indices;
     std::vector<float> distances;
@@ -230,17 +203,9 @@ TEST(VPTests, TestSerialization) {
 TEST(VPTests, TestCreation) {
 
     std::default_random_engine generator;
-    std::uniform_real_distribution<float> distribution(-10, 10);
 
     const unsigned int numPoints = 10000;
-    std::vector<Eigen::Vector3d> points;
-    points.reserve(numPoints);
-    points.resize(numPoints);
-    for (Eigen::Vector3d &point : points) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
 
     auto start = std::chrono::steady_clock::now();
 
@@ -251,29 +216,16 @@ TEST(VPTests, TestCreation) {
 
 TEST(VPTests, TestSearch) {
     std::default_random_engine generator;
-    std::uniform_real_distribution<float> distribution(-10, 10);
 
     const unsigned int numPoints = 4e4;
-    std::vector<Eigen::Vector3d> points;
-    points.resize(numPoints);
-    for (Eigen::Vector3d &point : points) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
 
     auto start = std::chrono::steady_clock::now();
     VPTree<Eigen::Vector3d, float, distance> tree(points);
     auto end = std::chrono::steady_clock::now();
     std::chrono::duration<float> diff = end - start;
 
-    std::vector<Eigen::Vector3d> queries;
-    queries.resize(5000);
-    for (Eigen::Vector3d &point : queries) {
-        point[0] = distribution(generator);
-        point[1] = distribution(generator);
-        point[2] = distribution(generator);
-    }
+    std::vector<Eigen::Vector3d> queries = randomPoints(5000, generator);
     /* std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results; */
     std::vector<int64_t> indices;
     std::vector<float> distances;
@@ -282,4 +234,865 @@ TEST(VPTests, TestSearch) {
     end = std::chrono::steady_clock::now();
     diff = end - start;
 }
+
+TEST(VPTests, TestSearchBatched) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 20000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+
+    std::vector<Eigen::Vector3d> queries = randomPoints(1001, generator);
+
+    const size_t k = 5;
+    std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+    std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> resultsBatched;
+    tree.searchKNN(queries, k, results);
+    tree.searchKNNBatched(queries, k, resultsBatched, 16);
+
+    ASSERT_EQ(results.size(), resultsBatched.size());
+    for (size_t i = 0; i < results.size(); ++i) {
+        ASSERT_EQ(resultsBatched[i].distances.size(), k);
+        EXPECT_EQ(results[i].distances, resultsBatched[i].distances) << "Results differ for query " << i;
+    }
+}
+
+TEST(VPTests, TestKNNQueues) {
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> distribution(0, 100);
+
+    std::vector<float> values(500);
+    for (float &value : values) {
+        value = distribution(generator);
+    }
+    std::vector<float> sorted = values;
+    std::sort(sorted.begin(), sorted.end(), std::greater<float>());
+
+    for (size_t k : {1, 3, 4, 7, 16}) {
+        KNNSortedArray<float, 16> sortedArray(k);
+        KNNHeap<float> heap(k);
+        for (size_t i = 0; i < values.size(); ++i) {
+            sortedArray.push(i, values[i]);
+            heap.push(i, values[i]);
+        }
+
+        std::vector<int64_t> indexes, heapIndexes;
+        std::vector<float> distances, heapDistances;
+        sortedArray.fill(indexes, distances);
+        heap.fill(heapIndexes, heapDistances);
+
+        std::vector<float> expected(sorted.end() - k, sorted.end());
+        EXPECT_EQ(distances, expected);
+        EXPECT_EQ(heapDistances, expected);
+        EXPECT_EQ(indexes, heapIndexes);
+        for (size_t i = 0; i < k; ++i) {
+            EXPECT_EQ(values[indexes[i]], distances[i]);
+        }
+    }
+}
+
+TEST(VPTests, TestSearchKNNExhaustive) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 3000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+
+    std::vector<Eigen::Vector3d> queries = randomPoints(50, generator);
+
+    VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchOptions options;
+    for (bool bestFirst : {false, true}) {
+        options.bestFirst = bestFirst;
+
+        for (size_t k : {1, 2, 8, 13, 40}) {
+            std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+            tree.searchKNN(queries, k, results, options);
+
+            const std::vector<std::vector<float>> expected = bruteForceKNN(queries, points, k);
+            for (size_t i = 0; i < queries.size(); ++i) {
+                EXPECT_EQ(results[i].distances, expected[i]) << "Results differ for query " << i << ", k " << k << ", best first " << bestFirst;
+            }
+        }
+    }
+}
+
+TEST(VPTests, TestSearchRadius) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 5000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+
+    std::vector<Eigen::Vector3d> queries = randomPoints(40, generator);
+    std::vector<float> radii;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        radii.push_back(i * 0.1f);
+    }
+
+    std::vector<int64_t> offsets, indexes;
+    std::vector<float> distances;
+    tree.searchRadius(queries, radii, offsets, indexes, distances);
+
+    ASSERT_EQ(offsets.size(), queries.size() + 1);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        std::vector<float> expected;
+        for (const Eigen::Vector3d &point : points) {
+            float dist = distance(queries[i], point);
+            if (dist <= radii[i]) {
+                expected.push_back(dist);
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+
+        std::vector<float> found(distances.begin() + offsets[i], distances.begin() + offsets[i + 1]);
+        EXPECT_EQ(found, expected) << "Results differ for query " << i;
+        for (int64_t j = offsets[i]; j < offsets[i + 1]; ++j) {
+            EXPECT_EQ(distance(queries[i], points[indexes[j]]), distances[j]);
+        }
+    }
+
+    // kNN capped by a maximum radius
+    VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchOptions options;
+    options.maxRadius = 1.5f;
+    const size_t k = 10;
+    for (bool bestFirst : {false, true}) {
+        options.bestFirst = bestFirst;
+
+        std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+        tree.searchKNN(queries, k, results, options);
+
+        for (size_t i = 0; i < queries.size(); ++i) {
+            std::vector<float> expected;
+            for (const Eigen::Vector3d &point : points) {
+                float dist = distance(queries[i], point);
+                if (dist <= options.maxRadius) {
+                    expected.push_back(dist);
+                }
+            }
+            EXPECT_EQ(results[i].distances, closestDistances(expected, k)) << "Results differ for query " << i << ", best first " << bestFirst;
+        }
+    }
+}
+
+TEST(VPTests, TestSearchKNNApprox) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 5000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+
+    std::vector<Eigen::Vector3d> queries = randomPoints(50, generator);
+
+    const size_t k = 8;
+    const std::vector<std::vector<float>> expected = bruteForceKNN(queries, points, k);
+
+    VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchOptions options;
+    options.epsilon = 0.5;
+    for (bool bestFirst : {false, true}) {
+        options.bestFirst = bestFirst;
+
+        std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+        tree.searchKNN(queries, k, results, options);
+
+        for (size_t i = 0; i < queries.size(); ++i) {
+            ASSERT_EQ(results[i].distances.size(), k);
+            for (size_t j = 0; j < k; ++j) {
+                EXPECT_LE(results[i].distances[j], expected[i][j] * (1 + options.epsilon) * (1 + 1e-6));
+            }
+            if (results[i].exact) {
+                EXPECT_EQ(results[i].distances, expected[i]) << "Exact result differs for query " << i << ", best first " << bestFirst;
+            }
+        }
+    }
+
+    // a budget smaller than the tree stops every search early
+    options.epsilon = 0;
+    options.maxDistanceEvaluations = 20;
+    for (bool bestFirst : {false, true}) {
+        options.bestFirst = bestFirst;
+
+        std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+        tree.searchKNN(queries, k, results, options);
+
+        for (size_t i = 0; i < queries.size(); ++i) {
+            EXPECT_FALSE(results[i].exact);
+            EXPECT_EQ(results[i].distances.size(), k);
+        }
+    }
+
+    // an expired deadline stops every search before it starts
+    options.maxDistanceEvaluations = std::numeric_limits<size_t>::max();
+    options.deadline = std::chrono::steady_clock::now();
+    std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+    tree.searchKNN(queries, k, results, options);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        EXPECT_FALSE(results[i].exact);
+    }
+
+    // a generous time budget does not change the exact search
+    options.deadline = std::chrono::steady_clock::time_point::max();
+    options.queryTimeBudget = std::chrono::seconds(60);
+    tree.searchKNN(queries, k, results, options);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        EXPECT_TRUE(results[i].exact);
+        EXPECT_EQ(results[i].distances, expected[i]);
+    }
+}
+
+TEST(VPTests, TestSearchKNNFiltered) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 5000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+
+    std::vector<Eigen::Vector3d> queries = randomPoints(30, generator);
+
+    // every third point is allowed, and query i is further restricted to two index ranges
+    std::vector<bool> allowed(numPoints);
+    for (size_t i = 0; i < numPoints; ++i) {
+        allowed[i] = i % 3 == 0;
+    }
+    auto allowedSet = tree.makeAllowedSet(allowed);
+
+    std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeIndexRanges> allowedRanges(queries.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+        allowedRanges[i] = {{i * 10, i * 10 + 1000}, {3000 + i, 3100 + i}};
+    }
+
+    VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchOptions options;
+    options.allowedSet = &allowedSet;
+    options.allowedRanges = &allowedRanges;
+    const size_t k = 6;
+    // allowed ranges follow their query when queries are reordered
+    for (bool bestFirst : {false, true}) {
+        options.bestFirst = bestFirst;
+        options.reorderQueries = !bestFirst;
+
+        std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+        tree.searchKNN(queries, k, results, options);
+
+        for (size_t i = 0; i < queries.size(); ++i) {
+            std::vector<float> expected;
+            for (size_t j = 0; j < numPoints; ++j) {
+                bool inRange = (j >= i * 10 && j < i * 10 + 1000) || (j >= 3000 + i && j < 3100 + i);
+                if (allowed[j] && inRange) {
+                    expected.push_back(distance(queries[i], points[j]));
+                }
+            }
+            EXPECT_EQ(results[i].distances, closestDistances(expected, k)) << "Results differ for query " << i << ", best first " << bestFirst;
+            for (int64_t index : results[i].indexes) {
+                EXPECT_TRUE(allowed[index]);
+            }
+        }
+    }
+
+    // nothing allowed
+    auto emptySet = tree.makeAllowedSet(std::vector<bool>(numPoints, false));
+    options.allowedSet = &emptySet;
+    options.allowedRanges = nullptr;
+    std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+    tree.searchKNN(queries, k, results, options);
+    for (const auto &result : results) {
+        EXPECT_TRUE(result.indexes.empty());
+    }
+}
+
+TEST(VPTests, TestKNNGraph) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 2000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+
+    for (bool excludeSelf : {false, true}) {
+        for (size_t k : {1, 7, 20}) {
+            std::vector<int64_t> indexes;
+            std::vector<float> distances;
+            tree.knnGraph(k, excludeSelf, indexes, distances);
+            ASSERT_EQ(indexes.size(), numPoints * k);
+
+            for (size_t i = 0; i < numPoints; ++i) {
+                std::vector<float> expected;
+                for (size_t j = 0; j < numPoints; ++j) {
+                    if (j != i || !excludeSelf) {
+                        expected.push_back(distance(points[i], points[j]));
+                    }
+                }
+
+                std::vector<float> found(distances.begin() + i * k, distances.begin() + (i + 1) * k);
+                EXPECT_EQ(found, closestDistances(expected, k))
+                    << "Results differ for point " << i << ", k " << k << ", exclude self " << excludeSelf;
+                for (size_t j = i * k; j < (i + 1) * k; ++j) {
+                    EXPECT_TRUE(indexes[j] != static_cast<int64_t>(i) || !excludeSelf);
+                }
+            }
+        }
+    }
+}
+
+TEST(VPTests, TestSearchKNNOutput) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 2000;
+    const unsigned int numQueries = 300;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+    std::vector<Eigen::Vector3d> queries = randomPoints(numQueries, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+    VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchOptions options;
+    options.maxRadius = 2.0f;
+
+    for (size_t k : {1, 7, 20}) {
+        std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> results;
+        tree.searchKNN(queries, k, results, options);
+
+        // arrays rows are the same results, padded at the front when fewer than k points are within max radius
+        std::vector<int64_t> indexes(numQueries * k);
+        std::vector<float> distances(numQueries * k);
+        std::unique_ptr<bool[]> exact(new bool[numQueries]);
+        tree.searchKNN(queries, k, {indexes.data(), distances.data(), k, exact.get()}, options);
+
+        for (size_t i = 0; i < numQueries; ++i) {
+            const size_t padding = k - results[i].indexes.size();
+            std::vector<int64_t> expectedIndexes(padding, -1);
+            std::vector<float> expectedDistances(padding, std::numeric_limits<float>::max());
+            expectedIndexes.insert(expectedIndexes.end(), results[i].indexes.begin(), results[i].indexes.end());
+            expectedDistances.insert(expectedDistances.end(), results[i].distances.begin(), results[i].distances.end());
+
+            EXPECT_EQ(std::vector<int64_t>(indexes.begin() + i * k, indexes.begin() + (i + 1) * k), expectedIndexes) << "query " << i;
+            EXPECT_EQ(std::vector<float>(distances.begin() + i * k, distances.begin() + (i + 1) * k), expectedDistances) << "query " << i;
+            EXPECT_TRUE(exact[i]);
+        }
+
+        tree.searchKNN(queries, k, results);
+        tree.searchKNNDualTree(queries, k, {indexes.data(), distances.data(), k});
+        for (size_t i = 0; i < numQueries; ++i) {
+            EXPECT_EQ(std::vector<float>(distances.begin() + i * k, distances.begin() + (i + 1) * k), results[i].distances) << "query " << i;
+        }
+    }
+}
+
+TEST(VPTests, TestSearchKNNDualTree) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 4000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+
+    std::vector<Eigen::Vector3d> queries = randomPoints(1500, generator);
+
+    for (size_t k : {1, 5, 20}) {
+        std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> expected, results;
+        tree.searchKNN(queries, k, expected);
+        tree.searchKNNDualTree(queries, k, results, 16);
+
+        ASSERT_EQ(results.size(), queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            EXPECT_EQ(results[i].distances, expected[i].distances) << "Results differ for query " << i << ", k " << k;
+        }
+    }
+}
+
+TEST(VPTests, TestNeighborIterator) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 1000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+
+    const std::vector<Eigen::Vector3d> queries = randomPoints(5, generator);
+    for (size_t q = 0; q < queries.size(); ++q) {
+        const Eigen::Vector3d &query = queries[q];
+
+        // every distance, from the closest to the farthest one
+        std::vector<float> expected = bruteForceKNN({query}, points, numPoints)[0];
+        std::reverse(expected.begin(), expected.end());
+
+        // every point comes out once, from the closest to the farthest one, in chunks that do not divide the total
+        auto iterator = tree.neighbors(query);
+        std::vector<int64_t> indexes;
+        std::vector<float> distances;
+        const size_t chunkSize = 7;
+        while (!iterator.done()) {
+            const size_t offset = indexes.size();
+            indexes.resize(offset + chunkSize);
+            distances.resize(offset + chunkSize);
+            const size_t found = iterator.next(chunkSize, &indexes[offset], &distances[offset]);
+            indexes.resize(offset + found);
+            distances.resize(offset + found);
+        }
+        EXPECT_EQ(distances, expected) << "Results differ for query " << q;
+
+        std::vector<bool> seen(numPoints, false);
+        for (size_t i = 0; i < indexes.size(); ++i) {
+            EXPECT_FALSE(seen[indexes[i]]);
+            seen[indexes[i]] = true;
+            EXPECT_EQ(distances[i], distance(query, points[indexes[i]]));
+        }
+
+        int64_t index;
+        float dist;
+        EXPECT_EQ(iterator.next(1, &index, &dist), 0u);
+    }
+
+    VPTree<Eigen::Vector3d, float, distance> empty;
+    EXPECT_THROW(empty.neighbors(Eigen::Vector3d(0, 0, 0)), std::runtime_error);
+}
+
+TEST(VPTests, TestSearchStats) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 20000;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+    std::vector<Eigen::Vector3d> queries = randomPoints(50, generator);
+
+    using Tree = VPTree<Eigen::Vector3d, float, distance>;
+    Tree tree(points);
+    const size_t k = 5;
+
+    for (bool bestFirst : {false, true}) {
+        Tree::VPTreeSearchOptions options;
+        options.bestFirst = bestFirst;
+
+        // counting does not change the results
+        std::vector<Tree::VPTreeSearchResultElement> expected, results;
+        std::vector<VPTreeSearchStats> stats;
+        tree.searchKNN(queries, k, expected, options);
+        tree.searchKNN(queries, k, results, options, stats);
+        ASSERT_EQ(stats.size(), queries.size());
+
+        VPTreeSearchStats total{};
+        for (size_t i = 0; i < queries.size(); ++i) {
+            EXPECT_EQ(results[i].indexes, expected[i].indexes);
+            EXPECT_EQ(stats[i].distanceEvaluations, stats[i].nodesVisited);
+            EXPECT_GE(stats[i].heapInsertions, k);
+            EXPECT_LE(stats[i].heapInsertions, stats[i].distanceEvaluations);
+            EXPECT_GE(stats[i].maxStackDepth, 1u);
+            total += stats[i];
+        }
+
+        // the tree prunes most of the points away
+        EXPECT_GT(total.nodesPruned, 0u);
+        EXPECT_LT(total.distanceEvaluations, numPoints * queries.size() / 10);
+    }
+
+    std::vector<int64_t> indices, expectedIndices;
+    std::vector<float> distances, expectedDistances;
+    std::vector<VPTreeSearchStats> stats;
+    tree.search1NN(queries, expectedIndices, expectedDistances);
+    tree.search1NN(queries, indices, distances, stats);
+    EXPECT_EQ(indices, expectedIndices);
+    ASSERT_EQ(stats.size(), queries.size());
+    for (const VPTreeSearchStats &queryStats : stats) {
+        EXPECT_GE(queryStats.heapInsertions, 1u);
+        EXPECT_GT(queryStats.nodesPruned, 0u);
+        EXPECT_LT(queryStats.distanceEvaluations, numPoints / 10);
+    }
+}
+
+
+TEST(VPTests, TestBruteForce) {
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> distribution(-1, 1);
+
+    // not a multiple of the tile and query block sizes
+    const size_t numPoints = 1000, numQueries = 70, dimension = 40, k = 10;
+    auto randomVectors = [&](size_t count) {
+        std::vector<std::vector<float>> vectors(count, std::vector<float>(dimension));
+        for (std::vector<float> &vector : vectors) {
+            std::generate(vector.begin(), vector.end(), [&]() { return distribution(generator); });
+        }
+        return vectors;
+    };
+    const std::vector<std::vector<float>> points = randomVectors(numPoints);
+    const std::vector<std::vector<float>> queries = randomVectors(numQueries);
+
+    for (GemmMetric metric : {GemmMetric::L2, GemmMetric::InnerProduct}) {
+        BruteForceIndex index(metric);
+        index.set(points);
+
+        std::vector<int64_t> indexes(numQueries * k);
+        std::vector<float> distances(numQueries * k);
+        index.searchKNN(queries, k, indexes.data(), distances.data());
+
+        for (size_t q = 0; q < numQueries; ++q) {
+            // exhaustive search, closest first
+            std::vector<std::pair<float, int64_t>> expected;
+            for (size_t i = 0; i < numPoints; ++i) {
+                float dist = 0;
+                for (size_t d = 0; d < dimension; ++d) {
+                    const float diff = queries[q][d] - points[i][d];
+                    dist += metric == GemmMetric::L2 ? diff * diff : queries[q][d] * points[i][d];
+                }
+                expected.push_back({metric == GemmMetric::L2 ? std::sqrt(dist) : dist, i});
+            }
+            std::sort(expected.begin(), expected.end(), [&](const auto &a, const auto &b) {
+                return metric == GemmMetric::L2 ? a.first < b.first : a.first > b.first;
+            });
+
+            // rows go from the farthest to the closest point
+            for (size_t j = 0; j < k; ++j) {
+                EXPECT_EQ(indexes[q * k + k - 1 - j], expected[j].second) << "Results differ for query " << q;
+                EXPECT_NEAR(distances[q * k + k - 1 - j], expected[j].first, 1e-4);
+            }
+        }
+
+        // k larger than the index pads rows
+        std::vector<int64_t> allIndexes(numPoints + 1);
+        std::vector<float> allDistances(numPoints + 1);
+        index.searchKNN({queries[0]}, numPoints + 1, allIndexes.data(), allDistances.data());
+        EXPECT_EQ(allIndexes[0], -1);
+        EXPECT_EQ(std::set<int64_t>(allIndexes.begin() + 1, allIndexes.end()).size(), numPoints);
+
+        BruteForceIndex copy;
+        copy.deserialize(index.serialize());
+        std::vector<int64_t> indices, copyIndices;
+        std::vector<float> dists, copyDists;
+        index.search1NN(queries, indices, dists);
+        copy.search1NN(queries, copyIndices, copyDists);
+        EXPECT_EQ(indices, copyIndices);
+        EXPECT_EQ(copy.metric(), metric);
+        for (size_t q = 0; q < numQueries; ++q) {
+            EXPECT_EQ(indices[q], indexes[q * k + k - 1]);
+        }
+    }
+
+    BruteForceIndex empty;
+    std::vector<int64_t> indices;
+    std::vector<float> distances;
+    EXPECT_THROW(empty.search1NN(queries, indices, distances), std::runtime_error);
+}
+
+float distanceL2(const std::vector<float> &v1, const std::vector<float> &v2) {
+    float sum = 0;
+    for (size_t i = 0; i < v1.size(); ++i) {
+        sum += (v1[i] - v2[i]) * (v1[i] - v2[i]);
+    }
+    return std::sqrt(sum);
+}
+
+TEST(VPTests, TestBruteForceFarFromOrigin) {
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> distribution(0, 1);
+
+    // far from the origin, the expanded form of squared distances loses every digit of the small ones
+    const size_t numPoints = 5000, numQueries = 100, dimension = 8, k = 5;
+    auto randomVectors = [&](size_t count) {
+        std::vector<std::vector<float>> vectors(count, std::vector<float>(dimension));
+        for (std::vector<float> &vector : vectors) {
+            std::generate(vector.begin(), vector.end(), [&]() { return 1000 + distribution(generator); });
+        }
+        return vectors;
+    };
+    const std::vector<std::vector<float>> points = randomVectors(numPoints);
+    const std::vector<std::vector<float>> queries = randomVectors(numQueries);
+
+    BruteForceIndex index;
+    index.set(points);
+    std::vector<int64_t> indexes(numQueries * k);
+    std::vector<float> distances(numQueries * k);
+    index.searchKNN(queries, k, indexes.data(), distances.data());
+
+    // same neighbors and distances as a tree, rounding included
+    VPTree<arrayf, float, dist_l2_f_avx2> tree;
+    tree.set(points);
+    std::vector<int64_t> treeIndexes(numQueries * k);
+    std::vector<float> treeDistances(numQueries * k);
+    tree.searchKNN(queries, k, {treeIndexes.data(), treeDistances.data(), k});
+    EXPECT_EQ(indexes, treeIndexes);
+    EXPECT_EQ(distances, treeDistances);
+}
+
+TEST(VPTests, TestCostModel) {
+    std::default_random_engine generator;
+    std::uniform_real_distribution<float> distribution(-10, 10);
+
+    const size_t numPoints = 20000, dimension = 3, k = 8;
+    std::vector<std::vector<float>> points(numPoints, std::vector<float>(dimension));
+    for (std::vector<float> &point : points) {
+        std::generate(point.begin(), point.end(), [&]() { return distribution(generator); });
+    }
+    std::vector<std::vector<float>> queries(points.begin(), points.begin() + 100);
+
+    using Tree = VPTree<std::vector<float>, float, distanceL2>;
+    Tree tree(points);
+
+    // scanning small partitions instead of walking them finds the same points
+    std::vector<Tree::VPTreeSearchResultElement> expected, results;
+    tree.searchKNN(queries, k, expected);
+    Tree::VPTreeSearchOptions options;
+    options.leafSize = 16;
+    tree.searchKNN(queries, k, results, options);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        EXPECT_EQ(results[i].indexes, expected[i].indexes) << "Results differ for query " << i;
+    }
+
+    BruteForceIndex bruteForce;
+    bruteForce.set(points);
+    const SearchPlan plan = planSearch(tree, points, &bruteForce, k);
+    EXPECT_TRUE(plan.leafSize == 1 || plan.leafSize == 4 || plan.leafSize == 16 || plan.leafSize == 64);
+    EXPECT_GT(plan.evaluatedFraction, 0);
+    EXPECT_LT(plan.evaluatedFraction, 0.01);
+    EXPECT_GT(plan.treeSecondsPerQuery, 0);
+    // the tree prunes too many points for a scan of all of them to be worth timing
+    EXPECT_FALSE(plan.hasBruteForce);
+
+    // at high dimensions the tree evaluates most points, and the scan is timed
+    const size_t highDimension = 64;
+    std::vector<std::vector<float>> highPoints(4000, std::vector<float>(highDimension));
+    for (std::vector<float> &point : highPoints) {
+        std::generate(point.begin(), point.end(), [&]() { return distribution(generator); });
+    }
+    Tree highTree(highPoints);
+    BruteForceIndex highBruteForce;
+    highBruteForce.set(highPoints);
+    const SearchPlan highPlan = planSearch(highTree, highPoints, &highBruteForce, k);
+    EXPECT_GT(highPlan.evaluatedFraction, 0.5);
+    EXPECT_TRUE(highPlan.hasBruteForce);
+    EXPECT_GT(highPlan.bruteForceSecondsPerBlock + highPlan.bruteForceSecondsPerQuery, 0);
+
+    // the scan streams the dataset once per block: it needs full blocks to win, and as many blocks as threads
+    SearchPlan costs;
+    costs.treeSecondsPerQuery = 1e-3;
+    costs.bruteForceSecondsPerBlock = 1e-2;
+    costs.bruteForceSecondsPerQuery = 1e-5;
+    costs.hasBruteForce = true;
+    EXPECT_FALSE(costs.useBruteForce(1, 1));
+    EXPECT_TRUE(costs.useBruteForce(BruteForceIndex::queryBlockSize, 1));
+    EXPECT_FALSE(costs.useBruteForce(BruteForceIndex::queryBlockSize, 8));
+    EXPECT_TRUE(costs.useBruteForce(8 * BruteForceIndex::queryBlockSize, 8));
+    EXPECT_TRUE(costs.bruteForceEverWins());
+
+    costs.treeSecondsPerQuery = 1e-4;
+    EXPECT_FALSE(costs.bruteForceEverWins());
+    EXPECT_FALSE(costs.useBruteForce(1000 * BruteForceIndex::queryBlockSize, 8));
+}
+
+// early abandon distance as in DistanceFunctions.hpp, counting the distances abandoned
+std::atomic<int> numAbandoned(0);
+float boundedDistance(const Eigen::Vector3d &v1, const Eigen::Vector3d &v2, float bound) {
+    float dist = distance(v1, v2);
+    if (dist > bound) {
+        ++numAbandoned;
+        return std::numeric_limits<float>::infinity();
+    }
+    return dist;
+}
+
+TEST(VPTests, TestBoundedDistance) {
+    std::default_random_engine generator;
+    std::vector<Eigen::Vector3d> points = randomPoints(3000, generator);
+    std::vector<Eigen::Vector3d> queries = randomPoints(50, generator);
+
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+    VPTree<Eigen::Vector3d, float, distance, boundedDistance> boundedTree(points);
+
+    const size_t k = 5;
+    VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchOptions options;
+    VPTree<Eigen::Vector3d, float, distance, boundedDistance>::VPTreeSearchOptions boundedOptions;
+    for (bool bestFirst : {false, true}) {
+        options.bestFirst = bestFirst;
+        boundedOptions.bestFirst = bestFirst;
+        std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> expected;
+        tree.searchKNN(queries, k, expected, options);
+
+        std::vector<VPTree<Eigen::Vector3d, float, distance, boundedDistance>::VPTreeSearchResultElement> results;
+        boundedTree.searchKNN(queries, k, results, boundedOptions);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            EXPECT_EQ(results[i].indexes, expected[i].indexes) << "Results differ for query " << i << ", best first " << bestFirst;
+            EXPECT_EQ(results[i].distances, expected[i].distances) << "Results differ for query " << i << ", best first " << bestFirst;
+        }
+    }
+
+    std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> expected;
+    tree.searchKNN(queries, k, expected);
+    std::vector<VPTree<Eigen::Vector3d, float, distance, boundedDistance>::VPTreeSearchResultElement> results;
+    boundedTree.searchKNNBatched(queries, k, results, 8);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        EXPECT_EQ(results[i].distances, expected[i].distances) << "Batched results differ for query " << i;
+    }
+
+    std::vector<int64_t> indices, boundedIndices;
+    std::vector<float> distances, boundedDistances;
+    tree.search1NN(queries, indices, distances);
+    boundedTree.search1NN(queries, boundedIndices, boundedDistances);
+    EXPECT_EQ(boundedIndices, indices);
+    EXPECT_EQ(boundedDistances, distances);
+
+    std::vector<int64_t> offsets, boundedOffsets;
+    tree.searchRadius(queries, {2.5f}, offsets, indices, distances);
+    boundedTree.searchRadius(queries, {2.5f}, boundedOffsets, boundedIndices, boundedDistances);
+    EXPECT_EQ(boundedOffsets, offsets);
+    EXPECT_EQ(boundedDistances, distances);
+
+    // leaves hold about half of the points, most of them too far to make it into the results
+    EXPECT_GT(numAbandoned, 0);
+}
+
+TEST(VPTests, TestConcurrentSearch) {
+    std::default_random_engine generator;
+
+    const unsigned int numPoints = 5000;
+    const unsigned int numQueries = 500;
+    std::vector<Eigen::Vector3d> points = randomPoints(numPoints, generator);
+    std::vector<Eigen::Vector3d> queries = randomPoints(numQueries, generator);
+
+    // building the same data twice gives the same tree
+    VPTree<Eigen::Vector3d, float, distance> tree(points);
+    VPTree<Eigen::Vector3d, float, distance> other(points);
+    std::stringstream treeString, otherString;
+    treeString << tree;
+    otherString << other;
+    EXPECT_EQ(treeString.str(), otherString.str());
+
+    const size_t k = 10;
+    std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement> expected;
+    tree.searchKNN(queries, k, expected);
+
+    // read only searches on the same tree from several threads at once, each one running its own parallel loops
+    const size_t numThreads = 4;
+    std::vector<std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement>> results(numThreads);
+    std::vector<std::vector<VPTree<Eigen::Vector3d, float, distance>::VPTreeSearchResultElement>> dualTreeResults(numThreads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int repeat = 0; repeat < 5; ++repeat) {
+                tree.searchKNN(queries, k, results[t]);
+                tree.searchKNNDualTree(queries, k, dualTreeResults[t]);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    for (size_t t = 0; t < numThreads; ++t) {
+        for (size_t i = 0; i < numQueries; ++i) {
+            EXPECT_EQ(results[t][i].indexes, expected[i].indexes) << "thread " << t << ", query " << i;
+            EXPECT_EQ(dualTreeResults[t][i].distances, expected[i].distances) << "thread " << t << ", query " << i;
+        }
+    }
+}
+
+TEST(VPTests, TestTaskQueue) {
+    std::atomic<int> done(0);
+    std::mutex mutex;
+    std::unique_lock<std::mutex> blocked(mutex);
+
+    {
+        TaskQueue queue(2, 4);
+        EXPECT_EQ(queue.numThreads(), 2);
+
+        // both workers wait on the mutex, so a fifth pending task has to wait for a free slot
+        for (int i = 0; i < 2; ++i) {
+            queue.submit([&]() {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++done;
+            });
+        }
+        for (int i = 0; i < 4; ++i) {
+            queue.submit([&]() { ++done; });
+        }
+
+        std::atomic<bool> submitted(false);
+        std::thread producer([&]() {
+            queue.submit([&]() { ++done; });
+            submitted = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        EXPECT_FALSE(submitted);
+
+        blocked.unlock();
+        producer.join();
+        EXPECT_TRUE(submitted);
+
+        // pending tasks still run on shutdown
+        queue.shutdown();
+        EXPECT_EQ(done, 7);
+        EXPECT_THROW(queue.submit([]() {}), std::runtime_error);
+    }
+
+    // a task never waits for a free slot, as its worker is the only one that could free it
+    {
+        TaskQueue queue(1, 1);
+        std::promise<void> submitted;
+        queue.submit([&]() {
+            for (int i = 0; i < 8; ++i) {
+                queue.submit([&]() { ++done; });
+            }
+            submitted.set_value();
+        });
+        EXPECT_EQ(submitted.get_future().wait_for(std::chrono::seconds(10)), std::future_status::ready);
+        queue.shutdown();
+        EXPECT_EQ(done, 15);
+    }
+}
+
+TEST(VPTests, TestThreadPool) {
+    ThreadPool pool(4);
+    EXPECT_EQ(pool.numThreads(), 4u);
+
+    for (size_t count : {0, 1, 2, 3, 7, 50, 1000}) {
+        std::vector<std::atomic<int>> calls(count);
+        pool.parallelFor(count, [&](size_t i) { ++calls[i]; });
+        for (size_t i = 0; i < count; ++i) {
+            EXPECT_EQ(calls[i], 1) << "count " << count << ", index " << i;
+        }
+    }
+
+    // loops from other threads while the pool is busy wait for it, and nested loops run inline
+    std::atomic<int> total(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; ++t) {
+        threads.emplace_back([&]() {
+            for (int repeat = 0; repeat < 100; ++repeat) {
+                pool.parallelFor(10, [&](size_t) {
+                    const std::thread::id outer = std::this_thread::get_id();
+                    pool.parallelFor(10, [&](size_t) {
+                        EXPECT_EQ(std::this_thread::get_id(), outer);
+                        ++total;
+                    });
+                });
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(total, 3 * 100 * 10 * 10);
+
+    ThreadPool::SerialScope serial;
+    const std::thread::id caller = std::this_thread::get_id();
+    pool.parallelFor(100, [&](size_t) { EXPECT_EQ(std::this_thread::get_id(), caller); });
+}
+
+TEST(VPTests, TestThreadPoolSchedules) {
+    for (ThreadPool::Schedule schedule : {ThreadPool::Schedule::Static, ThreadPool::Schedule::WorkStealing}) {
+        ThreadPool pool(3, schedule);
+        EXPECT_EQ(pool.schedule(), schedule);
+
+        // the first iterations are much slower than the others, as outlier queries are
+        for (size_t count : {2, 5, 64, 1001}) {
+            std::vector<std::atomic<int>> calls(count);
+            pool.parallelFor(count, [&](size_t i) {
+                if (i < count / 8) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                }
+                ++calls[i];
+            });
+            for (size_t i = 0; i < count; ++i) {
+                EXPECT_EQ(calls[i], 1) << "count " << count << ", index " << i;
+            }
+        }
+    }
+}
 } // namespace vptree::tests
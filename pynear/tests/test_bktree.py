@@ -8,6 +8,7 @@ CLASSES = [
     (pynear.BKTreeBinaryIndex128, 16),
     (pynear.BKTreeBinaryIndex256, 32),
     (pynear.BKTreeBinaryIndex512, 64),
+    (pynear.BKTreeBinaryIndex1024, 128),
     (pynear.BKTreeBinaryIndexN, 1),
 ]
 
@@ -100,3 +100,18 @@ def test_binary_serialization():
 
 
 test_basic_serialization()
+
+
+def test_brute_force_serialization():
+    np.random.seed(seed=42)
+
+    data = np.random.rand(1000, 16).astype(dtype=np.float32)
+    queries = np.random.rand(10, 16).astype(dtype=np.float32)
+
+    index = pynear.BruteForceL2Index()
+    index.set(data)
+    recovered = pickle.loads(pickle.dumps(index))
+
+    indices, distances = index.searchKNN(queries, 3)
+    indices_rec, distances_rec = recovered.searchKNN(queries, 3)
+    assert np.array_equal(indices, indices_rec) and np.array_equal(distances, distances_rec)
@@ -3,7 +3,13 @@
 # Copyright 2021 Pablo Carneiro Elias
 #
 
+import asyncio
+import os
+import pickle
+import subprocess
+import sys
 from collections import Counter
+from concurrent.futures import ThreadPoolExecutor
 from functools import partial
 from typing import Callable
 from typing import Tuple
@@ -34,6 +40,11 @@ def chebyshev_distance_pairwise(a: np.ndarray, b: np.ndarray) -> np.ndarray:
     return np.max(np.abs(diff), axis=-1)
 
 
+def inner_product_pairwise(a: np.ndarray, b: np.ndarray) -> np.ndarray:
+    # negated, so the closest vector has the lowest value
+    return -(a @ b.T)
+
+
 def test_empty_index():
     try:
         vptree = pynear.VPTreeBinaryIndex()
@@ -66,6 +77,10 @@ def test_empty_index():
         pass
 
 
+def test_simd_level():
+    assert pynear.simd_level() in ("generic", "sse4.2", "avx2", "avx512")
+
+
 def test_hamming():
     def hamming_distance(a, b) -> np.ndarray:
         r = (1 << np.arange(8))[:, None]
@@ -101,6 +116,7 @@ exhaustive_search_hamming = partial(exhaustive_search, hamming_distance_pairwise
 exhaustive_search_euclidean = partial(exhaustive_search, euclidean_distance_pairwise)
 exhaustive_search_manhattan = partial(exhaustive_search, manhattan_distance_pairwise)
 exhaustive_search_chebyshev = partial(exhaustive_search, chebyshev_distance_pairwise)
+exhaustive_search_inner_product = partial(exhaustive_search, inner_product_pairwise)
 
 
 def _num_dups(distances):
@@ -118,11 +134,58 @@ CLASSES = [
 ]
 
 
+DTYPE_CLASSES = [
+    (pynear.VPTreeL2Float64Index, euclidean_distance_pairwise, np.float64),
+    (pynear.VPTreeL1Float64Index, manhattan_distance_pairwise, np.float64),
+    (pynear.VPTreeChebyshevFloat64Index, chebyshev_distance_pairwise, np.float64),
+    (pynear.VPTreeL2Int16Index, euclidean_distance_pairwise, np.int16),
+    (pynear.VPTreeL1Int16Index, manhattan_distance_pairwise, np.int16),
+    (pynear.VPTreeChebyshevInt16Index, chebyshev_distance_pairwise, np.int16),
+    (pynear.VPTreeL2Int32Index, euclidean_distance_pairwise, np.int32),
+    (pynear.VPTreeL1Int32Index, manhattan_distance_pairwise, np.int32),
+    (pynear.VPTreeChebyshevInt32Index, chebyshev_distance_pairwise, np.int32),
+]
+
+
+@pytest.mark.parametrize("vptree_cls, metric_func, dtype", DTYPE_CLASSES)
+def test_dtype_indexes(vptree_cls, metric_func, dtype):
+    np.random.seed(seed=42)
+
+    num_points = 5021
+    dimension = 13
+    if dtype == np.float64:
+        data = np.random.normal(scale=1e3, size=(num_points, dimension))
+        queries = np.random.normal(scale=1e3, size=(23, dimension))
+    else:
+        # full range, where differences overflow the dtype
+        info = np.iinfo(dtype)
+        data = np.random.randint(info.min, info.max, size=(num_points, dimension), dtype=dtype)
+        queries = np.random.randint(info.min, info.max, size=(23, dimension), dtype=dtype)
+
+    k = 3
+    expected = np.sort(metric_func(queries.astype(np.float64), data.astype(np.float64)), axis=-1)[:, :k]
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k)
+    assert vptree_distances.dtype == np.float64
+    np.testing.assert_allclose(vptree_distances[:, ::-1], expected, rtol=1e-12)
+
+    _, distances_1nn = vptree.search1NN(queries)
+    np.testing.assert_allclose(distances_1nn, expected[:, 0], rtol=1e-12)
+
+    # every indexed vector is found again at distance 0, also from an unpickled index
+    recovered = pickle.loads(pickle.dumps(vptree))
+    offsets, indices, distances = recovered.searchRadius(data, 0)
+    assert np.all(np.diff(offsets) >= 1)
+    assert np.all(distances == 0)
+
+
+@pytest.mark.parametrize("dimension", [32, 128])
 @pytest.mark.parametrize("num_points, k", [(2021, 2), (40021, 3)])
-def test_binary(num_points, k):
+def test_binary(num_points, k, dimension):
     np.random.seed(seed=42)
 
-    dimension = 32
     data = np.random.normal(scale=255, loc=0, size=(num_points, dimension)).astype(dtype=np.uint8)
 
     num_queries = 8
@@ -153,7 +216,7 @@ def test_binary_duplicates():
     indices, distances = vptree.searchKNN(data, k)
 
     assert [sorted(i) for i in indices] == [list(range(num_points))] * num_points
-    assert distances == [[0] * k] * num_points
+    assert np.array_equal(distances, np.zeros((num_points, k)))
 
 
 @pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
@@ -341,3 +404,671 @@ def test_compare_with_exaustive_1nn(vptree_cls, exaustive_metric):
 
     assert np.array_equal(exaustive_indices, vptree_indices)
     np.testing.assert_allclose(exaustive_distances, vptree_distances, rtol=1e-06)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_compare_with_exaustive_knn_batched(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 77
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 3
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    vptree_indices, vptree_distances = vptree.searchKNNBatched(queries, k, block_size=16)
+
+    vptree_indices = np.array(vptree_indices, dtype=np.uint64)[:, ::-1]
+    vptree_distances = np.array(vptree_distances, dtype=np.float32)[:, ::-1]
+
+    assert np.array_equal(exaustive_indices, vptree_indices)
+    np.testing.assert_allclose(exaustive_distances, vptree_distances, rtol=1e-06)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_compare_with_exaustive_knn_dual_tree(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 1003
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 3
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    vptree_indices, vptree_distances = vptree.searchKNNDualTree(queries, k, block_size=16)
+
+    vptree_indices = np.array(vptree_indices, dtype=np.uint64)[:, ::-1]
+    vptree_distances = np.array(vptree_distances, dtype=np.float32)[:, ::-1]
+
+    assert np.array_equal(exaustive_indices, vptree_indices)
+    np.testing.assert_allclose(exaustive_distances, vptree_distances, rtol=1e-06)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_compare_with_exaustive_knn_best_first(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 16
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 23
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 5
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k, best_first=True)
+
+    vptree_indices = np.array(vptree_indices, dtype=np.uint64)[:, ::-1]
+    vptree_distances = np.array(vptree_distances, dtype=np.float32)[:, ::-1]
+
+    assert np.array_equal(exaustive_indices, vptree_indices)
+    np.testing.assert_allclose(exaustive_distances, vptree_distances, rtol=1e-06)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_compare_with_exaustive_knn_reorder_queries(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 523
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 5
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k, reorder_queries=True)
+
+    vptree_indices = np.array(vptree_indices, dtype=np.uint64)[:, ::-1]
+    vptree_distances = np.array(vptree_distances, dtype=np.float32)[:, ::-1]
+
+    assert np.array_equal(exaustive_indices, vptree_indices)
+    np.testing.assert_allclose(exaustive_distances, vptree_distances, rtol=1e-06)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_search_stats(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 4
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 23
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 3
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k)
+    stats_indices, stats_distances, stats = vptree.searchKNNStats(queries, k)
+
+    assert np.array_equal(vptree_indices, stats_indices)
+    assert np.array_equal(vptree_distances, stats_distances)
+    assert stats.shape == (num_queries,)
+    assert stats.dtype.names == (
+        "distance_evaluations",
+        "nodes_visited",
+        "nodes_pruned",
+        "heap_insertions",
+        "max_stack_depth",
+    )
+    assert np.all(stats["heap_insertions"] >= k)
+    assert np.all(stats["distance_evaluations"] < num_points)
+    assert np.all(stats["nodes_pruned"] > 0)
+
+    _, _, total = vptree.searchKNNStats(queries, k, aggregate=True)
+    assert total.shape == (1,)
+    assert total["distance_evaluations"][0] == stats["distance_evaluations"].sum()
+    assert total["max_stack_depth"][0] == stats["max_stack_depth"].max()
+
+    indices, _, stats = vptree.search1NNStats(queries)
+    assert np.array_equal(indices, vptree.search1NN(queries)[0])
+    assert np.all(stats["heap_insertions"] >= 1)
+
+
+@pytest.mark.parametrize("dimension", [4, 64])
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_tuned_search(vptree_cls, exaustive_metric, dimension):
+    np.random.seed(seed=42)
+
+    num_points = 4021
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 97
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 5
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data, tune=True)
+    plan = vptree.search_plan()
+    assert plan["leaf_size"] >= 1
+    assert 0 < plan["evaluated_fraction"] <= 1
+    assert plan["tree_seconds_per_query"] > 0
+
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k)
+    assert np.array_equal(exaustive_indices, vptree_indices[:, ::-1])
+    np.testing.assert_allclose(exaustive_distances, vptree_distances[:, ::-1], rtol=1e-04)
+
+    indices_1nn, _ = vptree.search1NN(queries)
+    assert np.array_equal(indices_1nn, exaustive_indices[:, 0])
+
+    # every entry point following the plan finds the same neighbors
+    for indices, distances in [
+        vptree.searchKNNApprox(queries, k)[:2],
+        vptree.searchKNNStats(queries, k)[:2],
+        vptree.submit(queries, k).result(timeout=60),
+    ]:
+        assert np.array_equal(exaustive_indices, indices[:, ::-1])
+        np.testing.assert_allclose(exaustive_distances, distances[:, ::-1], rtol=1e-04)
+
+    # far from the origin, where the expanded form of squared distances cancels, results are still exact
+    offset_data, offset_queries = data + 1e3, queries + 1e3
+    exaustive_indices, exaustive_distances = exaustive_metric(offset_data, offset_queries, k)
+    vptree.set(offset_data, tune=True)
+    for indices, distances in [
+        vptree.searchKNN(offset_queries, k),
+        vptree.submit(offset_queries, k).result(timeout=60),
+    ]:
+        assert np.array_equal(exaustive_indices, indices[:, ::-1])
+        np.testing.assert_allclose(exaustive_distances, distances[:, ::-1], rtol=1e-04)
+
+    # a plain set() drops the plan
+    vptree.set(data)
+    assert vptree.search_plan()["leaf_size"] == 1
+    assert not vptree.search_plan()["brute_force"]
+
+
+@pytest.mark.parametrize(
+    "index_cls, exaustive_metric",
+    [
+        (pynear.BruteForceL2Index, exhaustive_search_euclidean),
+        (pynear.BruteForceInnerProductIndex, exhaustive_search_inner_product),
+    ],
+)
+def test_brute_force(index_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 3021
+    dimension = 300
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 97
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 5
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    index = index_cls()
+    index.set(data)
+    assert index.size() == num_points
+    indices, distances = index.searchKNN(queries, k)
+
+    if index_cls is pynear.BruteForceInnerProductIndex:
+        exaustive_distances = -exaustive_distances
+
+    assert np.array_equal(exaustive_indices, indices[:, ::-1])
+    np.testing.assert_allclose(exaustive_distances, distances[:, ::-1], rtol=1e-04)
+
+    indices_1nn, _ = index.search1NN(queries)
+    assert np.array_equal(indices_1nn, indices[:, -1])
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_iter_neighbors(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 2021
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+    query = np.random.rand(dimension).astype(dtype=np.float32)
+
+    k = 50
+    exaustive_indices, exaustive_distances = exaustive_metric(data, query[np.newaxis], k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+
+    chunks = []
+    for indices, distances in vptree.iter_neighbors(query, chunk_size=7):
+        assert len(indices) == len(distances) <= 7
+        chunks.append((indices, distances))
+        if sum(len(chunk[0]) for chunk in chunks) >= k:
+            break
+
+    indices = np.concatenate([chunk[0] for chunk in chunks])[:k]
+    distances = np.concatenate([chunk[1] for chunk in chunks])[:k]
+    assert np.array_equal(exaustive_indices[0], indices)
+    np.testing.assert_allclose(exaustive_distances[0], distances, rtol=1e-06)
+
+    # iterating to the end yields every point once
+    all_indices = np.concatenate([indices for indices, _ in vptree.iter_neighbors(query, chunk_size=500)])
+    assert np.array_equal(np.sort(all_indices), np.arange(num_points))
+
+    with pytest.raises(ValueError):
+        vptree.iter_neighbors(query, chunk_size=0)
+
+    # rebuilding the index invalidates its iterators
+    neighbors = vptree.iter_neighbors(query)
+    next(neighbors)
+    vptree.set(data)
+    with pytest.raises(RuntimeError):
+        next(neighbors)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_search_radius(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 4
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 23
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+    radii = np.linspace(0.0, 0.2, num_queries).astype(dtype=np.float32)
+
+    metric_func = exaustive_metric.args[0]
+    exaustive_distances = metric_func(queries, data)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    offsets, indices, distances = vptree.searchRadius(queries, radii)
+
+    assert offsets.shape == (num_queries + 1,)
+    for i in range(num_queries):
+        found_indices = indices[offsets[i] : offsets[i + 1]]
+        found_distances = distances[offsets[i] : offsets[i + 1]]
+
+        assert np.array_equal(found_distances, np.sort(found_distances))
+        np.testing.assert_allclose(exaustive_distances[i, found_indices], found_distances, rtol=1e-06)
+
+        # tolerance to distances right at the radius
+        expected = np.nonzero(exaustive_distances[i] <= radii[i] * (1 - 1e-06))[0]
+        assert set(expected) <= set(found_indices)
+        assert np.all(found_distances <= radii[i] * (1 + 1e-06))
+
+    offsets, indices, distances = vptree.searchRadius(queries, 0.1)
+    assert offsets.shape == (num_queries + 1,)
+    assert np.all(distances <= 0.1 * (1 + 1e-06))
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_knn_max_radius(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 4
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 23
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 8
+    max_radius = 0.05
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k, max_radius=max_radius)
+
+    assert vptree_indices.shape == (num_queries, k)
+    for i in range(num_queries):
+        expected = exaustive_distances[i][exaustive_distances[i] <= max_radius]
+        # rows with fewer than k vectors within max_radius start with -1 indices
+        found = vptree_indices[i] >= 0
+        assert np.all(vptree_indices[i][: k - len(expected)] == -1)
+        np.testing.assert_allclose(expected, vptree_distances[i][found][::-1], rtol=1e-06)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_knn_out(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 2021
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 23
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 3
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+
+    indices = np.empty((num_queries, k), dtype=np.int64)
+    distances = np.empty((num_queries, k), dtype=np.float32)
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k, out=(indices, distances))
+    assert vptree_indices is indices
+    assert vptree_distances is distances
+    assert np.array_equal(exaustive_indices, indices[:, ::-1])
+    np.testing.assert_allclose(exaustive_distances, distances[:, ::-1], rtol=1e-06)
+
+    with pytest.raises(ValueError):
+        vptree.searchKNN(queries, k + 1, out=(indices, distances))
+    with pytest.raises(ValueError):
+        vptree.searchKNN(queries, k, out=(indices, distances.astype(np.float64)))
+    with pytest.raises(ValueError):
+        vptree.searchKNN(queries, k, out=(indices, np.asfortranarray(distances)))
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_knn_approx(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 23
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 5
+    epsilon = 0.5
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+
+    # default settings are the exact search
+    vptree_indices, vptree_distances, exact = vptree.searchKNNApprox(queries, k)
+    assert all(exact)
+    assert np.array_equal(exaustive_indices, np.array(vptree_indices, dtype=np.uint64)[:, ::-1])
+
+    vptree_indices, vptree_distances, exact = vptree.searchKNNApprox(queries, k, epsilon=epsilon)
+    vptree_distances = np.array(vptree_distances, dtype=np.float32)[:, ::-1]
+    assert np.all(vptree_distances <= exaustive_distances * (1 + epsilon) * (1 + 1e-06))
+
+    vptree_indices, vptree_distances, exact = vptree.searchKNNApprox(queries, k, max_distance_evaluations=50)
+    assert not any(exact)
+    assert np.all(vptree_indices >= 0)
+
+    vptree_indices, vptree_distances, exact = vptree.searchKNNApprox(queries, k, time_budget=0.0)
+    assert not any(exact)
+
+    vptree_indices, vptree_distances, exact = vptree.searchKNNApprox(queries, k, query_time_budget=60.0)
+    assert all(exact)
+    assert np.array_equal(exaustive_indices, np.array(vptree_indices, dtype=np.uint64)[:, ::-1])
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_knn_filtered(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 21231
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 23
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 4
+    allowed = np.random.rand(num_points) < 0.1
+    allowed_indices = np.nonzero(allowed)[0]
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data[allowed], queries, k)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k, allowed=allowed)
+
+    vptree_indices = np.array(vptree_indices, dtype=np.uint64)[:, ::-1]
+    assert np.array_equal(allowed_indices[exaustive_indices], vptree_indices)
+
+    # per query ranges
+    allowed_ranges = [[(i * 100, i * 100 + 5000)] for i in range(num_queries)]
+    vptree_indices, vptree_distances = vptree.searchKNN(queries, k, allowed_ranges=allowed_ranges)
+    for i in range(num_queries):
+        begin, end = allowed_ranges[i][0]
+        _, expected_distances = exaustive_metric(data[begin:end], queries[i : i + 1], k)
+        assert all(begin <= index < end for index in vptree_indices[i])
+        np.testing.assert_allclose(
+            expected_distances[0], np.array(vptree_distances[i], dtype=np.float32)[::-1], rtol=1e-06
+        )
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_knn_graph(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 5231
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    k = 5
+
+    exaustive_indices, exaustive_distances = exaustive_metric(data, data, k + 1)
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    indices, distances = vptree.knn_graph(k)
+
+    assert indices.shape == (num_points, k)
+    assert distances.shape == (num_points, k)
+    assert not np.any(indices == np.arange(num_points)[:, None])
+    np.testing.assert_allclose(exaustive_distances[:, 1:], distances[:, ::-1], rtol=1e-06)
+
+    indices, distances = vptree.knn_graph(k, exclude_self=False)
+    np.testing.assert_allclose(exaustive_distances[:, :k], distances[:, ::-1], rtol=1e-06)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_num_threads(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 20021
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 101
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 5
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    expected_indices, expected_distances = vptree.searchKNN(queries, k)
+
+    for num_threads, work_stealing in [(1, True), (3, True), (3, False)]:
+        vptree.set_num_threads(num_threads, work_stealing)
+        assert vptree.num_threads() == num_threads
+        for num in [1, 2, num_queries]:
+            indices, distances = vptree.searchKNN(queries[:num], k)
+            assert np.array_equal(expected_indices[:num], indices)
+            assert np.array_equal(expected_distances[:num], distances)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_concurrent_searches(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 20021
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    num_queries = 101
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 5
+
+    vptree = vptree_cls()
+    vptree.set(data)
+    expected_indices, expected_distances = vptree.searchKNN(queries, k)
+
+    # searches release the GIL, so these run at the same time on the same index
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        results = list(executor.map(lambda _: vptree.searchKNN(queries, k), range(16)))
+
+    for indices, distances in results:
+        assert np.array_equal(expected_indices, indices)
+        assert np.array_equal(expected_distances, distances)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_concurrent_set(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 20021
+    dimension = 8
+    datasets = [np.random.rand(num_points, dimension).astype(dtype=np.float32) for _ in range(2)]
+
+    num_queries = 101
+    queries = np.random.rand(num_queries, dimension).astype(dtype=np.float32)
+
+    k = 5
+
+    vptree = vptree_cls()
+    expected = []
+    for data in datasets:
+        vptree.set(data)
+        expected.append(vptree.searchKNN(queries, k))
+
+    # every search answers from one of the datasets, never from a tree being rebuilt
+    def search(_):
+        return vptree.searchKNN(queries, k), vptree.searchKNNDualTree(queries, k), vptree.knn_graph(1)
+
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        futures = [executor.submit(search, i) for i in range(16)]
+        for i in range(8):
+            vptree.set(datasets[i % 2])
+        results = [future.result(timeout=60) for future in futures]
+
+    for knn, dual_tree, graph in results:
+        assert any(
+            np.array_equal(indices, knn[0]) and np.array_equal(distances, knn[1]) for indices, distances in expected
+        )
+        assert any(np.array_equal(distances, dual_tree[1]) for _, distances in expected)
+        assert graph[0].shape == (num_points, 1)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_submit(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 20021
+    dimension = 8
+    data = np.random.rand(num_points, dimension).astype(dtype=np.float32)
+
+    k = 5
+    batches = [np.random.rand(7, dimension).astype(dtype=np.float32) for _ in range(50)]
+
+    vptree = vptree_cls()
+    vptree.set(data)
+
+    futures = [vptree.submit(queries, k) for queries in batches]
+    for queries, future in zip(batches, futures):
+        expected_indices, expected_distances = vptree.searchKNN(queries, k)
+        indices, distances = future.result(timeout=60)
+        assert np.array_equal(expected_indices, indices)
+        assert np.array_equal(expected_distances, distances)
+
+    async def search_all():
+        return await asyncio.gather(*(asyncio.wrap_future(vptree.submit(queries, k)) for queries in batches))
+
+    for queries, (indices, distances) in zip(batches, asyncio.run(search_all())):
+        assert np.array_equal(vptree.searchKNN(queries, k)[0], indices)
+
+    with pytest.raises(RuntimeError):
+        vptree_cls().submit(batches[0], k).result(timeout=60)
+
+
+@pytest.mark.parametrize("vptree_cls, exaustive_metric", CLASSES)
+def test_submit_then_set(vptree_cls, exaustive_metric):
+    np.random.seed(seed=42)
+
+    num_points = 20021
+    dimension = 8
+    datasets = [np.random.rand(num_points, dimension).astype(dtype=np.float32) for _ in range(2)]
+
+    k = 5
+    batches = [np.random.rand(7, dimension).astype(dtype=np.float32) for _ in range(50)]
+
+    vptree = vptree_cls()
+    vptree.set(datasets[1])
+    expected_after = [vptree.searchKNN(queries, k) for queries in batches]
+    vptree.set(datasets[0])
+    expected_before = [vptree.searchKNN(queries, k) for queries in batches]
+
+    # set() waits for the running searches, and every search answers from the vectors indexed when it started
+    futures = [vptree.submit(queries, k) for queries in batches]
+    vptree.set(datasets[1])
+    for before, after, future in zip(expected_before, expected_after, futures):
+        indices, distances = future.result(timeout=60)
+        assert any(
+            np.array_equal(expected_indices, indices) and np.array_equal(expected_distances, distances)
+            for expected_indices, expected_distances in (before, after)
+        )
+
+    for queries, (expected_indices, expected_distances) in zip(batches, expected_after):
+        indices, distances = vptree.submit(queries, k).result(timeout=60)
+        assert np.array_equal(expected_indices, indices)
+        assert np.array_equal(expected_distances, distances)
+
+
+SET_FROM_CALLBACK = """
+import threading
+import numpy as np
+import pynear
+
+np.random.seed(seed=42)
+datasets = [np.random.rand(20021, 8).astype(dtype=np.float32) for _ in range(2)]
+batches = [np.random.rand(7, 8).astype(dtype=np.float32) for _ in range(300)]
+
+vptree = pynear.VPTreeL2Index()
+vptree.set(datasets[0])
+reset = threading.Event()
+
+def reset_index(future):
+    vptree.set(datasets[1])
+    reset.set()
+
+futures = [vptree.submit(queries, 5) for queries in batches[:4]]
+futures[0].add_done_callback(reset_index)
+# more searches than the queue holds, some of them submitted by callbacks
+for future in futures[1:]:
+    future.add_done_callback(lambda _: vptree.submit(batches[0], 5))
+futures += [vptree.submit(queries, 5) for queries in batches[4:]]
+for future in futures:
+    assert future.result(timeout=60)[0].shape == (7, 5)
+assert reset.wait(timeout=60)
+"""
+
+
+def test_submit_callbacks_on_one_worker():
+    # callbacks of the futures run on the worker, which must not wait for the searches pending behind them
+    env = dict(os.environ, PYNEAR_SUBMIT_THREADS="1")
+    subprocess.run([sys.executable, "-c", SET_FROM_CALLBACK], env=env, check=True, timeout=120)
@@ -1,17 +1,23 @@
+import os
 import sys
 
 from pybind11.setup_helpers import Pybind11Extension
 from setuptools import find_packages
 from setuptools import setup
 
+# Distance kernels are compiled for every instruction set and picked at import, so the module
+# runs on any x86-64 CPU. PYNEAR_NATIVE=1 also tunes the rest of the code (e.g. the brute force
+# matrix products) for the building machine, which then is the only one it is guaranteed to run on.
+native = os.environ.get("PYNEAR_NATIVE", "0") == "1"
+
 if sys.platform == "win32":
-    extra_compile_args = ["/Wall", "/arch:AVX", "/openmp"]  # /LTCG unrecognized here
+    extra_compile_args = ["/Wall", "/openmp"] + (["/arch:AVX2"] if native else [])  # /LTCG unrecognized here
     extra_link_args = ["/LTCG"]  # /openmp unrecognized here
 elif sys.platform == "darwin":
-    extra_compile_args = ["-flto", "-Wall", "-march=native", "-mavx", "-fopenmp"]
+    extra_compile_args = ["-flto", "-Wall", "-fopenmp"] + (["-march=native"] if native else [])
     extra_link_args = ["-fopenmp", "-lomp"]
 else:
-    extra_compile_args = ["-flto", "-Wall", "-march=native", "-mavx", "-fopenmp"]
+    extra_compile_args = ["-flto", "-Wall", "-fopenmp"] + (["-march=native"] if native else [])
     extra_link_args = ["-fopenmp", "-lgomp"]
 
 ext_modules = [